@@ -0,0 +1,211 @@
+
+-- synthetic remap workload: short-lived event tables against a long-lived rule set
+
+local EV_KEY = device.type_num("EV_KEY")
+local EV_SYN = device.type_num("EV_SYN")
+
+-- iterations per timer tick, each tick is one Lua call and stays within the time limit
+local BATCH = 5000
+local RULES = 64
+local FRAME = 4
+
+local function new_rules()
+	local rules = {}
+	for i = 1, RULES do
+		local mod = {}
+		for k = 1, i % 3 + 1 do
+			table.insert(mod, 30 + (i + k) % 40)
+		end
+		rules[i] = {mod, {30 + i % 40, 42}, name = "rule" .. i}
+	end
+	return rules
+end
+
+local function run_frame(rules, key_state, seq)
+	local ev_list = {}
+	for i = 1, FRAME - 1 do
+		ev_list[i] = {type = EV_KEY, code = 30 + (seq + i) % 40, value = (seq + i) % 2}
+	end
+	ev_list[FRAME] = {type = EV_SYN, code = 0, value = 0}
+
+	local new_list = {}
+	for _, ev in ipairs(ev_list) do
+		local result = nil
+		if ev.type == EV_KEY then
+			key_state[ev.code] = ev.value > 0
+			for _, rule in ipairs(rules) do
+				local mod, target = rule[1], rule[2]
+				if mod[#mod] == ev.code then
+					local match = true
+					for k = 1, #mod - 1 do
+						if not key_state[mod[k]] then match = false break end
+					end
+					if match then
+						result = {}
+						for _, code in ipairs(target) do
+							table.insert(result, {type = EV_KEY, code = code, value = ev.value})
+						end
+						break
+					end
+				end
+			end
+		end
+		if result then
+			for _, r in ipairs(result) do table.insert(new_list, r) end
+		else
+			table.insert(new_list, ev)
+		end
+	end
+	return #new_list
+end
+
+-- log2 buckets of iteration time in ns, tail latency is dominated by collector steps
+local function percentile(histogram, total, p)
+	local seen = 0
+	for bucket = 0, 63 do
+		seen = seen + (histogram[bucket] or 0)
+		if seen >= total * p then return 2 ^ bucket end
+	end
+	return 0
+end
+
+local function report(stats)
+	local elapsed = stats.stop - stats.start
+	print(string.format("%s", _VERSION))
+	print(string.format("iterations %d events %d time_ms %.1f", stats.count, stats.count * FRAME, elapsed / 1e6))
+	print(string.format("events_per_sec %.0f", stats.count * FRAME / (elapsed / 1e9)))
+	print(string.format("iteration_ns p50<%d p99<%d p999<%d max %d",
+		percentile(stats.histogram, stats.count, 0.5),
+		percentile(stats.histogram, stats.count, 0.99),
+		percentile(stats.histogram, stats.count, 0.999),
+		stats.max))
+	print(string.format("memory_kb %.0f peak_kb %.0f", collectgarbage("count"), stats.peak))
+end
+
+local function main(iterations)
+	local rules = new_rules()
+	local key_state = {}
+	local stats = {count = 0, max = 0, peak = 0, histogram = {}}
+
+	local timer = sys.timer(function(timer)
+		stats.start = stats.start or sys.clock()
+		for _ = 1, BATCH do
+			local t0 = sys.clock()
+			run_frame(rules, key_state, stats.count)
+			local t = sys.clock() - t0
+			local bucket = 0
+			while 2 ^ (bucket + 1) <= t do bucket = bucket + 1 end
+			stats.histogram[bucket] = (stats.histogram[bucket] or 0) + 1
+			if t > stats.max then stats.max = t end
+			stats.count = stats.count + 1
+		end
+		local kb = collectgarbage("count")
+		if kb > stats.peak then stats.peak = kb end
+
+		if stats.count >= iterations then
+			stats.stop = sys.clock()
+			report(stats)
+			sys.exit()
+		else
+			timer:set(0, 1)
+		end
+	end)
+	timer:set(0, 1)
+
+	return function() end
+end
+
+-- the device path without /dev/input: frames into a loopback device, through its handler into another one
+local LOOP_BATCH = 256
+
+local function main_loopback(iterations)
+	local spec = {name = "bench loopback", events = {EV_KEY = true}}
+	local input = device.loopback(spec)
+	local output = device.loopback(spec)
+	local reader = device.open(output:name())
+	local source = device.open(input:name(), function(dev)
+		output:write(dev:read())
+	end)
+	source:monitor(true)
+	local stats = {sent = 0, received = 0}
+
+	local timer = sys.timer(function(timer)
+		stats.start = stats.start or sys.clock()
+		stats.received = stats.received + #reader:read()
+		if stats.sent < iterations then
+			local frames = {}
+			for i = 1, LOOP_BATCH do
+				local seq = stats.sent + i
+				frames[2 * i - 1] = {type = EV_KEY, code = 30, value = seq % 2}
+				frames[2 * i] = {type = EV_SYN, code = 0, value = 0}
+			end
+			input:write(frames)
+			stats.sent = stats.sent + LOOP_BATCH
+		elseif stats.received >= stats.sent * 2 then
+			local elapsed = sys.clock() - stats.start
+			print(string.format("%s", _VERSION))
+			print(string.format("frames %d events %d time_ms %.1f", stats.sent, stats.received, elapsed / 1e6))
+			print(string.format("events_per_sec %.0f", stats.received / (elapsed / 1e9)))
+			print(string.format("drops %d", input:stat().drops + output:stat().drops))
+			sys.exit()
+			return
+		end
+		timer:set(0, 1)
+	end)
+	timer:set(0, 1)
+
+	return function() end
+end
+
+-- a logged device without handler: its queue is dropped, reading and logging must go on past it
+local function main_log(iterations)
+	local spec = {name = "bench log", events = {EV_KEY = true}}
+	local input = device.loopback(spec)
+	local source = device.open(input:name())
+	source:log("/dev/null")
+	source:monitor(true)
+	local stats = {sent = 0, ticks = 0}
+
+	local timer = sys.timer(function(timer)
+		stats.start = stats.start or sys.clock()
+		local logged = source:log().events
+		if stats.sent < iterations then
+			local frames = {}
+			for i = 1, LOOP_BATCH do
+				local seq = stats.sent + i
+				frames[2 * i - 1] = {type = EV_KEY, code = 30, value = seq % 2}
+				frames[2 * i] = {type = EV_SYN, code = 0, value = 0}
+			end
+			input:write(frames)
+			stats.sent = stats.sent + LOOP_BATCH
+		elseif logged >= stats.sent * 2 or stats.ticks > 1000 then
+			local elapsed = sys.clock() - stats.start
+			print(string.format("%s", _VERSION))
+			print(string.format("frames %d events %d logged %d time_ms %.1f", stats.sent, stats.sent * 2, logged,
+				elapsed / 1e6))
+			print(string.format("drops %d", input:stat().drops + source:log().drops))
+			if logged < stats.sent * 2 then
+				print("FAIL: reading stopped before all events were logged")
+			end
+			sys.exit()
+			return
+		else
+			stats.ticks = stats.ticks + 1
+		end
+		timer:set(0, 1)
+	end)
+	timer:set(0, 1)
+
+	return function() end
+end
+
+local module_name, iterations, mode = ...
+
+if module_name == sys.main then
+	if mode == "loopback" then
+		return main_loopback(tonumber(iterations) or 200000)
+	elseif mode == "log" then
+		return main_log(tonumber(iterations) or 200000)
+	end
+	return main(tonumber(iterations) or 200000)
+end
@@ -2,8 +2,38 @@
 return function(match_func, new_func, del_func)
 
 	local device_map = {}
+	-- devices matched with the same group share one sink
+	local group_map = {}
 
-	return function(op, devname)
+	-- a new member brings its capabilities, so the sink of the group is created again
+	local function join_group(group, object)
+		local old_sink, old_name = group.sink, group.sink_name
+		table.insert(group.members, object)
+		group.sink, group.sink_name = object.sink, object.sink_name
+		device_map[group.sink_name] = true
+		for _, member in ipairs(group.members) do
+			if member ~= object then
+				member.sink, member.sink_name = object.sink, object.sink_name
+				member.src:forward(object.sink)
+			end
+		end
+		if old_sink then
+			device_map[old_name] = nil
+			old_sink:close()
+		end
+	end
+
+	local function leave_group(group, object)
+		for i, member in ipairs(group.members) do
+			if member == object then
+				table.remove(group.members, i)
+				break
+			end
+		end
+		return #group.members == 0
+	end
+
+	return function(op, devname, props)
 		if op == "add" then
 			if not device_map[devname] then
 				local dev, udev, udev_name
@@ -11,12 +41,21 @@ return function(match_func, new_func, del_func)
 				local stat, object = pcall(function()
 					dev = device.open(devname)
 					local info = dev:info()
-					local arg = match_func(info, devname)
+					local arg, group_key = match_func(info, devname, dev, props)
 					if not arg then
 						return
 					end
 
-					udev = device.create(dev)
+					local group = group_key and group_map[group_key]
+					if group then
+						local sources = {dev}
+						for _, member in ipairs(group.members) do
+							table.insert(sources, member.src)
+						end
+						udev = device.create(sources)
+					else
+						udev = device.create(dev)
+					end
 					udev_name = udev:name()
 					local object = {
 						info = info,
@@ -24,6 +63,7 @@ return function(match_func, new_func, del_func)
 						src_name = devname,
 						sink = udev,
 						sink_name = udev_name,
+						group = group_key,
 					}
 
 					if new_func then
@@ -33,7 +73,13 @@ return function(match_func, new_func, del_func)
 				end)
 				if stat and object then
 					device_map[devname] = object
-					device_map[udev_name] = object
+					if object.group then
+						local group = group_map[object.group] or {members = {}}
+						group_map[object.group] = group
+						join_group(group, object)
+					else
+						device_map[udev_name] = object
+					end
 					return object
 				end
 				if not stat then
@@ -45,13 +91,26 @@ return function(match_func, new_func, del_func)
 		elseif op == "del" then
 			object = device_map[devname]
 			if type(object) == "table" then
+				local group = object.group and group_map[object.group]
+				local last = true
 				device_map[object.src_name] = nil
-				device_map[object.sink_name] = nil
+				if group then
+					last = leave_group(group, object)
+					if last then group_map[object.group] = nil end
+				end
+				if last then
+					device_map[object.sink_name] = nil
+				else
+					-- the sink stays for the others, keys still down from this member are released
+					object.src:forward()
+				end
 
 				if del_func then
 					pcall(del_func, object)
 				end
-				object.sink:close()
+				if last then
+					object.sink:close()
+				end
 				object.src:close()
 
 				return true
@@ -0,0 +1,41 @@
+
+local function event_text(rec)
+	local typeid = device.type_name(rec.type) or rec.type
+	local code = device.code_name(rec.type, rec.code) or rec.code
+	local value = device.value_name(rec.type, rec.code, rec.value) or rec.value
+	return string.format("%s %s %s", typeid, code, value)
+end
+
+local function record_text(rec)
+	if rec.kind == "read" or rec.kind == "write" then
+		return string.format("fd=%d %s", rec.fd, event_text(rec))
+	elseif rec.kind == "dispatch" then
+		return string.format("fd=%d queued=%d", rec.fd, rec.value)
+	elseif rec.kind == "return" then
+		return string.format("fd=%d rc=%d time_us=%d", rec.fd, rec.value, rec.extra)
+	elseif rec.kind == "hotplug" then
+		return string.format("%s event%d", rec.code == 1 and "add" or "del", rec.value)
+	end
+	return string.format("fd=%d rc=%d", rec.fd, rec.value)
+end
+
+local function main(path)
+	local timer = sys.timer(function() sys.exit() end)
+	timer:set(0, 1)
+
+	local records, dump_time = sys.record_load(path)
+	-- times relative to the dump, the last entries are what happened right before it
+	for _, rec in ipairs(records) do
+		local ms = (rec.time - dump_time) / 1000000
+		print(string.format("%12.3f %-8s %s", ms, rec.kind, record_text(rec)))
+	end
+
+	return function() end
+end
+
+local module_name, path = ...
+
+if module_name == sys.main then
+	-- nil reads the --record file
+	return main(path)
+end
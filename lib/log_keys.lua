@@ -1,26 +1,16 @@
 
-local function main(names)
+local function main(names, options)
 
 	local dev_map = {}
 
-	local function handle_event(dev)
-		local ev_list = dev:read()
-		local name = dev_map[dev]
-		for _, ev in ipairs(ev_list) do
-			local typeid = device.type_name(ev.type) or ev.type
-			local code = device.code_name(ev.type, ev.code) or ev.code
-			local value = device.value_name(ev.type, ev.code, ev.value) or ev.value
-			print(name, typeid, code, value)
-		end
-	end
-
 	return function(op, devname)
 		if names and not names[devname] then
 			return false
 		end
 		if op == "add" then
 			local dev = device.open(devname)
-			dev:handler(handle_event)
+			-- events are formatted and written in C, no handler runs for them
+			dev:log(options.file or "-", options)
 			dev:monitor(true)
 			dev_map[dev] = devname
 			return true
@@ -40,13 +30,25 @@ local module_name = ...
 
 if module_name == sys.main then
 	local names = {}
+	local options = {}
 	local i = 2
 	while true do
 		local name = select(i, ...)
 		if not name then break end
 		i = i + 1
-		names[name] = true
+		-- format=text|json|binary, file=PATH and filter=EV_KEY,REL_WHEEL,... set options
+		local key, value = string.match(name, "^(%w+)=(.*)$")
+		if key == "filter" then
+			options.filter = {}
+			for entry in string.gmatch(value, "[^,]+") do
+				table.insert(options.filter, entry)
+			end
+		elseif key then
+			options[key] = value
+		else
+			names[name] = true
+		end
 	end
 
-	return main(i > 2 and names or nil)
+	return main(next(names) and names or nil, options)
 end
@@ -4,6 +4,15 @@ local print_table = require("print_table")
 local device_manager = require("device_manager")
 
 local EV_KEY = device.type_num("EV_KEY")
+local clock = sys.clock
+local NO_KEYS = {}
+
+local device_map = {}
+-- what rules see and sinks get by default: every key, motion and switches as they are;
+-- scan codes and LED echoes are dropped by the kernel
+local DEFAULT_EVENTS = {"EV_KEY", "EV_REL", "EV_ABS", "EV_SW", "MSC_SERIAL", "MSC_GESTURE", "MSC_RAW", "MSC_TIMESTAMP"}
+-- key state shared by the devices merged into one sink, by config entry
+local merge_state = {}
 
 local function table_join(a, b)
 	return table.move(b, 1, #b, #a + 1, a)
@@ -20,15 +29,6 @@ local function table_reverse(t)
 	return t
 end
 
-local KeyParser = {
-	__index = function(self, key)
-		local code, _ = device.code_num(self.prefix .. key)
-		if not code then error("unknown key " .. key) end
-		rawset(self, key, code)
-		return code
-	end
-}
-
 local function load_config(config_file)
 	return require(config_file)
 end
@@ -74,14 +74,38 @@ local function default_handler(ev, target, rule)
 	return result
 end
 
-local function remap_keys(dev, rules, key_state, ev)
+-- per device and per rule counters, handler time in ns
+local function new_stats(count)
+	local stats = {evals = {}, calls = {}, hits = {}, time = {}}
+	for i = 1, count do
+		stats.evals[i] = 0
+		stats.calls[i] = 0
+		stats.hits[i] = 0
+		stats.time[i] = 0
+	end
+	return stats
+end
+
+local function call_handler(stats, i, handler, arg, key_state, rule, dev)
+	local start = clock()
+	local result = handler(arg, key_state, rule, dev)
+	stats.time[i] = stats.time[i] + (clock() - start)
+	stats.calls[i] = stats.calls[i] + 1
+	if result then stats.hits[i] = stats.hits[i] + 1 end
+	return result
+end
+
+local function remap_keys(dev, rules, key_state, ev, stats)
 	local key_down = (ev.value > 0)
 	key_state[ev.code] = key_down
 
 	for i, rule in ipairs(rules) do
 		local mod, handler = table.unpack(rule)
 		local is_func = (type(handler) == "function")
+		-- a macro plays on the sink, the trigger keys are handled as for an empty target
+		local is_macro = (type(handler) == "userdata")
 		local arg = nil
+		stats.evals[i] = stats.evals[i] + 1
 
 		if key_down then
 			if not is_func then
@@ -103,40 +127,64 @@ local function remap_keys(dev, rules, key_state, ev)
 		end
 
 		if is_func then
-			local result = handler(arg, key_state, rule, dev)
+			local result = call_handler(stats, i, handler, arg, key_state, rule, dev)
 			if result then return result end
 		else
-			return default_handler(ev, handler, rule)
+			local result = default_handler(ev, is_macro and NO_KEYS or handler, rule)
+			if is_macro and result and rule.active then
+				device_map[dev].sink:play(handler)
+			end
+			stats.calls[i] = stats.calls[i] + 1
+			if result then stats.hits[i] = stats.hits[i] + 1 end
+			return result
 		end
 
 	::_continue::
 	end
 end
 
-local function remap_custom(dev, rules, key_state, ev)
+local function remap_custom(dev, rules, key_state, ev, stats)
 	for i, rule in ipairs(rules) do
 		local mod, handler = table.unpack(rule)
 		if type(handler) ~= "function" then goto _continue end
+		stats.evals[i] = stats.evals[i] + 1
 
 		for _, k in ipairs(mod) do
 			if not key_state[k] then goto _continue end
 		end
 
-		local result = handler(ev, key_state, rule, dev)
+		local result = call_handler(stats, i, handler, ev, key_state, rule, dev)
 		if result then return result end
 
 	::_continue::
 	end
 end
 
-local function remap(dev, rules, key_state, ev_list)
+-- events[first..last] is either an array of tables or an FFI event array,
+-- missed holds the keys of this device whose press was only seen in a resync
+local function remap(dev, rules, key_state, missed, events, first, last, resync, stats)
 	local new_list = {}
-	for _, ev in ipairs(ev_list) do
+	for i = first, last do
+		local ev = events[i]
 		local result = nil
-		if ev.type == EV_KEY then
-			result = remap_keys(dev, rules, key_state, ev)
+		if resync and ev.type == EV_KEY and ev.value > 0 then
+			-- presses missed while events were dropped only update the state,
+			-- firing their rules late would do more harm than good
+			key_state[ev.code] = true
+			missed[ev.code] = true
+			result = {}
+		elseif ev.type == EV_KEY and missed[ev.code] then
+			-- neither the sink nor the rules saw the press, so its repeats and
+			-- release go nowhere either
+			if ev.value == 0 then
+				key_state[ev.code] = false
+				missed[ev.code] = nil
+			end
+			result = {}
+		elseif ev.type == EV_KEY then
+			result = remap_keys(dev, rules, key_state, ev, stats)
 		else
-			result = remap_custom(dev, rules, key_state, ev)
+			result = remap_custom(dev, rules, key_state, ev, stats)
 		end
 		if result then
 			new_list = table_join(new_list, result)
@@ -148,17 +196,73 @@ local function remap(dev, rules, key_state, ev_list)
 end
 
 
-local device_map = {}
-
 local function handle_event(dev)
 	local rec = device_map[dev]
 	if not rec then return end
-	local ev_list = dev:read()
-	ev_list = remap(dev, rec.rules, rec.key_state, ev_list)
+	local ev_list
+	if dev.events then
+		-- LuaJIT build, events stay in C memory
+		local events, count, resync = dev:events()
+		ev_list = remap(dev, rec.rules, rec.key_state, rec.missed, events, 0, count - 1, resync, rec.stats)
+	else
+		local events = dev:read()
+		ev_list = remap(dev, rec.rules, rec.key_state, rec.missed, events, 1, #events, events.resync, rec.stats)
+	end
 	rec.sink:write(ev_list)
 end
 
-local function match_dev(config, info)
+local function rule_label(rule)
+	local mod, handler = table.unpack(rule)
+	local keys = {}
+	for _, k in ipairs(mod) do
+		table.insert(keys, type(k) == "number" and (device.code_name(EV_KEY, k) or k) or tostring(k))
+	end
+	local label = #keys > 0 and table.concat(keys, "+") or "*"
+	if type(handler) == "function" then
+		return label .. " => function"
+	elseif type(handler) == "userdata" then
+		return label .. " => macro"
+	end
+	return label
+end
+
+-- prints per rule counters of all mapped devices, and returns them as records
+local function report(reset)
+	local records = {}
+	for _, rec in pairs(device_map) do
+		local stats = rec.stats
+		for i, rule in ipairs(rec.rules) do
+			local record = {
+				device = rec.src_name,
+				rule = i,
+				label = rule_label(rule),
+				evals = stats.evals[i],
+				calls = stats.calls[i],
+				hits = stats.hits[i],
+				time = stats.time[i],
+			}
+			table.insert(records, record)
+			print(string.format("remap %s rule=%d evals=%d calls=%d hits=%d time_ns=%d %s",
+				record.device, i, record.evals, record.calls, record.hits, record.time, record.label))
+		end
+		if reset then rec.stats = new_stats(#rec.rules) end
+	end
+	return records
+end
+
+-- kernel event mask of a device, nil to leave everything through
+local function event_mask(rules)
+	if rules.events == false then return nil end
+	local events = rules.events or DEFAULT_EVENTS
+	local mask = table.move(events, 1, #events, 1, {})
+	-- routed events skip the rules, they must come in all the same
+	for _, route in ipairs(rules.route or {}) do
+		table.move(route, 2, #route, #mask + 1, mask)
+	end
+	return mask
+end
+
+local function match_dev(config, info, props)
 	for _, entry in ipairs(config) do
 		local match, rules = table.unpack(entry)
 		if type(match) ~= "function" then
@@ -169,11 +273,16 @@ local function match_dev(config, info)
 					goto _continue
 				end
 			end
-		elseif not match(info) then
+		elseif not match(info, props) then
 			goto _continue
 		end
 		if true then
-			return table.pack(table.unpack(rules))
+			local result = table.pack(table.unpack(rules))
+			-- named fields configure native stages of the device
+			for k, v in pairs(rules) do
+				if type(k) == "string" then result[k] = v end
+			end
+			return result, rules
 		end
 
 	::_continue::
@@ -183,25 +292,60 @@ end
 local function main(config_file)
 	local config = load_config(config_file)
 
+	if config.report then
+		local report_timer = sys.timer(function(timer)
+			timer:set(config.report)
+			report()
+		end)
+		report_timer:set(config.report)
+	end
+
 	return device_manager(
 		-- match function
-		function (info) return match_dev(config, info) end,
+		function (info, devname, dev, props)
+			local rules, entry = match_dev(config, info, props)
+			-- native stages must be set before the sink is cloned from the device
+			if rules and rules.abs then dev:abs(rules.abs) end
+			if rules and rules.pointer then dev:pointer(rules.pointer) end
+			if rules and rules.route then dev:route(rules.route) end
+			-- devices of a merged entry share one sink
+			return rules, rules and rules.merge and entry or nil
+		end,
 		-- new function
 		function(rec, rules)
 			local dev = rec.src
 			print("new mapping", rec.src_name, "=>", rec.sink_name)
 
 			dev:handler(handle_event)
+			dev:forward(rec.sink)
+			-- false lifts a mask an fd handed over by a restart may still have;
+			-- kernels before 4.4 have no masks, everything keeps coming then
+			local mask = event_mask(rules)
+			local ok, err = pcall(dev.mask, dev, mask or false)
+			if not ok and mask then print("no event mask", rec.src_name, err) end
 			dev:grab(true)
 			dev:monitor(true)
 			rec.rules = rules
-			rec.key_state = {}
+			if rec.group then
+				merge_state[rec.group] = merge_state[rec.group] or {}
+				rec.key_state = merge_state[rec.group]
+			else
+				rec.key_state = {}
+			end
+			rec.missed = {}
+			rec.stats = new_stats(#rules)
 			device_map[dev] = rec
 		end,
 		-- del function
 		function(rec)
 			print("del mapping", rec.src_name, "=>", rec.sink_name)
 			device_map[rec.src] = nil
+			if rec.group then
+				for _, other in pairs(device_map) do
+					if other.group == rec.group then return end
+				end
+				merge_state[rec.group] = nil
+			end
 		end
 	)
 end
@@ -209,8 +353,7 @@ end
 
 if module_name == sys.main then
 	-- global objects
-	KEY = setmetatable({prefix = "KEY_"}, KeyParser)
-	BTN = setmetatable({prefix = "BTN_"}, KeyParser)
+	remap_report = report
 
 	return main(config_file)
 end
@@ -0,0 +1,165 @@
+#include "abs_engine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <linux/input.h>
+
+struct abs_engine_t *abs_engine_create(void)
+{
+	return (struct abs_engine_t *)calloc(1, sizeof(struct abs_engine_t));
+}
+
+void abs_engine_destroy(struct abs_engine_t *engine)
+{
+	if (engine == NULL)
+		return;
+	for (unsigned i = 0; i < ABS_CNT; i++)
+		free(engine->axis[i]);
+	free(engine);
+}
+
+void abs_axis_init(struct abs_axis_t *axis, const struct input_absinfo *in, const struct input_absinfo *out, int deadzone)
+{
+	int32_t half = (in->maximum - in->minimum) / 2;
+	int32_t out_half = (out->maximum - out->minimum) / 2;
+	if (half < 1)
+		half = 1;
+
+	axis->center = in->minimum + half;
+	axis->scale = (int32_t)(((int64_t)ABS_NORM_MAX << 16) / half);
+
+	if (deadzone < 0)
+		deadzone = 0;
+	axis->deadzone = (int32_t)(((int64_t)deadzone * axis->scale) >> 16);
+	if (axis->deadzone >= ABS_NORM_MAX)
+		axis->deadzone = ABS_NORM_MAX - 1;
+	axis->dz_scale = (int32_t)((((int64_t)ABS_NORM_MAX << 16) + ABS_NORM_MAX - axis->deadzone - 1) / (ABS_NORM_MAX - axis->deadzone));
+
+	axis->out_center = out->minimum + out_half;
+	axis->out_scale = (int32_t)((((int64_t)out_half << 16) + ABS_NORM_MAX / 2) / ABS_NORM_MAX);
+	axis->out_last = INT32_MIN;
+	axis->key_state = 0;
+}
+
+void abs_axis_set_curve(struct abs_axis_t *axis, const int16_t *points, unsigned count)
+{
+	if (count < 2) {
+		axis->flags &= ~ABS_AXIS_CURVE;
+		return;
+	}
+	// resample evenly spaced points over [0, ABS_NORM_MAX] into the lookup table
+	for (unsigned i = 0; i < ABS_CURVE_SIZE; i++) {
+		int64_t x = (int64_t)(i << ABS_CURVE_SHIFT) * (count - 1);
+		unsigned index = (unsigned)(x / ABS_NORM_MAX);
+		int64_t frac = x % ABS_NORM_MAX;
+		int32_t y;
+		if (index >= count - 1) {
+			y = points[count - 1];
+		} else {
+			y = points[index] + (int32_t)((points[index + 1] - points[index]) * frac / ABS_NORM_MAX);
+		}
+		axis->curve[i] = (int16_t)(y < 0 ? 0 : (y > ABS_NORM_MAX ? ABS_NORM_MAX : y));
+	}
+	axis->flags |= ABS_AXIS_CURVE;
+}
+
+void abs_axis_set_keys(struct abs_axis_t *axis, int key_low, int key_high, int press, int release)
+{
+	axis->key_low = (uint16_t)key_low;
+	axis->key_high = (uint16_t)key_high;
+	axis->press = press;
+	axis->release = release < press ? release : press;
+	axis->key_state = 0;
+	if (key_low || key_high)
+		axis->flags |= ABS_AXIS_KEYS;
+	else
+		axis->flags &= ~ABS_AXIS_KEYS;
+}
+
+static inline void abs_set_event(struct input_event *out, const struct input_event *ev, int type, int code, int value)
+{
+	out->time = ev->time;
+	out->type = type;
+	out->code = code;
+	out->value = value;
+}
+
+static int abs_axis_keys(struct abs_axis_t *axis, int32_t v, const struct input_event *ev, struct input_event *out)
+{
+	int n = 0;
+	int state;
+
+	// hysteresis: pressing needs the press threshold, releasing happens below the release threshold
+	if (v >= axis->press)
+		state = 1;
+	else if (v <= -axis->press)
+		state = -1;
+	else if (axis->key_state > 0 && v > axis->release)
+		state = 1;
+	else if (axis->key_state < 0 && v < -axis->release)
+		state = -1;
+	else
+		state = 0;
+
+	if (state == axis->key_state)
+		return 0;
+
+	if (axis->key_state) {
+		int key = axis->key_state > 0 ? axis->key_high : axis->key_low;
+		if (key)
+			abs_set_event(out + n++, ev, EV_KEY, key, 0);
+	}
+	if (state) {
+		int key = state > 0 ? axis->key_high : axis->key_low;
+		if (key)
+			abs_set_event(out + n++, ev, EV_KEY, key, 1);
+	}
+	axis->key_state = (int8_t)state;
+	return n;
+}
+
+int abs_engine_process(struct abs_engine_t *engine, const struct input_event *ev, struct input_event *out)
+{
+	int n = 0;
+	int32_t v, mag;
+	int64_t wide;
+	struct abs_axis_t *axis = engine->axis[ev->code];
+
+	// widen before subtracting: value and center may sit at opposite ends of int32_t
+	wide = (((int64_t)ev->value - axis->center) * axis->scale) >> 16;
+	if (wide > ABS_NORM_MAX)
+		wide = ABS_NORM_MAX;
+	else if (wide < -ABS_NORM_MAX)
+		wide = -ABS_NORM_MAX;
+	v = (int32_t)wide;
+	mag = v < 0 ? -v : v;
+
+	if (mag <= axis->deadzone) {
+		mag = 0;
+	} else if (axis->deadzone) {
+		mag = (int32_t)(((int64_t)(mag - axis->deadzone) * axis->dz_scale) >> 16);
+		if (mag > ABS_NORM_MAX)
+			mag = ABS_NORM_MAX;
+	}
+
+	if (mag && (axis->flags & ABS_AXIS_CURVE)) {
+		unsigned index = (unsigned)mag >> ABS_CURVE_SHIFT;
+		int32_t frac = mag & ((1 << ABS_CURVE_SHIFT) - 1);
+		int32_t y0 = axis->curve[index];
+		int32_t y1 = axis->curve[index + 1];
+		mag = y0 + (((y1 - y0) * frac) >> ABS_CURVE_SHIFT);
+	}
+
+	v = ((v < 0) != !!(axis->flags & ABS_AXIS_INVERT)) ? -mag : mag;
+
+	if (axis->flags & ABS_AXIS_KEYS)
+		n = abs_axis_keys(axis, v, ev, out);
+
+	if (axis->flags & ABS_AXIS_OUTPUT) {
+		int32_t value = axis->out_center + (int32_t)(((int64_t)v * axis->out_scale + 0x8000) >> 16);
+		if (value != axis->out_last) {
+			abs_set_event(out + n++, ev, EV_ABS, axis->out_code, value);
+			axis->out_last = value;
+		}
+	}
+	return n;
+}
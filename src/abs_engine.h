@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <linux/input-event-codes.h>
+
+struct input_event;
+struct input_absinfo;
+
+// normalized axis range is [-ABS_NORM_MAX, ABS_NORM_MAX]
+#define ABS_NORM_MAX 0x7fff
+// response curve lookup table, one point every 1024 normalized units
+#define ABS_CURVE_SHIFT 10
+#define ABS_CURVE_SIZE ((ABS_NORM_MAX >> ABS_CURVE_SHIFT) + 2)
+// at most one axis event and two key transitions per input event
+#define ABS_OUTPUT_MAX 3
+
+enum {
+	ABS_AXIS_OUTPUT = 1,
+	ABS_AXIS_KEYS = 2,
+	ABS_AXIS_CURVE = 4,
+	ABS_AXIS_INVERT = 8,
+};
+
+struct abs_axis_t {
+	int32_t center;
+	int32_t scale;		// raw to normalized, Q16
+	int32_t deadzone;	// normalized
+	int32_t dz_scale;	// deadzone rescale, Q16
+	int32_t out_center;
+	int32_t out_scale;	// normalized to output, Q16
+	int32_t out_last;
+	int32_t press;		// key thresholds, normalized
+	int32_t release;
+	uint16_t out_code;
+	uint16_t key_low;
+	uint16_t key_high;
+	uint8_t flags;
+	int8_t key_state;
+	int16_t curve[ABS_CURVE_SIZE];
+};
+
+struct abs_engine_t {
+	struct abs_axis_t *axis[ABS_CNT];
+};
+
+struct abs_engine_t *abs_engine_create(void);
+void abs_engine_destroy(struct abs_engine_t *engine);
+void abs_axis_init(struct abs_axis_t *axis, const struct input_absinfo *in, const struct input_absinfo *out, int deadzone);
+void abs_axis_set_curve(struct abs_axis_t *axis, const int16_t *points, unsigned count);
+void abs_axis_set_keys(struct abs_axis_t *axis, int key_low, int key_high, int press, int release);
+int abs_engine_process(struct abs_engine_t *engine, const struct input_event *ev, struct input_event *out);
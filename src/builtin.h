@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+
+// lib/*.lua precompiled at build time by the embed tool, see builtin.c
+struct builtin_module_t {
+	// module name, the file name without .lua
+	const char *name;
+	const unsigned char *chunk;
+	size_t size;
+};
+
+// ends with a NULL name
+extern const struct builtin_module_t builtin_module[];
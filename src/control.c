@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "poll_group.h"
+
+#define CONTROL_MAX_ARGS 8
+
+int control_init(struct control_t *control, const char *path, struct poll_group_t *poll_group)
+{
+	int rc;
+	mode_t mask;
+	struct stat statbuf;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	// replace stale socket from previous run
+	if (lstat(path, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode))
+		unlink(path);
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->fd < 0)
+		return errno;
+	// commands run as the daemon, such as record writing a file anywhere: owner only, 0600
+	mask = umask(0177);
+	rc = bind(control->fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc < 0 || listen(control->fd, CONTROL_MAX_CLIENTS) < 0) {
+		rc = errno;
+		goto err;
+	}
+	control->reply = malloc(CONTROL_REPLY_SIZE);
+	if (control->reply == NULL) {
+		rc = ENOMEM;
+		goto err_unlink;
+	}
+	rc = poll_group_add(poll_group, control->fd);
+	if (rc != 0) {
+		free(control->reply);
+		goto err_unlink;
+	}
+	control->poll_group = poll_group;
+	for (unsigned i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		control->client[i].fd = -1;
+	return 0;
+err_unlink:
+	unlink(path);
+err:
+	close(control->fd);
+	return rc;
+}
+
+static void control_drop(struct control_t *control, struct control_client_t *client)
+{
+	poll_group_del(control->poll_group, client->fd);
+	close(client->fd);
+	client->fd = -1;
+	client->length = 0;
+}
+
+void control_cleanup(struct control_t *control)
+{
+	struct sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+
+	for (unsigned i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control->client[i].fd >= 0)
+			control_drop(control, control->client + i);
+	}
+	if (getsockname(control->fd, (struct sockaddr *)&addr, &len) == 0 && len > sizeof(addr.sun_family))
+		unlink(addr.sun_path);
+	poll_group_del(control->poll_group, control->fd);
+	close(control->fd);
+	free(control->reply);
+}
+
+int control_owns(const struct control_t *control, int fd)
+{
+	if (fd == control->fd)
+		return 1;
+	for (unsigned i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control->client[i].fd == fd)
+			return 1;
+	}
+	return 0;
+}
+
+static void control_accept(struct control_t *control)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fd = accept4(control->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	// in case the socket was made accessible to others after all
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || (cred.uid != 0 && cred.uid != geteuid())) {
+		close(fd);
+		return;
+	}
+	for (unsigned i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control->client[i].fd < 0) {
+			if (poll_group_add(control->poll_group, fd) != 0)
+				break;
+			control->client[i].fd = fd;
+			control->client[i].length = 0;
+			return;
+		}
+	}
+	// too many clients
+	close(fd);
+}
+
+static int control_command(struct control_t *control, struct control_client_t *client, char *line, control_handler_t handler, void *arg)
+{
+	int argc = 0;
+	char *argv[CONTROL_MAX_ARGS + 1];
+	char *saveptr = NULL;
+	char *word;
+	FILE *out;
+	long length;
+
+	for (word = strtok_r(line, " \t\r", &saveptr); word && argc < CONTROL_MAX_ARGS; word = strtok_r(NULL, " \t\r", &saveptr))
+		argv[argc++] = word;
+	argv[argc] = NULL;
+	if (argc == 0)
+		return 0;
+
+	out = fmemopen(control->reply, CONTROL_REPLY_SIZE, "w");
+	if (out == NULL)
+		return errno;
+	if (handler(arg, argc, argv, out) != 0)
+		fprintf(out, "error\n");
+	// an empty line ends every reply
+	fputc('\n', out);
+	fflush(out);
+	length = ftell(out);
+	fclose(out);
+
+	// replies never block the loop, a client that cannot take one is dropped
+	if (length > 0 && write(client->fd, control->reply, length) != length)
+		return EAGAIN;
+	return 0;
+}
+
+int control_handle(struct control_t *control, int fd, control_handler_t handler, void *arg)
+{
+	ssize_t len;
+	char *line, *end;
+	struct control_client_t *client = NULL;
+
+	if (fd == control->fd) {
+		control_accept(control);
+		return 0;
+	}
+	for (unsigned i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control->client[i].fd == fd)
+			client = control->client + i;
+	}
+	if (client == NULL)
+		return EINVAL;
+
+	len = read(fd, client->line + client->length, CONTROL_LINE_SIZE - client->length);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (len <= 0) {
+		control_drop(control, client);
+		return 0;
+	}
+	client->length += len;
+
+	line = client->line;
+	while ((end = memchr(line, '\n', client->line + client->length - line)) != NULL) {
+		*end = 0;
+		if (control_command(control, client, line, handler, arg) != 0) {
+			control_drop(control, client);
+			return 0;
+		}
+		line = end + 1;
+	}
+	client->length -= line - client->line;
+	memmove(client->line, line, client->length);
+
+	// line too long
+	if (client->length == CONTROL_LINE_SIZE)
+		control_drop(control, client);
+	return 0;
+}
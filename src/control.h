@@ -0,0 +1,29 @@
+#pragma once
+#include <stdio.h>
+
+struct poll_group_t;
+
+#define CONTROL_MAX_CLIENTS 4
+#define CONTROL_LINE_SIZE 256
+#define CONTROL_REPLY_SIZE 0x4000
+
+struct control_client_t {
+	int fd;
+	unsigned length;
+	char line[CONTROL_LINE_SIZE];
+};
+
+struct control_t {
+	int fd;
+	struct poll_group_t *poll_group;
+	char *reply;
+	struct control_client_t client[CONTROL_MAX_CLIENTS];
+};
+
+// called with one command line split into words, writes the reply to out
+typedef int (*control_handler_t)(void *arg, int argc, char **argv, FILE *out);
+
+int control_init(struct control_t *control, const char *path, struct poll_group_t *poll_group);
+void control_cleanup(struct control_t *control);
+int control_owns(const struct control_t *control, int fd);
+int control_handle(struct control_t *control, int fd, control_handler_t handler, void *arg);
@@ -0,0 +1,106 @@
+/*
+ * Build tool, prints the Lua modules given on the command line as C arrays of precompiled
+ * chunks. It links against the Lua lukeymap is built with, so the bytecode matches it.
+ */
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define NAME_SIZE 64
+
+static int chunk_writer(struct lua_State *ls, const void *p, size_t size, void *data)
+{
+	const unsigned char *byte = (const unsigned char *)p;
+	size_t *column = (size_t *)data;
+	for (size_t i = 0; i < size; i++, (*column)++)
+		printf("%s0x%02x,", (*column % 16) ? " " : "\n\t", byte[i]);
+	return 0;
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+	long len;
+	char *buf = NULL;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		return NULL;
+	if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		buf = (char *)malloc(len + 1);
+		if (buf && fread(buf, 1, len, fp) != (size_t)len) {
+			free(buf);
+			buf = NULL;
+		}
+		*size = len;
+	}
+	fclose(fp);
+	return buf;
+}
+
+// "../lib/remap.lua" is module "remap"
+static int module_name(const char *path, char *name)
+{
+	const char *base = strrchr(path, '/');
+	size_t len;
+	base = base ? base + 1 : path;
+	len = strlen(base);
+	if (len <= 4 || len - 4 >= NAME_SIZE || 0 != strcmp(base + len - 4, ".lua"))
+		return EINVAL;
+	memcpy(name, base, len - 4);
+	name[len - 4] = 0;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct lua_State *ls = luaL_newstate();
+	char name[NAME_SIZE];
+	char chunkname[NAME_SIZE + 8];
+
+	if (ls == NULL)
+		return 1;
+	printf("// generated by embed from lib/*.lua, do not edit\n#include \"builtin.h\"\n");
+	for (int i = 1; i < argc; i++) {
+		size_t size;
+		size_t column = 0;
+		char *source;
+
+		if (module_name(argv[i], name) != 0) {
+			fprintf(stderr, "%s: not a Lua module\n", argv[i]);
+			return 1;
+		}
+		source = read_file(argv[i], &size);
+		if (source == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		// the same source name as when loaded from the working directory
+		snprintf(chunkname, sizeof(chunkname), "@%s.lua", name);
+		if (luaL_loadbufferx(ls, source, size, chunkname, "t") != 0) {
+			fprintf(stderr, "%s\n", lua_tostring(ls, -1));
+			return 1;
+		}
+		free(source);
+		printf("\nstatic const unsigned char chunk_%d[] = {", i);
+		// debug information is kept for error messages and the profiler
+#if LUA_VERSION_NUM == 501
+		lua_dump(ls, chunk_writer, &column);
+#else
+		lua_dump(ls, chunk_writer, &column, 0);
+#endif
+		printf("\n};\n");
+		lua_pop(ls, 1);
+	}
+
+	printf("\nconst struct builtin_module_t builtin_module[] = {\n");
+	for (int i = 1; i < argc; i++) {
+		module_name(argv[i], name);
+		printf("\t{\"%s\", chunk_%d, sizeof(chunk_%d)},\n", name, i, i);
+	}
+	printf("\t{NULL, NULL, 0}\n};\n");
+	lua_close(ls);
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include "event_log.h"
+#include "event_names.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// device names are node names, this only bounds them
+#define EVENT_LOG_NAME_MAX 64
+
+struct event_log_t *event_log_create(const char *path, int format)
+{
+	struct event_log_t *log;
+	int fd;
+
+	if (0 == strcmp(path, "-")) {
+		// a description of our own, O_NONBLOCK on the inherited one would be seen by others
+		fd = open("/proc/self/fd/1", O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+	}
+	if (fd < 0)
+		return NULL;
+	log = (struct event_log_t *)calloc(1, sizeof(struct event_log_t));
+	if (log == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	log->fd = fd;
+	log->format = format;
+	return log;
+}
+
+void event_log_destroy(struct event_log_t *log)
+{
+	if (log == NULL)
+		return;
+	event_log_flush(log);
+	close(log->fd);
+	free(log);
+}
+
+int event_log_filter(struct event_log_t *log, int type, int code)
+{
+	if (type < 0 || type >= EV_CNT || code >= KEY_CNT)
+		return EINVAL;
+	log->filtered = 1;
+	if (code < 0)
+		log->types |= 1u << type;
+	else
+		log->code[type][code / 8] |= 1u << (code % 8);
+	return 0;
+}
+
+static inline int event_log_match(const struct event_log_t *log, const struct input_event *ev)
+{
+	if (ev->type >= EV_CNT)
+		return 0;
+	if (log->types & (1u << ev->type))
+		return 1;
+	return ev->code < KEY_CNT && (log->code[ev->type][ev->code / 8] & (1u << (ev->code % 8)));
+}
+
+static inline char *put_str(char *p, const char *s)
+{
+	size_t len = strlen(s);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static inline char *put_name(char *p, const char *s)
+{
+	size_t len = strnlen(s, EVENT_LOG_NAME_MAX);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static char *put_uint(char *p, uint64_t value, unsigned width)
+{
+	char digit[20];
+	unsigned n = 0;
+	do {
+		digit[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value || n < width);
+	while (n)
+		*p++ = digit[--n];
+	return p;
+}
+
+static inline char *put_int(char *p, int64_t value)
+{
+	if (value < 0) {
+		*p++ = '-';
+		return put_uint(p, -(uint64_t)value, 0);
+	}
+	return put_uint(p, value, 0);
+}
+
+// the name if there is one, the number otherwise, quoted in JSON only as a name
+static inline char *put_type(char *p, const struct input_event *ev, int quote)
+{
+	const char *name = event_type_name(ev->type);
+	if (name == NULL)
+		return put_uint(p, ev->type, 0);
+	if (quote)
+		*p++ = '"';
+	p = put_str(p, name);
+	if (quote)
+		*p++ = '"';
+	return p;
+}
+
+static inline char *put_code(char *p, const struct input_event *ev, int quote)
+{
+	const char *name = event_code_name(ev->type, ev->code);
+	if (name == NULL)
+		return put_uint(p, ev->code, 0);
+	if (quote)
+		*p++ = '"';
+	p = put_str(p, name);
+	if (quote)
+		*p++ = '"';
+	return p;
+}
+
+// time in s.us, tab separated as log_keys printed them
+static char *format_text(char *p, const char *dev_name, const struct input_event *ev)
+{
+	p = put_uint(p, ev->input_event_sec, 0);
+	*p++ = '.';
+	p = put_uint(p, ev->input_event_usec, 6);
+	*p++ = '\t';
+	p = put_name(p, dev_name);
+	*p++ = '\t';
+	p = put_type(p, ev, 0);
+	*p++ = '\t';
+	p = put_code(p, ev, 0);
+	*p++ = '\t';
+	p = put_int(p, ev->value);
+	*p++ = '\n';
+	return p;
+}
+
+// time in ns as ev.time in Lua
+static char *format_json(char *p, const char *dev_name, const struct input_event *ev)
+{
+	p = put_str(p, "{\"time\":");
+	p = put_uint(p, (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000, 0);
+	p = put_str(p, ",\"device\":\"");
+	p = put_name(p, dev_name);
+	p = put_str(p, "\",\"type\":");
+	p = put_type(p, ev, 1);
+	p = put_str(p, ",\"code\":");
+	p = put_code(p, ev, 1);
+	p = put_str(p, ",\"value\":");
+	p = put_int(p, ev->value);
+	p = put_str(p, "}\n");
+	return p;
+}
+
+void event_log_event(struct event_log_t *log, const char *dev_name, const struct input_event *ev)
+{
+	char *p;
+
+	if (log->filtered && !event_log_match(log, ev))
+		return;
+	if (EVENT_LOG_BUFFER_SIZE - log->len < EVENT_LOG_LINE_MAX) {
+		event_log_flush(log);
+		if (EVENT_LOG_BUFFER_SIZE - log->len < EVENT_LOG_LINE_MAX) {
+			log->drops++;
+			return;
+		}
+	}
+	p = log->buffer + log->len;
+	switch (log->format) {
+	case EVENT_LOG_BINARY:
+		memcpy(p, ev, sizeof(struct input_event));
+		p += sizeof(struct input_event);
+		break;
+	case EVENT_LOG_JSON:
+		p = format_json(p, dev_name, ev);
+		break;
+	default:
+		p = format_text(p, dev_name, ev);
+		break;
+	}
+	log->len = p - log->buffer;
+	log->events++;
+}
+
+int event_log_flush(struct event_log_t *log)
+{
+	ssize_t n;
+
+	if (log->len == 0)
+		return 0;
+	do {
+		n = write(log->fd, log->buffer, log->len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno == EAGAIN)
+			return EAGAIN;
+		// a reader gone away, or a full disk, the buffer is lost
+		log->write_errors++;
+		log->len = 0;
+		return errno;
+	}
+	log->writes++;
+	log->bytes += n;
+	// the rest goes with the next flush, lines and records stay whole in the output
+	if ((unsigned)n < log->len) {
+		memmove(log->buffer, log->buffer + n, log->len - n);
+		log->len -= n;
+		return EAGAIN;
+	}
+	log->len = 0;
+	return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <linux/input.h>
+
+#define EVENT_LOG_BUFFER_SIZE (64 * 1024)
+// room left for one event in any format, names included
+#define EVENT_LOG_LINE_MAX 256
+
+enum {
+	EVENT_LOG_TEXT = 0,
+	EVENT_LOG_JSON = 1,
+	EVENT_LOG_BINARY = 2,
+};
+
+/*
+ * Formats the events read from a device into a buffer written once per wakeup. The fd is
+ * non-blocking: when its reader falls behind, events are dropped instead of stalling input.
+ */
+struct event_log_t {
+	int fd;
+	int format;
+	// only types and codes set below are logged when filtered
+	int filtered;
+	uint32_t types;
+	uint64_t events;
+	uint64_t drops;
+	uint64_t writes;
+	uint64_t write_errors;
+	uint64_t bytes;
+	unsigned len;
+	uint8_t code[EV_CNT][KEY_CNT / 8];
+	char buffer[EVENT_LOG_BUFFER_SIZE];
+};
+
+// path "-" is standard output, returns NULL with errno set
+struct event_log_t *event_log_create(const char *path, int format);
+// writes what is buffered first
+void event_log_destroy(struct event_log_t *log);
+// code -1 logs all codes of the type, returns 0 or errno
+int event_log_filter(struct event_log_t *log, int type, int code);
+void event_log_event(struct event_log_t *log, const char *dev_name, const struct input_event *ev);
+// returns 0, EAGAIN when part of the buffer is left for the next flush, or errno
+int event_log_flush(struct event_log_t *log);
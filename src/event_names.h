@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/input-event-codes.h>
+
+/*
+ * Type and code names of linux/input-event-codes.h and the FF_ effects of linux/input.h,
+ * generated at build time by gen_names into event_names.c: dense arrays from code to name,
+ * and a perfect hash from name to type and code.
+ */
+
+struct event_name_t {
+	const char *name;
+	uint8_t len;
+	uint8_t type;
+	// -1 for type names such as "EV_KEY"
+	int16_t code;
+};
+
+struct event_code_names_t {
+	const char * const *name;
+	unsigned count;
+};
+
+extern const char * const event_type_names[EV_CNT];
+extern const struct event_code_names_t event_code_names[EV_CNT];
+// a seed per bucket places the names of the bucket into free slots
+extern const struct event_name_t event_name_slot[];
+extern const uint16_t event_name_seed[];
+extern const uint32_t event_name_slot_mask;
+extern const uint32_t event_name_bucket_mask;
+
+// FNV-1a with a final mix, also used by gen_names to pick the seeds
+static inline uint32_t event_name_hash(const char *name, size_t len, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static inline const char *event_type_name(unsigned type)
+{
+	return type < EV_CNT ? event_type_names[type] : NULL;
+}
+
+// aliases such as KEY_HANGUEL are found by name, a code is named by its first definition
+static inline const char *event_code_name(unsigned type, unsigned code)
+{
+	if (type >= EV_CNT || code >= event_code_names[type].count)
+		return NULL;
+	return event_code_names[type].name[code];
+}
+
+// NULL when name is neither a type nor a code name
+static inline const struct event_name_t *event_name_find(const char *name, size_t len)
+{
+	uint32_t seed = event_name_seed[event_name_hash(name, len, 0) & event_name_bucket_mask];
+	const struct event_name_t *entry = event_name_slot + (event_name_hash(name, len, seed) & event_name_slot_mask);
+	if (entry->name == NULL || entry->len != len || 0 != memcmp(entry->name, name, len))
+		return NULL;
+	return entry;
+}
@@ -0,0 +1,205 @@
+/*
+ * Stand-in for the fd store of systemd, to try lukeymap --handoff=store without a service:
+ * runs the command with NOTIFY_SOCKET set, keeps the fds it stores, and runs it again with
+ * them as LISTEN_FDS when it exits with the restart status.
+ *
+ *	fdstore lukeymap --handoff=store remap /etc/lukeymap/remap.conf
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+
+#define STORE_MAX 256
+#define STORE_NAME_SIZE 256
+#define LISTEN_FDS_START 3
+#define MESSAGE_SIZE 4096
+
+struct store_t {
+	unsigned count;
+	int fd[STORE_MAX];
+	char name[STORE_MAX][STORE_NAME_SIZE];
+};
+
+static void store_remove(struct store_t *store, const char *name)
+{
+	unsigned kept = 0;
+	for (unsigned i = 0; i < store->count; i++) {
+		if (0 == strcmp(store->name[i], name)) {
+			close(store->fd[i]);
+			continue;
+		}
+		store->fd[kept] = store->fd[i];
+		memcpy(store->name[kept], store->name[i], STORE_NAME_SIZE);
+		kept++;
+	}
+	store->count = kept;
+}
+
+static void store_add(struct store_t *store, int fd, const char *name)
+{
+	// a name stored again replaces the fd it had
+	store_remove(store, name);
+	if (store->count == STORE_MAX) {
+		fprintf(stderr, "fdstore: full, dropping %s\n", name);
+		close(fd);
+		return;
+	}
+	store->fd[store->count] = fd;
+	snprintf(store->name[store->count], STORE_NAME_SIZE, "%s", name);
+	store->count++;
+}
+
+// FDSTORE=1 with FDNAME= stores the fds attached, FDSTOREREMOVE=1 drops them
+static void handle_message(struct store_t *store, int sock)
+{
+	char buf[MESSAGE_SIZE + 1];
+	char control[CMSG_SPACE(sizeof(int) * STORE_MAX)];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = MESSAGE_SIZE,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	int fds[STORE_MAX];
+	unsigned nfds = 0;
+	int fdstore = 0;
+	int remove = 0;
+	const char *name = "stored";
+	char *line;
+	char *p = buf;
+	ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+	if (len < 0)
+		return;
+	buf[len] = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	}
+	while ((line = strsep(&p, "\n")) != NULL) {
+		if (0 == strcmp(line, "FDSTORE=1"))
+			fdstore = 1;
+		else if (0 == strcmp(line, "FDSTOREREMOVE=1"))
+			remove = 1;
+		else if (0 == strncmp(line, "FDNAME=", 7))
+			name = line + 7;
+	}
+	if (remove)
+		store_remove(store, name);
+	for (unsigned i = 0; i < nfds; i++) {
+		if (fdstore)
+			store_add(store, fds[i], name);
+		else
+			close(fds[i]);
+	}
+}
+
+// in the child: stored fds from 3 on, named as sd_listen_fds_with_names(3) expects
+static void pass_fds(struct store_t *store)
+{
+	char value[32];
+	char names[STORE_MAX * STORE_NAME_SIZE];
+	int high[STORE_MAX];
+	size_t len = 0;
+
+	if (store->count == 0)
+		return;
+	// out of the way of the numbers they go to, gone with the exec
+	for (unsigned i = 0; i < store->count; i++)
+		high[i] = fcntl(store->fd[i], F_DUPFD_CLOEXEC, LISTEN_FDS_START + STORE_MAX);
+	for (unsigned i = 0; i < store->count; i++) {
+		dup2(high[i], LISTEN_FDS_START + i);
+		len += snprintf(names + len, sizeof(names) - len, "%s%s", i ? ":" : "", store->name[i]);
+	}
+	snprintf(value, sizeof(value), "%u", store->count);
+	setenv("LISTEN_FDS", value, 1);
+	setenv("LISTEN_FDNAMES", names, 1);
+	snprintf(value, sizeof(value), "%d", (int)getpid());
+	setenv("LISTEN_PID", value, 1);
+}
+
+int main(int argc, char **argv)
+{
+	int sock;
+	int status = 0;
+	struct store_t store = { 0 };
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s COMMAND [ARG ...]\n", argv[0]);
+		return 2;
+	}
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/fdstore.%d", (int)getpid());
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("fdstore");
+		return 1;
+	}
+	setenv("NOTIFY_SOCKET", addr.sun_path, 1);
+	// the command gets the terminal signals, we wait for it to go
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	while (1) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fdstore");
+			break;
+		}
+		if (pid == 0) {
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			pass_fds(&store);
+			execvp(argv[1], argv + 1);
+			perror(argv[1]);
+			_exit(127);
+		}
+		while (waitpid(pid, &status, WNOHANG) == 0) {
+			struct pollfd pfd = {
+				.fd = sock,
+				.events = POLLIN,
+			};
+			if (poll(&pfd, 1, 100) > 0)
+				handle_message(&store, sock);
+		}
+		// what was sent before the exit
+		while (1) {
+			struct pollfd pfd = {
+				.fd = sock,
+				.events = POLLIN,
+			};
+			if (poll(&pfd, 1, 0) <= 0)
+				break;
+			handle_message(&store, sock);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != HANDOFF_EXIT_STATUS)
+			break;
+		fprintf(stderr, "fdstore: restarting %s with %u fds\n", argv[1], store.count);
+	}
+
+	for (unsigned i = 0; i < store.count; i++)
+		close(store.fd[i]);
+	close(sock);
+	unlink(addr.sun_path);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,289 @@
+/*
+ * Build tool, reads linux/input-event-codes.h and prints event_names.c: the names of each
+ * event type as an array indexed by code, and a hash-and-displace perfect hash of all names.
+ * The force feedback effect codes are defined in linux/input.h, read after it when given.
+ */
+#include "event_names.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define NAME_MAX_COUNT 2048
+#define NAME_SIZE 64
+#define SEED_MAX 0xffff
+
+struct name_t {
+	char name[NAME_SIZE];
+	int type;
+	int code;
+	// defined as another name, never names its code
+	int alias;
+	unsigned bucket;
+};
+
+// code name prefixes and their event type names
+static const char * const prefix[][2] = {
+	{"SYN_", "EV_SYN"}, {"KEY_", "EV_KEY"}, {"BTN_", "EV_KEY"}, {"REL_", "EV_REL"},
+	{"ABS_", "EV_ABS"}, {"MSC_", "EV_MSC"}, {"SW_", "EV_SW"}, {"LED_", "EV_LED"},
+	{"SND_", "EV_SND"}, {"REP_", "EV_REP"}, {"FF_", "EV_FF"},
+};
+
+// the first codes of ranges, the name of the first code in the range is used instead
+static const char * const range_name[] = {
+	"BTN_MISC", "BTN_MOUSE", "BTN_JOYSTICK", "BTN_GAMEPAD", "BTN_DIGI", "BTN_WHEEL", "BTN_TRIGGER_HAPPY",
+};
+
+// in linux/input.h, FF_ names that are not codes
+static const char * const ff_skip[] = {
+	"FF_STATUS_", "FF_EFFECT_", "FF_WAVEFORM_", "FF_MAX",
+};
+
+static struct name_t names[NAME_MAX_COUNT];
+static unsigned name_count;
+
+static struct name_t *name_get(const char *name)
+{
+	for (unsigned i = 0; i < name_count; i++) {
+		if (0 == strcmp(names[i].name, name))
+			return names + i;
+	}
+	return NULL;
+}
+
+static int prefix_len(const char *name, const char **type_name)
+{
+	if (0 == strncmp(name, "EV_", 3)) {
+		*type_name = NULL;
+		return 3;
+	}
+	for (unsigned i = 0; i < sizeof(prefix) / sizeof(prefix[0]); i++) {
+		size_t len = strlen(prefix[i][0]);
+		if (0 == strncmp(name, prefix[i][0], len)) {
+			*type_name = prefix[i][1];
+			return (int)len;
+		}
+	}
+	return -1;
+}
+
+static int skipped(const char *name, const char *only)
+{
+	if (only == NULL)
+		return 0;
+	if (0 != strncmp(name, only, strlen(only)))
+		return 1;
+	for (unsigned i = 0; i < sizeof(ff_skip) / sizeof(ff_skip[0]); i++) {
+		if (0 == strncmp(name, ff_skip[i], strlen(ff_skip[i])))
+			return 1;
+	}
+	return 0;
+}
+
+// only: the prefix of the names to take, NULL for all
+static int parse(FILE *fp, const char *only)
+{
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		char name[NAME_SIZE];
+		char value[NAME_SIZE];
+		char *endptr;
+		const char *type_name;
+		struct name_t *entry;
+		long code;
+		int len;
+
+		if (sscanf(line, " #define %63s %63s", name, value) != 2 || skipped(name, only))
+			continue;
+		len = prefix_len(name, &type_name);
+		// KEY_MAX and KEY_CNT are limits, not codes
+		if (len < 0 || 0 == strcmp(name + len, "MAX") || 0 == strcmp(name + len, "CNT"))
+			continue;
+		if (name_count == NAME_MAX_COUNT)
+			return ENOSPC;
+		entry = names + name_count;
+		strcpy(entry->name, name);
+		code = strtol(value, &endptr, 0);
+		if (*endptr == 0) {
+			entry->code = (int)code;
+		} else {
+			const struct name_t *target = name_get(value);
+			// expressions are only used for limits
+			if (target == NULL)
+				continue;
+			entry->code = target->code;
+			entry->alias = 1;
+		}
+		if (type_name == NULL) {
+			entry->type = entry->code;
+			entry->code = -1;
+		} else {
+			const struct name_t *type = name_get(type_name);
+			if (type == NULL)
+				return EINVAL;
+			entry->type = type->type;
+		}
+		if (entry->type < 0 || entry->type >= EV_CNT || entry->code > INT16_MAX)
+			return EINVAL;
+		name_count++;
+	}
+	return ferror(fp) ? EIO : 0;
+}
+
+static int names_code(const struct name_t *entry)
+{
+	if (entry->alias || entry->code < 0)
+		return 0;
+	for (unsigned i = 0; i < sizeof(range_name) / sizeof(range_name[0]); i++) {
+		if (0 == strcmp(entry->name, range_name[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static void print_code_names(void)
+{
+	unsigned count[EV_CNT] = { 0 };
+	const char *type_name[EV_CNT] = { NULL };
+
+	for (unsigned i = 0; i < name_count; i++) {
+		const struct name_t *entry = names + i;
+		if (entry->code < 0)
+			type_name[entry->type] = entry->name;
+		else if (names_code(entry) && (unsigned)entry->code >= count[entry->type])
+			count[entry->type] = entry->code + 1;
+	}
+	for (int type = 0; type < EV_CNT; type++) {
+		if (count[type] == 0)
+			continue;
+		printf("\nstatic const char * const code_names_%d[] = {\n", type);
+		for (int code = 0; code < (int)count[type]; code++) {
+			for (unsigned i = 0; i < name_count; i++) {
+				if (names[i].type == type && names[i].code == code && names_code(names + i)) {
+					printf("\t[0x%03x] = \"%s\",\n", code, names[i].name);
+					break;
+				}
+			}
+		}
+		printf("};\n");
+	}
+
+	printf("\nconst char * const event_type_names[EV_CNT] = {\n");
+	for (int type = 0; type < EV_CNT; type++) {
+		if (type_name[type])
+			printf("\t[0x%02x] = \"%s\",\n", type, type_name[type]);
+	}
+	printf("};\n\nconst struct event_code_names_t event_code_names[EV_CNT] = {\n");
+	for (int type = 0; type < EV_CNT; type++) {
+		if (count[type])
+			printf("\t[0x%02x] = {code_names_%d, %u},\n", type, type, count[type]);
+	}
+	printf("};\n");
+}
+
+static unsigned pow2_above(unsigned n)
+{
+	unsigned size = 1;
+	while (size < n)
+		size *= 2;
+	return size;
+}
+
+// largest buckets are placed first, while most slots are free
+static int print_hash(void)
+{
+	unsigned slot_count = pow2_above(2 * name_count);
+	unsigned bucket_count = pow2_above((name_count + 3) / 4);
+	int *slot = malloc(slot_count * sizeof(int));
+	unsigned *seed = calloc(bucket_count, sizeof(unsigned));
+	unsigned *size = calloc(bucket_count, sizeof(unsigned));
+	unsigned placed = 0;
+
+	if (slot == NULL || seed == NULL || size == NULL)
+		return ENOMEM;
+	for (unsigned i = 0; i < slot_count; i++)
+		slot[i] = -1;
+	for (unsigned i = 0; i < name_count; i++) {
+		names[i].bucket = event_name_hash(names[i].name, strlen(names[i].name), 0) & (bucket_count - 1);
+		size[names[i].bucket]++;
+	}
+	for (unsigned n = name_count; n > 0 && placed < name_count; n--) {
+		for (unsigned b = 0; b < bucket_count; b++) {
+			unsigned s;
+			if (size[b] != n)
+				continue;
+			for (s = 1; s <= SEED_MAX; s++) {
+				unsigned i;
+				for (i = 0; i < name_count; i++) {
+					unsigned at;
+					if (names[i].bucket != b)
+						continue;
+					at = event_name_hash(names[i].name, strlen(names[i].name), s) & (slot_count - 1);
+					if (slot[at] >= 0)
+						break;
+					slot[at] = (int)i;
+				}
+				if (i == name_count)
+					break;
+				// undo the names of the bucket placed with this seed
+				for (unsigned j = 0; j < slot_count; j++) {
+					if (slot[j] >= 0 && names[slot[j]].bucket == b)
+						slot[j] = -1;
+				}
+			}
+			if (s > SEED_MAX)
+				return EDEADLK;
+			seed[b] = s;
+			placed += n;
+		}
+	}
+
+	printf("\nconst struct event_name_t event_name_slot[%u] = {\n", slot_count);
+	for (unsigned i = 0; i < slot_count; i++) {
+		const struct name_t *entry = names + slot[i];
+		if (slot[i] >= 0)
+			printf("\t[%u] = {\"%s\", %zu, 0x%02x, %d},\n", i, entry->name, strlen(entry->name), entry->type, entry->code);
+	}
+	printf("};\n\nconst uint16_t event_name_seed[%u] = {", bucket_count);
+	for (unsigned b = 0; b < bucket_count; b++)
+		printf("%s%u,", (b % 16) ? " " : "\n\t", seed[b]);
+	printf("\n};\n\nconst uint32_t event_name_slot_mask = %u;\nconst uint32_t event_name_bucket_mask = %u;\n",
+		slot_count - 1, bucket_count - 1);
+	free(slot);
+	free(seed);
+	free(size);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rc;
+
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "usage: %s linux/input-event-codes.h [linux/input.h]\n", argv[0]);
+		return 1;
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		// the types are all in the first, only effect codes are taken from the second
+		rc = parse(fp, i == 1 ? NULL : "FF_");
+		fclose(fp);
+		if (rc != 0) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(rc));
+			return 1;
+		}
+	}
+	printf("// generated by gen_names from %s, do not edit\n#include \"event_names.h\"\n", argv[1]);
+	print_code_names();
+	rc = print_hash();
+	if (rc != 0) {
+		fprintf(stderr, "no perfect hash for %u names: %s\n", name_count, strerror(rc));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/uinput.h>
+
+#define HANDOFF_MAGIC 0x6c6b6d68
+// LISTEN_FDS of sd_listen_fds(3) start here
+#define LISTEN_FDS_START 3
+#define DELETED_SUFFIX " (deleted)"
+
+struct handoff_header_t {
+	uint32_t magic;
+	uint32_t entry_size;
+	uint32_t count;
+	uint32_t reserved;
+	int64_t time;
+};
+
+void handoff_init(struct handoff_t *handoff)
+{
+	memset(handoff, 0, sizeof(struct handoff_t));
+}
+
+struct handoff_entry_t *handoff_add(struct handoff_t *handoff, int kind, int fd)
+{
+	struct handoff_entry_t *entry;
+	if (handoff->count == HANDOFF_MAX)
+		return NULL;
+	entry = handoff->entry + handoff->count++;
+	memset(entry, 0, sizeof(struct handoff_entry_t));
+	entry->kind = kind;
+	entry->fd = fd;
+	return entry;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// a memfd holding the header and the entries, returns the fd or -errno
+static int handoff_snapshot(struct handoff_t *handoff, unsigned flags)
+{
+	int fd;
+	size_t len = sizeof(struct handoff_entry_t) * handoff->count;
+	struct handoff_header_t header = {
+		.magic = HANDOFF_MAGIC,
+		.entry_size = sizeof(struct handoff_entry_t),
+		.count = handoff->count,
+		.time = now_ns(),
+	};
+
+	fd = memfd_create(HANDOFF_SNAPSHOT_NAME, flags);
+	if (fd < 0)
+		return -errno;
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    pwrite(fd, handoff->entry, len, sizeof(header)) != (ssize_t)len) {
+		int rc = errno ? errno : EIO;
+		close(fd);
+		return -rc;
+	}
+	return fd;
+}
+
+// entries are read up to the size both sides know, fds still as numbered by the writer
+static int handoff_load(struct handoff_t *handoff, int fd)
+{
+	struct handoff_header_t header;
+	size_t size;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return errno ? errno : EINVAL;
+	if (header.magic != HANDOFF_MAGIC || header.count > HANDOFF_MAX)
+		return EINVAL;
+	size = header.entry_size < sizeof(struct handoff_entry_t) ? header.entry_size : sizeof(struct handoff_entry_t);
+	handoff_init(handoff);
+	handoff->time = header.time;
+	for (unsigned i = 0; i < header.count; i++) {
+		struct handoff_entry_t *entry = handoff->entry + i;
+		if (pread(fd, entry, size, sizeof(header) + (off_t)i * header.entry_size) != (ssize_t)size)
+			return errno ? errno : EINVAL;
+		entry->node[HANDOFF_NAME_SIZE - 1] = 0;
+		entry->source[HANDOFF_NAME_SIZE - 1] = 0;
+		entry->adopted = 0;
+	}
+	handoff->count = header.count;
+	return 0;
+}
+
+// the path the binary was started from, also when it has been replaced since
+static int exe_path(char *path, size_t size)
+{
+	size_t suffix = strlen(DELETED_SUFFIX);
+	ssize_t len = readlink("/proc/self/exe", path, size - 1);
+	if (len < 0)
+		return errno;
+	path[len] = 0;
+	if ((size_t)len > suffix && 0 == strcmp(path + len - suffix, DELETED_SUFFIX))
+		path[len - suffix] = 0;
+	return 0;
+}
+
+int handoff_exec(struct handoff_t *handoff, char **argv)
+{
+	int rc;
+	int fd;
+	unsigned i;
+	char value[16];
+	char path[4096];
+
+	rc = exe_path(path, sizeof(path));
+	if (rc != 0)
+		return rc;
+	// without FD_CLOEXEC, the snapshot and the entries survive exec() under their numbers
+	fd = handoff_snapshot(handoff, 0);
+	if (fd < 0)
+		return -fd;
+	for (i = 0; i < handoff->count; i++) {
+		if (fcntl(handoff->entry[i].fd, F_SETFD, 0) < 0)
+			break;
+	}
+	if (i == handoff->count) {
+		snprintf(value, sizeof(value), "%d", fd);
+		setenv(HANDOFF_ENV, value, 1);
+		execv(path, argv);
+		rc = errno;
+		unsetenv(HANDOFF_ENV);
+	} else {
+		rc = errno;
+	}
+	while (i-- > 0)
+		fcntl(handoff->entry[i].fd, F_SETFD, FD_CLOEXEC);
+	close(fd);
+	return rc;
+}
+
+static int notify_socket(struct sockaddr_un *addr, socklen_t *len)
+{
+	size_t n;
+	const char *path = getenv("NOTIFY_SOCKET");
+
+	if (path == NULL || (path[0] != '/' && path[0] != '@'))
+		return -ENOENT;
+	n = strlen(path);
+	if (n >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, n);
+	// abstract namespace
+	if (path[0] == '@')
+		addr->sun_path[0] = 0;
+	*len = offsetof(struct sockaddr_un, sun_path) + n + (path[0] == '/');
+	return 0;
+}
+
+// one notification, with fd attached unless it is negative
+static int notify_send(int sock, const struct sockaddr_un *addr, socklen_t len, const char *text, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = (void *)text,
+		.iov_len = strlen(text),
+	};
+	struct msghdr msg = {
+		.msg_name = (void *)addr,
+		.msg_namelen = len,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (fd >= 0) {
+		struct cmsghdr *cmsg;
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? errno : 0;
+}
+
+int handoff_store(struct handoff_t *handoff)
+{
+	int rc;
+	int sock;
+	int fd;
+	char text[64 + HANDOFF_NAME_SIZE];
+	struct sockaddr_un addr;
+	socklen_t len;
+
+	rc = notify_socket(&addr, &len);
+	if (rc != 0)
+		return -rc;
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return errno;
+	fd = handoff_snapshot(handoff, MFD_CLOEXEC);
+	if (fd < 0) {
+		close(sock);
+		return -fd;
+	}
+	for (unsigned i = 0; i < handoff->count && rc == 0; i++) {
+		snprintf(text, sizeof(text), "FDSTORE=1\nFDNAME=lukeymap-%u\n", i);
+		rc = notify_send(sock, &addr, len, text, handoff->entry[i].fd);
+	}
+	// the snapshot goes last, a store holding it holds everything it refers to
+	if (rc == 0)
+		rc = notify_send(sock, &addr, len, "FDSTORE=1\nFDNAME=" HANDOFF_SNAPSHOT_NAME "\n", fd);
+	// a grab left in the store would outlive us
+	for (unsigned i = 0; i < handoff->count && rc != 0; i++) {
+		snprintf(text, sizeof(text), "FDSTOREREMOVE=1\nFDNAME=lukeymap-%u\n", i);
+		notify_send(sock, &addr, len, text, -1);
+	}
+	close(fd);
+	close(sock);
+	return rc;
+}
+
+// fds passed by the service manager as of sd_listen_fds(3), names separated by ':'
+static int handoff_receive_store(struct handoff_t *handoff)
+{
+	int rc;
+	int sock;
+	int snapshot = -1;
+	unsigned count;
+	char *names;
+	char *name[HANDOFF_MAX + 1];
+	char text[64 + HANDOFF_NAME_SIZE];
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	const char *fdnames = getenv("LISTEN_FDNAMES");
+	struct sockaddr_un addr;
+	socklen_t len;
+
+	if (pid == NULL || fds == NULL || fdnames == NULL || strtol(pid, NULL, 10) != getpid())
+		return ENOENT;
+	count = (unsigned)strtoul(fds, NULL, 10);
+	if (count == 0 || count > HANDOFF_MAX + 1)
+		return ENOENT;
+	names = strdup(fdnames);
+	if (names == NULL)
+		return ENOMEM;
+	for (unsigned i = 0; i < count; i++) {
+		name[i] = strsep(&names, ":");
+		if (name[i] && 0 == strcmp(name[i], HANDOFF_SNAPSHOT_NAME))
+			snapshot = LISTEN_FDS_START + i;
+	}
+	if (snapshot < 0) {
+		free(name[0]);
+		return ENOENT;
+	}
+
+	rc = handoff_load(handoff, snapshot);
+	for (unsigned i = 0; i < handoff->count; i++) {
+		char entry_name[32];
+		struct handoff_entry_t *entry = handoff->entry + i;
+		snprintf(entry_name, sizeof(entry_name), "lukeymap-%u", i);
+		entry->fd = -1;
+		for (unsigned j = 0; j < count; j++) {
+			if (name[j] && 0 == strcmp(name[j], entry_name))
+				entry->fd = LISTEN_FDS_START + j;
+		}
+	}
+	// nothing refers to them without a snapshot
+	for (unsigned i = 0; i < count && rc != 0; i++) {
+		if (name[i] && 0 == strncmp(name[i], "lukeymap-", 9) && LISTEN_FDS_START + (int)i != snapshot)
+			close(LISTEN_FDS_START + i);
+	}
+
+	// the store lets go of its copies, as for a failed handoff_store()
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock >= 0 && notify_socket(&addr, &len) == 0) {
+		for (unsigned i = 0; i < count; i++) {
+			if (name[i] == NULL || strncmp(name[i], "lukeymap-", 9))
+				continue;
+			snprintf(text, sizeof(text), "FDSTOREREMOVE=1\nFDNAME=%s\n", name[i]);
+			notify_send(sock, &addr, len, text, -1);
+		}
+	}
+	if (sock >= 0)
+		close(sock);
+	close(snapshot);
+	free(name[0]);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return rc;
+}
+
+int handoff_receive(struct handoff_t *handoff)
+{
+	int rc;
+	const char *value = getenv(HANDOFF_ENV);
+
+	handoff_init(handoff);
+	if (value) {
+		char *endptr;
+		int fd = (int)strtol(value, &endptr, 10);
+		unsetenv(HANDOFF_ENV);
+		if (*endptr != 0 || endptr == value || fd < 0)
+			return EINVAL;
+		rc = handoff_load(handoff, fd);
+		close(fd);
+	} else {
+		rc = handoff_receive_store(handoff);
+	}
+	if (rc != 0) {
+		handoff_release(handoff);
+		return rc;
+	}
+	// not to be passed on to anything run from here
+	for (unsigned i = 0; i < handoff->count; i++) {
+		struct handoff_entry_t *entry = handoff->entry + i;
+		if (entry->fd >= 0 && fcntl(entry->fd, F_SETFD, FD_CLOEXEC) < 0)
+			entry->fd = -1;
+	}
+	return 0;
+}
+
+struct handoff_entry_t *handoff_take(struct handoff_t *handoff, int kind, const char *node, uint64_t spec)
+{
+	for (unsigned i = 0; i < handoff->count; i++) {
+		struct handoff_entry_t *entry = handoff->entry + i;
+		if (entry->adopted || entry->kind != kind || entry->fd < 0)
+			continue;
+		// twin devices have sinks of the same spec, each goes back to the one it was cloned from
+		if (strcmp(kind == HANDOFF_UINPUT ? entry->source : entry->node, node) != 0 || entry->spec != spec)
+			continue;
+		entry->adopted = 1;
+		return entry;
+	}
+	return NULL;
+}
+
+static void uinput_release(const struct handoff_entry_t *entry)
+{
+	struct input_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = EV_KEY;
+	for (unsigned i = 0; i < KEY_CNT; i++) {
+		if (entry->key_down[i / 8] & (1u << (i % 8))) {
+			ev.code = i;
+			if (write(entry->fd, &ev, sizeof(ev)) < 0)
+				return;
+		}
+	}
+	ev.type = EV_SYN;
+	ev.code = SYN_REPORT;
+	if (write(entry->fd, &ev, sizeof(ev)) < 0)
+		return;
+}
+
+void handoff_release(struct handoff_t *handoff)
+{
+	for (unsigned i = 0; i < handoff->count; i++) {
+		struct handoff_entry_t *entry = handoff->entry + i;
+		if (entry->adopted || entry->fd < 0)
+			continue;
+		if (entry->kind == HANDOFF_UINPUT) {
+			uinput_release(entry);
+			ioctl(entry->fd, UI_DEV_DESTROY);
+		}
+		close(entry->fd);
+		entry->fd = -1;
+	}
+	handoff->count = 0;
+}
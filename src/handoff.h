@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <linux/input.h>
+
+#define HANDOFF_MAX 64
+#define HANDOFF_NAME_SIZE 32
+// fd of the snapshot across an exec
+#define HANDOFF_ENV "LUKEYMAP_HANDOFF"
+// fd store names, entries are "lukeymap-N"
+#define HANDOFF_SNAPSHOT_NAME "lukeymap-snapshot"
+// exit status asking the service manager for a restart with the stored fds
+#define HANDOFF_EXIT_STATUS 75
+
+enum {
+	HANDOFF_MODE_EXEC = 1,
+	HANDOFF_MODE_STORE = 2,
+};
+
+enum {
+	HANDOFF_UINPUT = 1,
+	HANDOFF_EVDEV = 2,
+};
+
+// written to the snapshot as it is, fields are only ever appended
+struct handoff_entry_t {
+	int32_t kind;
+	// the number in the process it is handed to, -1 when it did not arrive
+	int32_t fd;
+	// node name such as "event3", of the evdev device or of the uinput device
+	char node[HANDOFF_NAME_SIZE];
+	// uinput: hash of the description it was created from
+	uint64_t spec;
+	// evdev: grabbed through this fd
+	uint32_t grabbed;
+	// taken by the new state, not part of the snapshot
+	uint32_t adopted;
+	// uinput: keys reported down
+	uint8_t key_down[KEY_CNT / 8];
+	// uinput: node of the evdev device it was cloned from, empty if made from a description
+	char source[HANDOFF_NAME_SIZE];
+};
+
+/*
+ * Devices kept open across a restart. The old process hands uinput and evdev fds over,
+ * either to its replacement through exec(), or to the systemd fd store, together with a
+ * snapshot of their state; the new one adopts them when its script creates or opens the
+ * same devices, so that sinks never disappear and grabs are never let go.
+ */
+struct handoff_t {
+	// CLOCK_MONOTONIC ns of the restart that handed them over, 0 if none
+	int64_t time;
+	unsigned count;
+	struct handoff_entry_t entry[HANDOFF_MAX];
+};
+
+void handoff_init(struct handoff_t *handoff);
+// the entry to fill in, NULL when full
+struct handoff_entry_t *handoff_add(struct handoff_t *handoff, int kind, int fd);
+// runs the binary again with argv and the entries, returns errno only when that fails
+int handoff_exec(struct handoff_t *handoff, char **argv);
+// parks the entries in the fd store at $NOTIFY_SOCKET, returns 0 or errno
+int handoff_store(struct handoff_t *handoff);
+// takes what an exec or the fd store handed over, returns 0, ENOENT when nothing was, or errno
+int handoff_receive(struct handoff_t *handoff);
+// an entry not yet taken: evdev by node name, uinput by spec and the node of its source
+struct handoff_entry_t *handoff_take(struct handoff_t *handoff, int kind, const char *node, uint64_t spec);
+// closes entries not taken, releasing keys still down on uinput devices first
+void handoff_release(struct handoff_t *handoff);
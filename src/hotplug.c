@@ -0,0 +1,211 @@
+#include "hotplug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#define SYSFS_BITMAP_SIZE 1024
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+// sysfs capability files per event type
+static const char * const capability_file[EV_CNT] = {
+	[EV_KEY] = "capabilities/key",
+	[EV_REL] = "capabilities/rel",
+	[EV_ABS] = "capabilities/abs",
+	[EV_MSC] = "capabilities/msc",
+	[EV_SW] = "capabilities/sw",
+	[EV_LED] = "capabilities/led",
+	[EV_SND] = "capabilities/snd",
+	[EV_FF] = "capabilities/ff",
+};
+
+struct hotplug_filter_t *hotplug_filter_create(void)
+{
+	return (struct hotplug_filter_t *)calloc(1, sizeof(struct hotplug_filter_t));
+}
+
+void hotplug_filter_destroy(struct hotplug_filter_t *filter)
+{
+	free(filter);
+}
+
+static int node_number(const char *name)
+{
+	char *endptr;
+	unsigned long n;
+	if (0 != strncmp(name, "event", 5) || name[5] < '0' || name[5] > '9')
+		return -1;
+	n = strtoul(name + 5, &endptr, 10);
+	if (*endptr != 0 || n >= HOTPLUG_NODE_MAX)
+		return -1;
+	return (int)n;
+}
+
+static inline int test_bit(const uint8_t *map, int n)
+{
+	return map[n / 8] & (1u << (n % 8));
+}
+
+static inline void set_bit(uint8_t *map, int n, int value)
+{
+	if (value)
+		map[n / 8] |= 1u << (n % 8);
+	else
+		map[n / 8] &= ~(1u << (n % 8));
+}
+
+void hotplug_filter_own(struct hotplug_filter_t *filter, const char *name, int own)
+{
+	int n = node_number(name);
+	if (n < 0)
+		return;
+	set_bit(filter->own, n, own);
+	// its removal is ours to skip as well
+	set_bit(filter->gone, n, !own);
+}
+
+int hotplug_rule_require(struct hotplug_rule_t *rule, int type, int code)
+{
+	if (type < 0 || type >= EV_CNT)
+		return EINVAL;
+	rule->types |= 1u << type;
+	if (code < 0)
+		return 0;
+	if (capability_file[type] == NULL || code > 0xffff)
+		return EINVAL;
+	if (rule->code_count == HOTPLUG_CODE_MAX)
+		return ENOSPC;
+	rule->code_type[rule->code_count] = type;
+	rule->code[rule->code_count] = code;
+	rule->code_count++;
+	return 0;
+}
+
+static int sysfs_read(int dir, const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd = openat(dir, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return errno;
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = 0;
+	return 0;
+}
+
+static int sysfs_hex(int dir, const char *path)
+{
+	char buf[32];
+	if (sysfs_read(dir, path, buf, sizeof(buf)) != 0)
+		return -1;
+	return (int)strtol(buf, NULL, 16);
+}
+
+// bitmaps are printed as hex words, the most significant one first
+static int sysfs_test_bit(int dir, const char *path, unsigned bit)
+{
+	char buf[SYSFS_BITMAP_SIZE];
+	char *word[SYSFS_BITMAP_SIZE / 2];
+	unsigned count = 0;
+	unsigned index = bit / BITS_PER_WORD;
+	char *p = buf;
+
+	if (sysfs_read(dir, path, buf, sizeof(buf)) != 0)
+		return 0;
+	while (*p) {
+		word[count++] = p;
+		p = strchr(p, ' ');
+		if (p == NULL)
+			break;
+		*p++ = 0;
+	}
+	if (index >= count)
+		return 0;
+	return (strtoul(word[count - 1 - index], NULL, 16) >> (bit % BITS_PER_WORD)) & 1;
+}
+
+static int rule_match(const struct hotplug_rule_t *rule, int dir, const char *name, int bustype, int vendor, int product)
+{
+	if (rule->name[0] && strstr(name, rule->name) == NULL)
+		return 0;
+	if ((rule->bustype >= 0 && rule->bustype != bustype) || (rule->vendor >= 0 && rule->vendor != vendor) ||
+	    (rule->product >= 0 && rule->product != product))
+		return 0;
+	if (rule->types) {
+		char buf[32];
+		unsigned long types;
+		if (sysfs_read(dir, "capabilities/ev", buf, sizeof(buf)) != 0)
+			return 0;
+		types = strtoul(buf, NULL, 16);
+		if ((types & rule->types) != rule->types)
+			return 0;
+	}
+	for (unsigned i = 0; i < rule->code_count; i++) {
+		if (!sysfs_test_bit(dir, capability_file[rule->code_type[i]], rule->code[i]))
+			return 0;
+	}
+	return 1;
+}
+
+// a device sysfs does not describe is left to Lua
+static int hotplug_filter_match(const struct hotplug_filter_t *filter, const char *node)
+{
+	int dir;
+	int rc = 0;
+	char path[64];
+	char name[256];
+	int bustype, vendor, product;
+
+	snprintf(path, sizeof(path), HOTPLUG_SYSFS_PATH "%s/device", node);
+	dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0)
+		return 1;
+	if (sysfs_read(dir, "name", name, sizeof(name)) != 0) {
+		close(dir);
+		return 1;
+	}
+	bustype = sysfs_hex(dir, "id/bustype");
+	vendor = sysfs_hex(dir, "id/vendor");
+	product = sysfs_hex(dir, "id/product");
+	for (unsigned i = 0; i < filter->rule_count && !rc; i++)
+		rc = rule_match(filter->rule + i, dir, name, bustype, vendor, product);
+	close(dir);
+	return rc;
+}
+
+int hotplug_filter_pass(struct hotplug_filter_t *filter, int add, const char *name)
+{
+	int pass = 1;
+	int n = node_number(name);
+
+	if (n < 0)
+		return 1;
+	if (add) {
+		if (test_bit(filter->own, n))
+			pass = 0;
+		else if (filter->rule_count)
+			pass = hotplug_filter_match(filter, name);
+		// the number is reused by another device
+		set_bit(filter->gone, n, 0);
+		set_bit(filter->announced, n, pass);
+	} else {
+		if (test_bit(filter->own, n) || test_bit(filter->gone, n))
+			pass = 0;
+		else if (filter->rule_count && !test_bit(filter->announced, n))
+			pass = 0;
+		set_bit(filter->gone, n, 0);
+		set_bit(filter->announced, n, 0);
+	}
+	if (pass)
+		filter->passed++;
+	else
+		filter->skipped++;
+	return pass;
+}
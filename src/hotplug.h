@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+
+// eventN nodes tracked, dynamic input minors stop at 1024
+#define HOTPLUG_NODE_MAX 1024
+#define HOTPLUG_RULE_MAX 16
+#define HOTPLUG_CODE_MAX 16
+#define HOTPLUG_NAME_SIZE 64
+#define HOTPLUG_SYSFS_PATH "/sys/class/input/"
+
+// device accepted when all given fields match, -1 and empty fields match anything
+struct hotplug_rule_t {
+	char name[HOTPLUG_NAME_SIZE];
+	int bustype;
+	int vendor;
+	int product;
+	uint32_t types;
+	unsigned code_count;
+	uint16_t code_type[HOTPLUG_CODE_MAX];
+	uint16_t code[HOTPLUG_CODE_MAX];
+};
+
+/*
+ * Decides in C which hotplug events reach Lua. Nodes of our own uinput devices are never
+ * announced, and with rules installed only devices matching one of them are, checked
+ * through sysfs without opening the node. Kept across reloads, rules are not.
+ */
+struct hotplug_filter_t {
+	unsigned rule_count;
+	struct hotplug_rule_t rule[HOTPLUG_RULE_MAX];
+	uint64_t passed;
+	uint64_t skipped;
+	// uinput devices of ours, and closed ones whose removal is still to come
+	uint8_t own[HOTPLUG_NODE_MAX / 8];
+	uint8_t gone[HOTPLUG_NODE_MAX / 8];
+	// nodes announced as added
+	uint8_t announced[HOTPLUG_NODE_MAX / 8];
+};
+
+struct hotplug_filter_t *hotplug_filter_create(void);
+void hotplug_filter_destroy(struct hotplug_filter_t *filter);
+// name is a node name such as "event3", others are not tracked
+void hotplug_filter_own(struct hotplug_filter_t *filter, const char *name, int own);
+// code -1 requires the type only, returns 0 or errno
+int hotplug_rule_require(struct hotplug_rule_t *rule, int type, int code);
+// 1 when the add or del of node name goes on to Lua
+int hotplug_filter_pass(struct hotplug_filter_t *filter, int add, const char *name);
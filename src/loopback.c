@@ -0,0 +1,104 @@
+#include "loopback.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <libevdev/libevdev.h>
+
+struct loopback_t *loopback_create(struct libevdev *dev, unsigned index)
+{
+	struct loopback_t *loop = (struct loopback_t *)calloc(1, sizeof(struct loopback_t));
+	if (loop == NULL)
+		return NULL;
+	loop->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->fd < 0) {
+		int rc = errno;
+		free(loop);
+		errno = rc;
+		return NULL;
+	}
+	loop->ref = 1;
+	loop->dev = dev;
+	snprintf(loop->name, sizeof(loop->name), "loop%u", index);
+	return loop;
+}
+
+void loopback_put(struct loopback_t *loop)
+{
+	if (loop == NULL || --loop->ref)
+		return;
+	close(loop->fd);
+	libevdev_free(loop->dev);
+	free(loop);
+}
+
+int loopback_open_reader(struct loopback_t *loop)
+{
+	int fd;
+	if (loop->reader)
+		return -EBUSY;
+	fd = fcntl(loop->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	loop->reader = 1;
+	loop->ref++;
+	return fd;
+}
+
+void loopback_close_reader(struct loopback_t *loop)
+{
+	if (loop == NULL)
+		return;
+	loop->reader = 0;
+	loopback_put(loop);
+}
+
+int loopback_write(struct loopback_t *loop, const struct input_event *ev, unsigned count)
+{
+	struct timespec ts;
+	uint64_t one = 1;
+
+	if (loop->count + count > LOOPBACK_QUEUE_SIZE) {
+		// a full kernel buffer drops events as well, nobody reads this side
+		loop->drops += count;
+		return -ENOSPC;
+	}
+	// the clock evdev objects are switched to
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (unsigned i = 0; i < count; i++) {
+		struct input_event *out = loop->event + ((loop->head + loop->count + i) & (LOOPBACK_QUEUE_SIZE - 1));
+		*out = ev[i];
+		out->input_event_sec = ts.tv_sec;
+		out->input_event_usec = ts.tv_nsec / 1000;
+		if (ev[i].type == EV_LED && ev[i].code < 32) {
+			if (ev[i].value)
+				loop->led |= 1u << ev[i].code;
+			else
+				loop->led &= ~(1u << ev[i].code);
+		}
+	}
+	if (loop->count == 0 && count && write(loop->fd, &one, sizeof(one)) < 0)
+		return -errno;
+	loop->count += count;
+	loop->written += count;
+	return 0;
+}
+
+int loopback_read(struct loopback_t *loop, struct input_event *ev)
+{
+	uint64_t value;
+
+	if (loop->count == 0)
+		return EAGAIN;
+	*ev = loop->event[loop->head];
+	loop->head = (loop->head + 1) & (LOOPBACK_QUEUE_SIZE - 1);
+	loop->read++;
+	// drained, the event loop stops waking up for it
+	if (--loop->count == 0 && read(loop->fd, &value, sizeof(value)) < 0)
+		value = 0;
+	return 0;
+}
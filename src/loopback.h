@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <linux/input.h>
+
+struct libevdev;
+
+// events queued per device, power of 2
+#define LOOPBACK_QUEUE_SIZE 4096
+#define LOOPBACK_NAME_SIZE 16
+
+/*
+ * In-memory input device: events written to its uinput side are read back from its evdev side.
+ * The eventfd is readable while events are queued, so the event loop waits on it like on a device.
+ */
+struct loopback_t {
+	int fd;
+	// held by the uinput object and the evdev object reading it
+	unsigned ref;
+	int reader;
+	// capabilities, reported by the evdev side
+	struct libevdev *dev;
+	char name[LOOPBACK_NAME_SIZE];
+	uint32_t led;
+	unsigned head;
+	unsigned count;
+	uint64_t written;
+	uint64_t read;
+	uint64_t drops;
+	struct input_event event[LOOPBACK_QUEUE_SIZE];
+};
+
+// takes dev when it succeeds, returns NULL with errno set
+struct loopback_t *loopback_create(struct libevdev *dev, unsigned index);
+void loopback_put(struct loopback_t *loop);
+// one reader at a time, returns an fd of its own waiting on the queue, or -errno
+int loopback_open_reader(struct loopback_t *loop);
+void loopback_close_reader(struct loopback_t *loop);
+// stamps and queues the events, all or none of them, returns 0 or -errno
+int loopback_write(struct loopback_t *loop, const struct input_event *ev, unsigned count);
+// returns 0 or EAGAIN when nothing is queued
+int loopback_read(struct loopback_t *loop, struct input_event *ev);
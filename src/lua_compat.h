@@ -0,0 +1,102 @@
+#pragma once
+/*
+ * Lua 5.3 API used by lua_device.c, on top of LuaJIT (5.1 API with 2.1 extensions).
+ * Included after lua.h, lualib.h and lauxlib.h, empty for Lua 5.3.
+ */
+
+#if LUA_VERSION_NUM == 501
+#include <luajit.h>
+
+#define LUA_COMPAT_LUAJIT 1
+// lua_type() of FFI cdata
+#define LUA_TCDATA 10
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+/*
+ * There is no extra space in a LuaJIT state. The allocator ud is kept per state, and
+ * lua_device_create() passes a lua_device_info_t, whose first member is the slot.
+ */
+static inline void *lua_getextraspace(lua_State *L)
+{
+	void *ud;
+	lua_getallocf(L, &ud);
+	return ud;
+}
+
+#define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#define luaL_len(L, i) ((lua_Integer)lua_objlen(L, i))
+#define lua_isinteger(L, i) (lua_type(L, i) == LUA_TNUMBER && \
+	(lua_Number)lua_tointeger(L, i) == lua_tonumber(L, i))
+
+#ifndef luaL_newlib
+#define luaL_newlib(L, l) (lua_createtable(L, 0, sizeof(l) / sizeof((l)[0]) - 1), luaL_setfuncs(L, l, 0))
+#endif
+
+static inline int lua_absindex(lua_State *L, int idx)
+{
+	return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop(L) + idx + 1;
+}
+
+// 5.3 returns the type of the pushed value
+static inline int lua_compat_getfield(lua_State *L, int idx, const char *k)
+{
+	lua_getfield(L, idx, k);
+	return lua_type(L, -1);
+}
+#define lua_getfield lua_compat_getfield
+
+static inline int lua_geti(lua_State *L, int idx, lua_Integer n)
+{
+	idx = lua_absindex(L, idx);
+	lua_pushinteger(L, n);
+	lua_gettable(L, idx);
+	return lua_type(L, -1);
+}
+
+static inline void lua_seti(lua_State *L, int idx, lua_Integer n)
+{
+	idx = lua_absindex(L, idx);
+	lua_pushinteger(L, n);
+	lua_insert(L, -2);
+	lua_settable(L, idx);
+}
+
+static inline int luaL_getsubtable(lua_State *L, int idx, const char *name)
+{
+	idx = lua_absindex(L, idx);
+	if (lua_compat_getfield(L, idx, name) == LUA_TTABLE)
+		return 1;
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, idx, name);
+	return 0;
+}
+
+// the user value lives in slot 1 of the userdata environment table
+static inline void lua_setuservalue(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	lua_createtable(L, 1, 0);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, idx);
+}
+
+static inline int lua_getuservalue(lua_State *L, int idx)
+{
+	lua_getfenv(L, idx);
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		return LUA_TNIL;
+	}
+	lua_rawgeti(L, -1, 1);
+	lua_remove(L, -2);
+	return lua_type(L, -1);
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include "lua_compat.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,27 +12,189 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
+#include <sys/ioctl.h>
 
 #include <linux/input-event-codes.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
+#include <linux/uinput.h>
 
 #include "poll_group.h"
+#include "abs_engine.h"
+#include "pointer.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "macro.h"
+#include "route.h"
+#include "loopback.h"
+#include "uevent.h"
+#include "hotplug.h"
+#include "builtin.h"
+#include "event_names.h"
+#include "event_log.h"
+#include "handoff.h"
 
 #define REG_FD_MAP "fd_map"
 #define REG_NAME_TIMER "timer"
 #define REG_NAME_EVDEV "evdev"
 #define REG_NAME_UINPUT "uinput"
+#define REG_NAME_MACRO "macro"
+#define REG_LOOPBACK "loopback"
+#define REG_FFI_CAST "ffi_cast"
+#define REG_MODULES "modules"
+// weak set of uinput objects, walked to hand them over
+#define REG_UINPUTS "uinputs"
+
+// instructions between checks of the profiler clock
+#define LUA_PROFILE_HOOK_COUNT 1000
+
+#define EVDEV_QUEUE_SIZE 64
+#define EVDEV_NAME_SIZE 32
+// events drained per wakeup, adapted to the backlog seen
+#define EVDEV_BUDGET_MIN 64
+#define EVDEV_BUDGET_MAX 1024
+// sources of one sink read in the same wakeup
+#define EVDEV_MERGE_MAX 16
+
+struct evdev_t;
+
+struct uinput_t {
+	struct libevdev_uinput *dev;
+	int fd;
+	// in-memory device of device.loopback(), instead of dev
+	struct loopback_t *loop;
+	// macros queued on this device, created on first use
+	struct macro_player_t *player;
+	// evdev objects forwarding here, and the one whose events or handler write now
+	struct evdev_t *sources;
+	struct evdev_t *writer;
+	// output state: keys reported down, and events since the last SYN_REPORT
+	unsigned frame_events;
+	uint64_t written;
+	uint64_t redundant;
+	uint64_t releases;
+	uint8_t key_down[KEY_CNT / 8];
+	// hash of the description it was created from, and the node of the evdev device
+	// it was cloned from if any, match it after a restart
+	uint64_t spec;
+	char source[EVDEV_NAME_SIZE];
+	// handed over by an earlier process: written through fd, without libevdev
+	int adopted;
+	char node[EVDEV_NAME_SIZE];
+};
+
+// compiled event sequence of device.macro()
+struct macro_t {
+	unsigned count;
+	struct macro_step_t step[];
+};
+
+struct evdev_stat_t {
+	uint64_t events_in;
+	uint64_t events_lua;
+	uint64_t events_native;
+	uint64_t drops;
+	uint64_t lua_calls;
+	uint64_t lua_time;
+	uint64_t syn_dropped;
+	uint64_t sync_events;
+	unsigned depth_last;
+	unsigned depth_max;
+	// kernel timestamp of the first event of a wakeup to its read
+	uint64_t wake_count;
+	uint64_t wake_ns;
+	uint64_t wake_max_ns;
+};
+
+struct evdev_t {
+	struct libevdev *dev;
+	int fd;
+	struct recorder_t *recorder;
+	// sink writes go through the event loop, batched when it runs on io_uring
+	struct poll_group_t *poll_group;
+	char name[EVDEV_NAME_SIZE];
+	// native output target, events produced in C are written here directly
+	struct uinput_t *sink;
+	int sink_ref;
+	struct evdev_t *next_source;
+	int read_flag;
+	unsigned frame;
+	unsigned count;
+	unsigned passthrough;
+	int grabbed;
+	// queued events are deltas of a resync after SYN_DROPPED
+	unsigned resync;
+	// read a frame at a time, while merged with the other sources of its sink
+	unsigned merged;
+	unsigned budget;
+	unsigned wake_events;
+	struct evdev_stat_t stat;
+	struct abs_engine_t *abs;
+	struct pointer_stage_t *pointer;
+	struct route_stage_t *route;
+	// read from a loopback device instead of libevdev
+	struct loopback_t *loop;
+	// events read are formatted and written natively
+	struct event_log_t *log;
+	// allocations of its handler, 0 until it first runs
+	unsigned mem_context;
+	// keys down on its sink that it pressed, released when it stops forwarding there
+	uint8_t key_down[KEY_CNT / 8];
+	// events waiting to be handed to Lua
+	struct input_event queue[EVDEV_QUEUE_SIZE];
+};
+
+enum {
+	EVDEV_FRAME_NATIVE = 1,
+	EVDEV_FRAME_LUA = 2,
+};
+
+// evdev_pump() results besides negative errno
+enum {
+	EVDEV_PUMP_FULL = 0,
+	EVDEV_PUMP_BOUNDARY = 1,
+	EVDEV_PUMP_BUDGET = 2,
+};
+
+static inline int64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// the clock of a loop iteration, for sys.now() and the flight recorder
+static inline void loop_tick(struct lua_device_info_t *info)
+{
+	info->now = get_time_ns();
+	if (info->recorder)
+		info->recorder->now = info->now;
+}
+
+// evdev objects are switched to CLOCK_MONOTONIC, the clock of timers and sys.clock()
+static inline int64_t event_time_ns(const struct input_event *ev)
+{
+	return (int64_t)ev->input_event_sec * 1000 * 1000 * 1000 + (int64_t)ev->input_event_usec * 1000;
+}
 
 static int lua_device_load(struct lua_State *ls, int narg);
+static void profile_hook(struct lua_State *ls, lua_Debug *hook_ar);
+static void evdev_release_keys(struct evdev_t *evdev);
+static int evdev_reset_mask(int fd);
+static void evdev_route_clear(struct lua_State *ls, struct evdev_t *evdev);
+static int evdev_open_loopback(struct lua_State *ls, const char *devname, struct evdev_t *evdev);
 
 static int l_new_object(struct lua_State *ls)
 {
-	void *data = lua_touserdata(ls, 1);
-	const char *reg_name = lua_tostring(ls, 2);
-	*(void **)lua_newuserdata(ls, sizeof(void *)) = data;
+	const void *data = lua_touserdata(ls, 1);
+	size_t size = (size_t)lua_tointeger(ls, 2);
+	const char *reg_name = lua_tostring(ls, 3);
+	memcpy(lua_newuserdata(ls, size), data, size);
 	luaL_setmetatable(ls, reg_name);
 	return 1;
 }
@@ -41,8 +204,9 @@ do {							\
 	int rc;						\
 	lua_pushcfunction(ls, l_new_object);		\
 	lua_pushlightuserdata(ls, (void *)(data));	\
+	lua_pushinteger(ls, sizeof(*(data)));		\
 	lua_pushliteral(ls, reg_name);			\
-	rc = lua_pcall(ls, 2, 1, 0);			\
+	rc = lua_pcall(ls, 3, 1, 0);			\
 	if (rc != LUA_OK) {				\
 		__VA_ARGS__;				\
 		return lua_error(ls);			\
@@ -52,11 +216,163 @@ do {							\
 static int l_sys_meminfo(struct lua_State *ls)
 {
 	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	struct lua_mem_context_t snapshot[LUA_MEM_CONTEXT_MAX];
+	unsigned count = info->mem_context_count;
+	int detail = lua_toboolean(ls, 1);
 	lua_pushinteger(ls, info->mem_usage);
 	if (info->mem_limit)
 		lua_pushinteger(ls, info->mem_limit);
 	else
 		lua_pushnil(ls);
+	if (!detail)
+		return 2;
+	// taken before the tables are built, they allocate in the caller's context
+	memcpy(snapshot, info->mem_contexts, count * sizeof(struct lua_mem_context_t));
+	lua_createtable(ls, 0, count);
+	for (unsigned i = 0; i < count; i++) {
+		const struct lua_mem_context_t context = snapshot[i];
+		lua_createtable(ls, 0, 4);
+		lua_pushinteger(ls, context.live);
+		lua_setfield(ls, -2, "live");
+		lua_pushinteger(ls, context.peak);
+		lua_setfield(ls, -2, "peak");
+		lua_pushinteger(ls, context.allocs);
+		lua_setfield(ls, -2, "allocs");
+		lua_pushinteger(ls, context.frees);
+		lua_setfield(ls, -2, "frees");
+		lua_setfield(ls, -2, context.name);
+	}
+	return 3;
+}
+
+#define PROFILER_MAX_RATE 100000
+
+// the hook stays installed while the profiler runs, a count restarted on every call would skip short ones
+static void profile_hook_update(struct lua_State *ls, const struct lua_device_info_t *info)
+{
+	if (info->profiler && info->profiler->rate)
+		lua_sethook(ls, profile_hook, LUA_MASKCOUNT, LUA_PROFILE_HOOK_COUNT);
+	else
+		lua_sethook(ls, NULL, 0, 0);
+}
+
+static int profile_set_rate(struct lua_State *ls, struct lua_device_info_t *info, unsigned rate)
+{
+	if (info->profiler == NULL) {
+		if (rate == 0)
+			return 0;
+		// kept across reloads, freed by the owner of info
+		info->profiler = profiler_create();
+		if (info->profiler == NULL)
+			return ENOMEM;
+	}
+	profiler_set_rate(info->profiler, rate);
+	profile_hook_update(ls, info);
+	return 0;
+}
+
+static int l_sys_profile(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	lua_Integer rate = 0;
+	if (lua_toboolean(ls, 1))
+		rate = luaL_optinteger(ls, 1, PROFILER_DEFAULT_RATE);
+	luaL_argcheck(ls, rate >= 0 && rate <= PROFILER_MAX_RATE, 1, "invalid sample rate");
+	if (profile_set_rate(ls, info, (unsigned)rate) != 0)
+		return luaL_error(ls, "cannot create profiler");
+	return 0;
+}
+
+static int l_sys_profile_dump(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	const char *path = luaL_checkstring(ls, 1);
+	int reset = lua_toboolean(ls, 2);
+	FILE *out;
+	if (info->profiler == NULL)
+		return luaL_error(ls, "profiler not started");
+	out = fopen(path, "w");
+	if (out == NULL)
+		return luaL_error(ls, "cannot open %s: %s", path, strerror(errno));
+	profiler_dump(info->profiler, out);
+	fclose(out);
+	if (reset)
+		profiler_reset(info->profiler);
+	return 0;
+}
+
+static int l_sys_record_save(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	const char *path;
+	int rc;
+	if (info->recorder == NULL)
+		return luaL_error(ls, "flight recorder disabled");
+	path = luaL_optstring(ls, 1, info->recorder->path);
+	if (path == NULL)
+		return luaL_error(ls, "no path for flight recorder");
+	rc = recorder_save(info->recorder, path);
+	if (rc != 0)
+		return luaL_error(ls, "cannot save %s: %s", path, strerror(rc));
+	return 0;
+}
+
+static const char * const recorder_kind_name[] = {
+	[RECORDER_READ] = "read",
+	[RECORDER_DISPATCH] = "dispatch",
+	[RECORDER_RETURN] = "return",
+	[RECORDER_WRITE] = "write",
+	[RECORDER_HOTPLUG] = "hotplug",
+	[RECORDER_ERROR] = "error",
+};
+
+static int l_sys_record_load(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	const char *path = luaL_optstring(ls, 1, info->recorder ? info->recorder->path : NULL);
+	struct recorder_header_t header;
+	struct recorder_entry_t entry;
+	FILE *in;
+	if (path == NULL)
+		return luaL_error(ls, "no path for flight recorder");
+	in = fopen(path, "rb");
+	if (in == NULL)
+		return luaL_error(ls, "cannot open %s: %s", path, strerror(errno));
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, RECORDER_MAGIC, sizeof(header.magic)) ||
+	    header.version != RECORDER_VERSION || header.entry_size != sizeof(entry)) {
+		fclose(in);
+		return luaL_error(ls, "invalid flight recorder file %s", path);
+	}
+
+	// a dump never holds more than the ring, whatever the file claims
+	if (header.count > RECORDER_SIZE)
+		header.count = RECORDER_SIZE;
+	lua_createtable(ls, header.count, 0);
+	for (unsigned i = 1; i <= header.count && fread(&entry, sizeof(entry), 1, in) == 1; i++) {
+		const char *kind = entry.kind < sizeof(recorder_kind_name) / sizeof(recorder_kind_name[0]) ?
+			recorder_kind_name[entry.kind] : NULL;
+		lua_createtable(ls, 0, 7);
+		lua_pushinteger(ls, entry.time);
+		lua_setfield(ls, -2, "time");
+		if (kind)
+			lua_pushstring(ls, kind);
+		else
+			lua_pushinteger(ls, entry.kind);
+		lua_setfield(ls, -2, "kind");
+		lua_pushinteger(ls, entry.fd);
+		lua_setfield(ls, -2, "fd");
+		lua_pushinteger(ls, entry.type);
+		lua_setfield(ls, -2, "type");
+		lua_pushinteger(ls, entry.code);
+		lua_setfield(ls, -2, "code");
+		lua_pushinteger(ls, entry.value);
+		lua_setfield(ls, -2, "value");
+		lua_pushinteger(ls, entry.extra);
+		lua_setfield(ls, -2, "extra");
+		lua_seti(ls, -2, i);
+	}
+	fclose(in);
+	lua_pushinteger(ls, header.time);
 	return 2;
 }
 
@@ -78,17 +394,37 @@ static int l_sys_gettime(struct lua_State *ls)
 	return 2;
 }
 
+static int l_sys_clock(struct lua_State *ls)
+{
+	lua_pushinteger(ls, get_time_ns());
+	return 1;
+}
+
+static int l_sys_now(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	lua_pushinteger(ls, info->now);
+	return 1;
+}
+
+static int l_sys_nocache(struct lua_State *ls)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	info->nocache = 1;
+	return 0;
+}
+
 static int l_sys_timer(struct lua_State *ls)
 {
 	int fd;
 	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 	luaL_checktype(ls, 1, LUA_TFUNCTION);
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 	if (fd < 0)
 		return luaL_error(ls, "cannot create timer: %s", strerror(errno));
 
 	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_FD_MAP);
-	L_NEW_OBJECT((uintptr_t)fd, REG_NAME_TIMER, close(fd));
+	L_NEW_OBJECT(&fd, REG_NAME_TIMER, close(fd));
 
 	// user value
 	lua_pushvalue(ls, 1);
@@ -99,6 +435,7 @@ static int l_sys_timer(struct lua_State *ls)
 	lua_seti(ls, -3, fd);
 
 	poll_group_add(info->poll_group, fd);
+	info->timer_count++;
 
 	return 1;
 }
@@ -111,6 +448,7 @@ static int l_timer_close(struct lua_State *ls)
 
 	poll_group_del(info->poll_group, fd);
 	close(fd);
+	info->timer_count--;
 	lua_pushnil(ls);
 	lua_setmetatable(ls, -2);
 
@@ -161,6 +499,22 @@ static int l_timer_set(struct lua_State *ls)
 	return 0;
 }
 
+// arms the timer at an absolute monotonic time in ns, such as an event time plus a delay
+static int l_timer_at(struct lua_State *ls)
+{
+	struct itimerspec ts = { 0 };
+	int fd = *(int *)luaL_checkudata(ls, 1, REG_NAME_TIMER);
+	lua_Integer time = luaL_checkinteger(ls, 2);
+	// 0 would disarm it, a time already past expires at once
+	if (time <= 0)
+		time = 1;
+	ts.it_value.tv_sec = time / (1000 * 1000 * 1000);
+	ts.it_value.tv_nsec = time % (1000 * 1000 * 1000);
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0)
+		return luaL_error(ls, "cannot set timer: %s", strerror(errno));
+	return 0;
+}
+
 static int l_timer_get(struct lua_State *ls)
 {
 	struct itimerspec ts;
@@ -202,6 +556,12 @@ static int l_evdev_open(struct lua_State *ls)
 	int nargs;
 	struct stat statbuf = { 0 };
 	struct libevdev *dev = NULL;
+	struct handoff_entry_t *entry = NULL;
+	struct evdev_t evdev = {
+		.sink_ref = LUA_NOREF,
+		.read_flag = LIBEVDEV_READ_FLAG_NORMAL,
+		.budget = EVDEV_BUDGET_MIN,
+	};
 	const char *devname;
 	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
@@ -215,8 +575,17 @@ static int l_evdev_open(struct lua_State *ls)
 		return luaL_error(ls, "invalid device path %s", devname);
 	}
 
+	if (evdev_open_loopback(ls, devname, &evdev) == 0) {
+		dev = evdev.dev;
+		fd = evdev.fd;
+		goto opened;
+	}
+
+	// still open from before a restart, with what the device sent meanwhile
+	if (info->handoff)
+		entry = handoff_take(info->handoff, HANDOFF_EVDEV, devname, 0);
 	// fd = openat2(info->dev_dir_fd, devname, O_RDONLY | O_NONBLOCK, 0, RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_XDEV);
-	fd = openat(info->dev_dir_fd, devname, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+	fd = entry ? entry->fd : openat(info->dev_dir_fd, devname, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
 	if (fd < 0) {
 		return luaL_error(ls, "cannot open device %s: %s", devname, strerror(errno));
 	}
@@ -230,9 +599,28 @@ static int l_evdev_open(struct lua_State *ls)
 		close(fd);
 		return luaL_error(ls, "cannot create device: %d", rc);
 	}
-
+	// event times comparable with timers, wall clock jumps do not reorder merged sources
+	rc = libevdev_set_clock_id(dev, CLOCK_MONOTONIC);
+	if (rc < 0) {
+		libevdev_free(dev);
+		close(fd);
+		return luaL_error(ls, "cannot use monotonic event times on %s: %s", devname, strerror(-rc));
+	}
+	// the grab came along with the fd and is held throughout, evdev:grab goes by this
+	if (entry)
+		evdev.grabbed = entry->grabbed;
+	// so did the event mask, a script that sets none expects every event; old kernels have none
+	if (entry)
+		evdev_reset_mask(fd);
+
+	evdev.dev = dev;
+	evdev.fd = fd;
+opened:
+	evdev.recorder = info->recorder;
+	evdev.poll_group = info->poll_group;
+	strncpy(evdev.name, devname, EVDEV_NAME_SIZE - 1);
 	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_FD_MAP);
-	L_NEW_OBJECT(dev, REG_NAME_EVDEV, libevdev_free(dev), close(fd));
+	L_NEW_OBJECT(&evdev, REG_NAME_EVDEV, libevdev_free(dev), close(fd), loopback_close_reader(evdev.loop));
 
 	if (nargs > 1) {
 		// user value
@@ -247,15 +635,46 @@ static int l_evdev_open(struct lua_State *ls)
 	return 1;
 }
 
+static void evdev_unlink_sink(struct lua_State *ls, struct evdev_t *evdev)
+{
+	struct evdev_t **p;
+	if (evdev->sink) {
+		evdev_release_keys(evdev);
+		if (evdev->sink->writer == evdev)
+			evdev->sink->writer = NULL;
+		for (p = &evdev->sink->sources; *p; p = &(*p)->next_source) {
+			if (*p == evdev) {
+				*p = evdev->next_source;
+				break;
+			}
+		}
+	}
+	evdev->next_source = NULL;
+	luaL_unref(ls, LUA_REGISTRYINDEX, evdev->sink_ref);
+	evdev->sink_ref = LUA_NOREF;
+	evdev->sink = NULL;
+}
+
 static int l_evdev_close(struct lua_State *ls)
 {
 	int fd;
-	struct libevdev *dev;
+	struct evdev_t *evdev;
 	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
-	fd = libevdev_get_fd(dev);
-	libevdev_free(dev);
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	fd = evdev->fd;
+	libevdev_free(evdev->dev);
+	loopback_close_reader(evdev->loop);
+	evdev->loop = NULL;
+	abs_engine_destroy(evdev->abs);
+	free(evdev->pointer);
+	event_log_destroy(evdev->log);
+	evdev_route_clear(ls, evdev);
+	evdev_unlink_sink(ls, evdev);
+	evdev->dev = NULL;
+	evdev->log = NULL;
+	evdev->abs = NULL;
+	evdev->pointer = NULL;
 	if (fd >= 0) {
 		poll_group_del(info->poll_group, fd);
 		close(fd);
@@ -274,7 +693,7 @@ static int l_evdev_close(struct lua_State *ls)
 static int l_evdev_info(struct lua_State *ls)
 {
 	struct libevdev *dev;
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	dev = ((struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV))->dev;
 	lua_newtable(ls);
 
 	lua_pushstring(ls, libevdev_get_name(dev));
@@ -328,7 +747,7 @@ static int l_evdev_info(struct lua_State *ls)
 		};
 #endif
 		if (libevdev_has_event_type(dev, i)) {
-			const char *name = libevdev_event_type_get_name(i);
+			const char *name = event_type_name(i);
 			if (name) {
 				lua_pushboolean(ls, 1);
 				lua_setfield(ls, -2, name);
@@ -362,7 +781,7 @@ static int l_evdev_info(struct lua_State *ls)
 			abs_info = libevdev_get_abs_info(dev, i);
 			if (!abs_info)
 				continue;
-			name = libevdev_event_code_get_name(EV_ABS, i);
+			name = event_code_name(EV_ABS, i);
 			if (!name)
 				continue;
 
@@ -398,7 +817,7 @@ static int l_evdev_handler(struct lua_State *ls)
 {
 	int nargs;
 	struct libevdev *dev;
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	dev = ((struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV))->dev;
 	(void) dev;
 	nargs = lua_gettop(ls);
 
@@ -417,18 +836,17 @@ static int l_evdev_monitor(struct lua_State *ls)
 	int rc;
 	int fd;
 	int monitor;
-	struct libevdev *dev;
 	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
-	fd = libevdev_get_fd(dev);
+	fd = ((struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV))->fd;
 	if (fd < 0)
 		return luaL_error(ls, "cannot monitor device: %d", fd);
 
 	luaL_checktype(ls, 2, LUA_TBOOLEAN);
 	monitor = lua_toboolean(ls, 2);
 
+	// evdev_handle() reads until EAGAIN, or marks what it left over as pending
 	if (monitor)
-		rc = poll_group_add(info->poll_group, fd);
+		rc = poll_group_add_drained(info->poll_group, fd);
 	else
 		rc = poll_group_del(info->poll_group, fd);
 	if (rc != 0)
@@ -441,148 +859,1279 @@ static int l_evdev_grab(struct lua_State *ls)
 {
 	int rc;
 	int grab;
-	struct libevdev *dev;
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	struct evdev_t *evdev;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
 	luaL_checktype(ls, 2, LUA_TBOOLEAN);
 	grab = lua_toboolean(ls, 2);
-	rc = libevdev_grab(dev, grab ? LIBEVDEV_GRAB : LIBEVDEV_UNGRAB);
+	// nobody else reads a loopback device
+	if (evdev->loop || evdev->grabbed == grab)
+		return 0;
+	// not through libevdev, which knows nothing of a grab that came with a handed over fd
+	rc = ioctl(evdev->fd, EVIOCGRAB, (void *)(intptr_t)grab);
 	if (rc != 0)
-		return luaL_error(ls, "cannot grab device: %d", rc);
+		return luaL_error(ls, "cannot grab device: %s", strerror(errno));
+	evdev->grabbed = grab;
 	return 0;
 }
 
-static int l_evdev_read(struct lua_State *ls)
+static inline int uinput_open(const struct uinput_t *uinput)
 {
-	int rc;
-	int count = 0;
-	int flag = LIBEVDEV_READ_FLAG_NORMAL;
-	struct libevdev *dev;
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
-	lua_newtable(ls);
-	do {
-		struct input_event ev;
-		rc = libevdev_next_event(dev, flag, &ev);
-		if (rc < 0) {
-			if (rc == -EAGAIN && flag == LIBEVDEV_READ_STATUS_SYNC) {
-				flag = LIBEVDEV_READ_FLAG_NORMAL;
-				continue;
+	return uinput->dev || uinput->loop || uinput->adopted;
+}
+
+static inline int evdev_has_sink(const struct evdev_t *evdev)
+{
+	return evdev->sink && uinput_open(evdev->sink);
+}
+
+static inline void evdev_queue(struct evdev_t *evdev, const struct input_event *ev)
+{
+	evdev->queue[evdev->count++] = *ev;
+	evdev->frame |= EVDEV_FRAME_LUA;
+}
+
+/*
+ * a press of a key already down, a release or repeat of a key that is up, or an empty frame.
+ * With several sources, a key pressed through more than one stays down until the last lets go.
+ */
+static inline int uinput_redundant(const struct uinput_t *uinput, int type, int code, int value)
+{
+	if (type == EV_KEY && code >= 0 && code < KEY_CNT) {
+		uint8_t bit = 1u << (code % 8);
+		unsigned byte = code / 8;
+		if (!(uinput->key_down[byte] & bit))
+			return value != 1;
+		if (value == 1)
+			return 1;
+		if (value == 0) {
+			for (const struct evdev_t *source = uinput->sources; source; source = source->next_source) {
+				if (source != uinput->writer && (source->key_down[byte] & bit))
+					return 1;
 			}
-			if (rc == -EINTR)
-				continue;
-			break;
-		}
-		if (rc == LIBEVDEV_READ_STATUS_SYNC && rc != flag) {
-			flag = LIBEVDEV_READ_FLAG_SYNC;
-			continue;
 		}
+	} else if (type == EV_SYN && code == SYN_REPORT) {
+		return uinput->frame_events == 0;
+	}
+	return 0;
+}
 
-		lua_createtable(ls, 0, 3);
-		lua_pushinteger(ls, ev.type);
-		lua_setfield(ls, -2, "type");
-		lua_pushinteger(ls, ev.code);
-		lua_setfield(ls, -2, "code");
-		lua_pushinteger(ls, ev.value);
-		lua_setfield(ls, -2, "value");
-		lua_seti(ls, -2, ++count);
-	} while (1);
-	if (rc != -EAGAIN && count == 0)
-		return luaL_error(ls, "cannot read device: %d", rc);
-	return 1;
+// state after an event went out, or after a redundant one, which may still change who holds a key
+static inline void uinput_commit(struct uinput_t *uinput, int type, int code, int value, int written)
+{
+	if (type == EV_KEY && code >= 0 && code < KEY_CNT) {
+		uint8_t bit = 1u << (code % 8);
+		unsigned byte = code / 8;
+		if (value == 1) {
+			uinput->key_down[byte] |= bit;
+			if (uinput->writer)
+				uinput->writer->key_down[byte] |= bit;
+		} else if (value == 0) {
+			if (uinput->writer)
+				uinput->writer->key_down[byte] &= ~bit;
+			if (written) {
+				uinput->key_down[byte] &= ~bit;
+				for (struct evdev_t *source = uinput->sources; source; source = source->next_source)
+					source->key_down[byte] &= ~bit;
+			}
+		}
+	}
+	if (written)
+		uinput->frame_events = (type == EV_SYN && code == SYN_REPORT) ? 0 : uinput->frame_events + 1;
 }
 
-static int l_evdev_led(struct lua_State *ls)
+// undoes the commit of a written event, when the write of its frame failed
+static inline void uinput_revert(struct uinput_t *uinput, int type, int code, int value)
 {
-	int rc;
-	int index;
-	struct libevdev *dev;
-	uint32_t led_status = 0;	// assuming LED_CNT is less than 32
+	if (type == EV_KEY && code >= 0 && code < KEY_CNT && (value == 0 || value == 1)) {
+		uint8_t bit = 1u << (code % 8);
+		unsigned byte = code / 8;
+		if (value == 1) {
+			uinput->key_down[byte] &= ~bit;
+			if (uinput->writer)
+				uinput->writer->key_down[byte] &= ~bit;
+		} else {
+			uinput->key_down[byte] |= bit;
+			if (uinput->writer)
+				uinput->writer->key_down[byte] |= bit;
+		}
+	}
+}
 
-	dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+// all write helpers return 0 or -errno
+static inline int uinput_write_raw(struct poll_group_t *group, struct uinput_t *uinput, int type, int code, int value)
+{
+	struct input_event ev;
+	if (group->uring == NULL && uinput->dev)
+		return libevdev_uinput_write_event(uinput->dev, type, code, value);
+	// the kernel stamps uinput events itself
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	if (uinput->loop)
+		return loopback_write(uinput->loop, &ev, 1);
+	return poll_group_write(group, uinput->fd, &ev, sizeof(ev));
+}
 
-	index = luaL_optinteger(ls, 2, -1);
-	if (index >= LED_CNT)
-		return luaL_error(ls, "LED out of range: %d", index);
+// queued on the ring and submitted with the next wait when io_uring is in use
+static inline int uinput_write_event(struct poll_group_t *group, struct uinput_t *uinput,
+				     int type, int code, int value)
+{
+	int rc;
+	if (uinput_redundant(uinput, type, code, value)) {
+		uinput_commit(uinput, type, code, value, 0);
+		uinput->redundant++;
+		return 0;
+	}
+	rc = uinput_write_raw(group, uinput, type, code, value);
+	// a key is only known to be down once its press went out
+	if (rc == 0) {
+		uinput_commit(uinput, type, code, value, 1);
+		uinput->written++;
+	}
+	return rc;
+}
 
-	rc = ioctl(libevdev_get_fd(dev), EVIOCGLED(sizeof(led_status)), &led_status);
-	if (rc < 0)
-		return luaL_error(ls, "cannot get LED: %s", strerror(errno));
+// one write for a whole frame, events that change nothing are left out
+static int uinput_write_frame(struct poll_group_t *group, struct uinput_t *uinput, struct input_event *ev, unsigned count)
+{
+	int rc;
+	unsigned kept = 0;
+	// committed as they are filtered, later events of the frame depend on earlier ones
+	for (unsigned i = 0; i < count; i++) {
+		int redundant = uinput_redundant(uinput, ev[i].type, ev[i].code, ev[i].value);
+		uinput_commit(uinput, ev[i].type, ev[i].code, ev[i].value, !redundant);
+		if (!redundant)
+			ev[kept++] = ev[i];
+	}
+	uinput->redundant += count - kept;
+	if (kept == 0)
+		return 0;
+	if (uinput->loop)
+		rc = loopback_write(uinput->loop, ev, kept);
+	else
+		rc = poll_group_write(group, uinput->fd, ev, sizeof(struct input_event) * kept);
+	if (rc == 0) {
+		uinput->written += kept;
+		return 0;
+	}
+	for (unsigned i = kept; i > 0; i--)
+		uinput_revert(uinput, ev[i - 1].type, ev[i - 1].code, ev[i - 1].value);
+	return rc;
+}
 
-	if (index >= 0) {
-		lua_pushboolean(ls, led_status & (1 << index));
-		return 1;
+// releases every key reported down, so that nothing stays stuck when the writer goes away
+static void uinput_release_all(struct poll_group_t *group, struct uinput_t *uinput)
+{
+	uint8_t key_down[sizeof(uinput->key_down)];
+	if (!uinput_open(uinput))
+		return;
+	// whichever source held them, they all go
+	for (struct evdev_t *source = uinput->sources; source; source = source->next_source)
+		memset(source->key_down, 0, sizeof(source->key_down));
+	memcpy(key_down, uinput->key_down, sizeof(key_down));
+	for (unsigned i = 0; i < sizeof(key_down); i++) {
+		for (uint8_t keys = key_down[i]; keys; keys &= keys - 1) {
+			uinput_write_event(group, uinput, EV_KEY, i * 8 + __builtin_ctz(keys), 0);
+			uinput->releases++;
+		}
 	}
+	uinput_write_event(group, uinput, EV_SYN, SYN_REPORT, 0);
+}
 
-	lua_newtable(ls);
-	for (index = 0; index < LED_CNT; index++) {
-		lua_pushboolean(ls, led_status & (1 << index));
-		lua_seti(ls, -2, index);
+// keys it pressed on its sink that no other source holds too are released
+static void evdev_release_keys(struct evdev_t *evdev)
+{
+	struct uinput_t *sink = evdev->sink;
+	unsigned released = 0;
+	if (!uinput_open(sink))
+		return;
+	for (unsigned i = 0; i < sizeof(evdev->key_down); i++) {
+		uint8_t keys = evdev->key_down[i] & sink->key_down[i];
+		for (struct evdev_t *other = sink->sources; other; other = other->next_source) {
+			if (other != evdev)
+				keys &= ~other->key_down[i];
+		}
+		// no longer its own, or the releases would be held back for it
+		evdev->key_down[i] = 0;
+		for (; keys; keys &= keys - 1) {
+			uinput_write_event(evdev->poll_group, sink, EV_KEY, i * 8 + __builtin_ctz(keys), 0);
+			sink->releases++;
+			released++;
+		}
 	}
-	return 1;
+	if (released)
+		uinput_write_event(evdev->poll_group, sink, EV_SYN, SYN_REPORT, 0);
+}
 
+// what is written to its sink until the matching leave is on its behalf, returns the one before
+static inline struct evdev_t *evdev_enter_sink(struct evdev_t *evdev)
+{
+	struct evdev_t *writer;
+	if (evdev->sink == NULL)
+		return NULL;
+	writer = evdev->sink->writer;
+	evdev->sink->writer = evdev;
+	return writer;
 }
 
-#define EVDEV_SET_STR(ls, dev, key)		\
-do { 						\
-	const char *str;			\
-	lua_getfield((ls), -1, #key);		\
-	str = lua_tostring((ls), -1);		\
-	if (str)				\
-		libevdev_set_##key((dev), str);	\
-	lua_pop((ls), 1);			\
-} while (0)
+// either of them may have stopped forwarding there meanwhile
+static inline void evdev_leave_sink(struct evdev_t *evdev, struct evdev_t *writer)
+{
+	if (evdev->sink)
+		evdev->sink->writer = (writer && writer->sink == evdev->sink) ? writer : NULL;
+}
 
-#define EVDEV_SET_INT(ls, dev, key) 			\
-do { 							\
-	int val, rc;					\
-	lua_getfield((ls), -1, #key);			\
-	val = lua_tointegerx((ls), -1, &rc);		\
-	if (rc)						\
-		libevdev_set_id_##key((dev), val);	\
-	lua_pop((ls), 1);				\
-} while (0)
+static inline void evdev_write(struct evdev_t *evdev, int type, int code, int value)
+{
+	recorder_log(evdev->recorder, RECORDER_WRITE, evdev->sink->fd, type, code, value, 0);
+	if (uinput_write_event(evdev->poll_group, evdev->sink, type, code, value) == 0)
+		evdev->stat.events_native++;
+	else
+		evdev->stat.drops++;
+}
 
-#define ABS_INFO_GET(ls, abs_info, key)		\
-do {						\
-	int val, rc;				\
-	lua_getfield((ls), -1, #key);		\
-	val = lua_tointegerx((ls), -1, &rc);	\
-	if (rc)					\
-		(abs_info)->key = val;	\
-	lua_pop((ls), 1);			\
-} while (0)
+// output of native stages, goes to the sink if there is one, otherwise to Lua
+static inline void evdev_emit(struct evdev_t *evdev, const struct input_event *ev)
+{
+	if (evdev_has_sink(evdev)) {
+		evdev_write(evdev, ev->type, ev->code, ev->value);
+		evdev->frame |= EVDEV_FRAME_NATIVE;
+	} else {
+		evdev_queue(evdev, ev);
+	}
+}
 
+static void evdev_route_write(struct evdev_t *evdev, struct route_sink_t *route)
+{
+	struct uinput_t *sink = (struct uinput_t *)route->sink;
+	unsigned count = route->count;
+	route->count = 0;
+	if (count == 0)
+		return;
+	if (!uinput_open(sink)) {
+		evdev->stat.drops += count;
+		return;
+	}
+	for (unsigned i = 0; i < count; i++)
+		recorder_log(evdev->recorder, RECORDER_WRITE, sink->fd, route->frame[i].type, route->frame[i].code,
+			     route->frame[i].value, 0);
+	route->writes++;
+	if (uinput_write_frame(evdev->poll_group, sink, route->frame, count) == 0)
+		evdev->stat.events_native += count;
+	else
+		evdev->stat.drops += count;
+}
 
-static int get_abs_info_from_table(struct lua_State *ls, int table_index, int code, struct input_absinfo *abs_info)
+// ends the frame on every routed sink that has seen events of it
+static void evdev_route_sync(struct evdev_t *evdev, const struct input_event *ev)
 {
-	int rc = 0;
-	lua_getfield(ls, table_index, "abs_info");
-	if (lua_type(ls, -1) == LUA_TTABLE) {
-		const char *key = libevdev_event_code_get_name(EV_ABS, code);
-		if (key) {
-			lua_getfield(ls, -1, key);
-			if (lua_type(ls, -1) == LUA_TTABLE) {
-				ABS_INFO_GET(ls, abs_info, value);
-				ABS_INFO_GET(ls, abs_info, minimum);
-				ABS_INFO_GET(ls, abs_info, maximum);
-				ABS_INFO_GET(ls, abs_info, fuzz);
-				ABS_INFO_GET(ls, abs_info, flat);
-				ABS_INFO_GET(ls, abs_info, resolution);
-				rc = 1;
-			}
-			lua_pop(ls, 1);
-		}
+	for (unsigned i = 0; i < evdev->route->sink_count; i++) {
+		struct route_sink_t *route = evdev->route->sink + i;
+		if (!route->pending)
+			continue;
+		route->frame[route->count++] = *ev;
+		route->pending = 0;
+		evdev_route_write(evdev, route);
 	}
-	lua_pop(ls, 1);
-	return rc;
 }
 
-static void build_evdev_from_table(struct lua_State *ls, struct libevdev *dev)
+// close the frame on whichever side has seen events of it
+static void evdev_sync(struct evdev_t *evdev, const struct input_event *ev)
 {
-	int table_index = lua_gettop(ls);
-	EVDEV_SET_STR(ls, dev, name);
-	EVDEV_SET_STR(ls, dev, phys);
-	EVDEV_SET_STR(ls, dev, uniq);
-	EVDEV_SET_INT(ls, dev, product);
+	if (evdev->frame & EVDEV_FRAME_NATIVE)
+		evdev_write(evdev, EV_SYN, SYN_REPORT, 0);
+	if (evdev->frame & EVDEV_FRAME_LUA)
+		evdev->queue[evdev->count++] = *ev;
+	evdev->frame = 0;
+}
+
+// queue slots that must stay free for output of native stages
+static inline unsigned evdev_reserve(const struct evdev_t *evdev)
+{
+	unsigned reserve = ABS_OUTPUT_MAX;
+	if (evdev->pointer && !evdev_has_sink(evdev))
+		reserve += 3 * (evdev->pointer->count + 1);
+	return reserve;
+}
+
+static void evdev_pointer_flush(struct evdev_t *evdev)
+{
+	struct pointer_stage_t *stage = evdev->pointer;
+	if (stage == NULL || stage->count == 0)
+		return;
+	pointer_stage_process(stage);
+	for (unsigned i = 0; i < stage->count; i++) {
+		struct input_event ev = { .time = stage->time[i], .type = EV_REL };
+		// motion below one count is carried over to the next frame
+		if (stage->dx[i] == 0 && stage->dy[i] == 0)
+			continue;
+		if (stage->dx[i]) {
+			ev.code = REL_X;
+			ev.value = stage->dx[i];
+			evdev_emit(evdev, &ev);
+		}
+		if (stage->dy[i]) {
+			ev.code = REL_Y;
+			ev.value = stage->dy[i];
+			evdev_emit(evdev, &ev);
+		}
+		ev.type = EV_SYN;
+		ev.code = SYN_REPORT;
+		ev.value = 0;
+		evdev_sync(evdev, &ev);
+	}
+	stage->count = 0;
+}
+
+// native stages write to the sink at once, events queued before must reach it through Lua first
+static inline int evdev_frame_bound(const struct evdev_t *evdev)
+{
+	return evdev->merged || ((evdev->abs || evdev->pointer) && evdev_has_sink(evdev));
+}
+
+static inline int is_pointer_motion(const struct input_event *ev)
+{
+	return ev->type == EV_REL && (ev->code == REL_X || ev->code == REL_Y);
+}
+
+static void evdev_dispatch(struct evdev_t *evdev, const struct input_event *ev)
+{
+	// routed codes skip the other stages and Lua
+	if (evdev->route) {
+		struct route_sink_t *route = route_stage_lookup(evdev->route, ev);
+		if (route) {
+			if (route_sink_push(route, ev))
+				evdev_route_write(evdev, route);
+			return;
+		}
+	}
+	// motion of earlier frames held in the batch goes out before anything else that follows it
+	if (evdev->pointer && evdev->pointer->count && ev->type != EV_SYN && !is_pointer_motion(ev))
+		evdev_pointer_flush(evdev);
+	switch (ev->type) {
+	case EV_SYN:
+		if (ev->code != SYN_REPORT)
+			break;
+		if (evdev->route)
+			evdev_route_sync(evdev, ev);
+		// a frame with more than motion is resolved at once, its motion stays in it
+		if (evdev->pointer && (pointer_stage_push(evdev->pointer, &ev->time) || evdev->frame))
+			evdev_pointer_flush(evdev);
+		evdev_sync(evdev, ev);
+		return;
+	case EV_REL:
+		if (evdev->pointer && is_pointer_motion(ev)) {
+			// coalesce motion of the frame, it is resolved in batches
+			if (ev->code == REL_X)
+				pointer_frame_add(&evdev->pointer->frame_dx, ev->value);
+			else
+				pointer_frame_add(&evdev->pointer->frame_dy, ev->value);
+			evdev->pointer->frame_events++;
+			return;
+		}
+		break;
+	case EV_ABS:
+		if (evdev->abs && ev->code < ABS_CNT && evdev->abs->axis[ev->code]) {
+			struct input_event out[ABS_OUTPUT_MAX];
+			int n = abs_engine_process(evdev->abs, ev, out);
+			for (int i = 0; i < n; i++) {
+				if (out[i].type == EV_ABS)
+					evdev_emit(evdev, out + i);
+				else
+					evdev_queue(evdev, out + i);
+			}
+			return;
+		}
+		break;
+	}
+	evdev_queue(evdev, ev);
+}
+
+// a resync after SYN_DROPPED starts, the frame being read is incomplete
+static void evdev_resync_start(struct evdev_t *evdev)
+{
+	evdev->stat.syn_dropped++;
+	evdev->read_flag = LIBEVDEV_READ_FLAG_SYNC;
+	if (evdev->pointer) {
+		evdev->pointer->frame_dx = 0;
+		evdev->pointer->frame_dy = 0;
+		evdev->pointer->frame_events = 0;
+	}
+	// the kernel buffer overflowed, drain harder from now on
+	evdev->budget = EVDEV_BUDGET_MAX;
+}
+
+static void evdev_wake_latency(struct evdev_t *evdev, const struct input_event *ev)
+{
+	int64_t latency = get_time_ns() - event_time_ns(ev);
+	if (latency < 0)
+		return;
+	evdev->stat.wake_count++;
+	evdev->stat.wake_ns += latency;
+	if ((uint64_t)latency > evdev->stat.wake_max_ns)
+		evdev->stat.wake_max_ns = latency;
+}
+
+/*
+ * read pending events through native stages, until the queue is full, the device drained,
+ * or the wakeup budget is used up. Resync deltas are never queued together with normal events.
+ */
+static int evdev_pump(struct evdev_t *evdev)
+{
+	int rc = EVDEV_PUMP_FULL;
+	struct evdev_t *writer;
+	// the next frame of a merged source, or of one with native output, is only read once the one queued was taken
+	if (evdev->count && evdev_frame_bound(evdev))
+		return EVDEV_PUMP_BOUNDARY;
+	writer = evdev_enter_sink(evdev);
+	while (evdev->count + evdev_reserve(evdev) < EVDEV_QUEUE_SIZE) {
+		struct input_event ev;
+		if (evdev->wake_events >= evdev->budget) {
+			rc = EVDEV_PUMP_BUDGET;
+			break;
+		}
+		if (evdev->read_flag == LIBEVDEV_READ_FLAG_SYNC) {
+			if (evdev->count && !evdev->resync) {
+				rc = EVDEV_PUMP_BOUNDARY;
+				break;
+			}
+			evdev->resync = 1;
+		}
+		if (evdev->loop)
+			rc = -loopback_read(evdev->loop, &ev);
+		else
+			rc = libevdev_next_event(evdev->dev, evdev->read_flag, &ev);
+		if (rc < 0) {
+			if (rc == -EAGAIN && evdev->read_flag == LIBEVDEV_READ_FLAG_SYNC) {
+				evdev->read_flag = LIBEVDEV_READ_FLAG_NORMAL;
+				if (evdev->count) {
+					rc = EVDEV_PUMP_BOUNDARY;
+					break;
+				}
+				evdev->resync = 0;
+				continue;
+			}
+			if (rc == -EINTR)
+				continue;
+			break;
+		}
+		recorder_log(evdev->recorder, RECORDER_READ, evdev->fd, ev.type, ev.code, ev.value, 0);
+		if (rc == LIBEVDEV_READ_STATUS_SYNC && evdev->read_flag != LIBEVDEV_READ_FLAG_SYNC) {
+			evdev_resync_start(evdev);
+			continue;
+		}
+		if (evdev->log)
+			event_log_event(evdev->log, evdev->name, &ev);
+		if (rc == LIBEVDEV_READ_STATUS_SYNC)
+			evdev->stat.sync_events++;
+		else if (evdev->wake_events == 0)
+			evdev_wake_latency(evdev, &ev);
+		evdev->stat.events_in++;
+		evdev->wake_events++;
+		if (evdev->passthrough && evdev_has_sink(evdev))
+			evdev_write(evdev, ev.type, ev.code, ev.value);
+		else
+			evdev_dispatch(evdev, &ev);
+		rc = EVDEV_PUMP_FULL;
+		if (evdev->count && ev.type == EV_SYN && ev.code == SYN_REPORT && evdev_frame_bound(evdev)) {
+			rc = EVDEV_PUMP_BOUNDARY;
+			break;
+		}
+	}
+	evdev_pointer_flush(evdev);
+	evdev_leave_sink(evdev, writer);
+	return rc;
+}
+
+// adapt the drain budget to the backlog seen in this wakeup
+static void evdev_wakeup_done(struct evdev_t *evdev)
+{
+	struct evdev_stat_t *stat = &evdev->stat;
+	stat->depth_last = evdev->wake_events;
+	if (stat->depth_last > stat->depth_max)
+		stat->depth_max = stat->depth_last;
+
+	if (evdev->wake_events >= evdev->budget && evdev->budget < EVDEV_BUDGET_MAX)
+		evdev->budget *= 2;
+	else if (evdev->wake_events < evdev->budget / 4 && evdev->budget > EVDEV_BUDGET_MIN)
+		evdev->budget /= 2;
+	evdev->wake_events = 0;
+	// one write for all events logged in the wakeup
+	if (evdev->log)
+		event_log_flush(evdev->log);
+}
+
+// reading stopped short of EAGAIN, what is left is served on the next wakeup as with poll(2)
+static inline void evdev_left_pending(struct evdev_t *evdev, int status)
+{
+	if (status >= 0)
+		poll_group_pending(evdev->poll_group, evdev->fd);
+}
+
+static int l_evdev_read(struct lua_State *ls)
+{
+	int rc;
+	int count = 0;
+	unsigned resync = 0;
+	struct evdev_t *evdev;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	lua_newtable(ls);
+	do {
+		rc = evdev_pump(evdev);
+		resync |= evdev->resync;
+		for (unsigned i = 0; i < evdev->count; i++) {
+			const struct input_event *ev = evdev->queue + i;
+			lua_createtable(ls, 0, 4);
+			lua_pushinteger(ls, ev->type);
+			lua_setfield(ls, -2, "type");
+			lua_pushinteger(ls, ev->code);
+			lua_setfield(ls, -2, "code");
+			lua_pushinteger(ls, ev->value);
+			lua_setfield(ls, -2, "value");
+			lua_pushinteger(ls, event_time_ns(ev));
+			lua_setfield(ls, -2, "time");
+			lua_seti(ls, -2, ++count);
+		}
+		evdev->stat.events_lua += evdev->count;
+		evdev->count = 0;
+		if (evdev->read_flag != LIBEVDEV_READ_FLAG_SYNC)
+			evdev->resync = 0;
+	} while (rc == EVDEV_PUMP_FULL);
+	if (resync) {
+		lua_pushboolean(ls, 1);
+		lua_setfield(ls, -2, "resync");
+	}
+	if (rc < 0 && rc != -EAGAIN && count == 0)
+		return luaL_error(ls, "cannot read device: %d", rc);
+	return 1;
+}
+
+#ifdef LUA_COMPAT_LUAJIT
+/*
+ * returns the queue as an FFI struct input_event array, 0 based, its length and the resync flag.
+ * The array and the events taken from it are only valid until the next events() or read() call,
+ * or the return of the handler: the queue is filled again in place.
+ */
+static int l_evdev_events(struct lua_State *ls)
+{
+	int rc;
+	struct evdev_t *evdev;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+	rc = evdev_pump(evdev);
+	if (rc < 0 && rc != -EAGAIN && evdev->count == 0)
+		return luaL_error(ls, "cannot read device: %d", rc);
+
+	lua_getfield(ls, LUA_REGISTRYINDEX, REG_FFI_CAST);
+	lua_pushlightuserdata(ls, evdev->queue);
+	lua_call(ls, 1, 1);
+	lua_pushinteger(ls, evdev->count);
+	lua_pushboolean(ls, evdev->resync);
+
+	// consumed, the memory stays as is until the next pump
+	evdev->stat.events_lua += evdev->count;
+	evdev->count = 0;
+	if (evdev->read_flag != LIBEVDEV_READ_FLAG_SYNC)
+		evdev->resync = 0;
+	return 3;
+}
+#endif
+
+static int l_evdev_forward(struct lua_State *ls)
+{
+	struct evdev_t *evdev;
+	struct uinput_t *sink = NULL;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	if (!lua_isnoneornil(ls, 2)) {
+		unsigned count = 0;
+		sink = (struct uinput_t *)luaL_checkudata(ls, 2, REG_NAME_UINPUT);
+		for (struct evdev_t *source = sink->sources; source; source = source->next_source)
+			count += (source != evdev);
+		// refused rather than left out of the merge
+		if (count >= EVDEV_MERGE_MAX)
+			return luaL_error(ls, "more than %d devices forward to one device", EVDEV_MERGE_MAX);
+	}
+	evdev_unlink_sink(ls, evdev);
+	if (sink) {
+		evdev->sink = sink;
+		lua_pushvalue(ls, 2);
+		evdev->sink_ref = luaL_ref(ls, LUA_REGISTRYINDEX);
+		evdev->next_source = evdev->sink->sources;
+		evdev->sink->sources = evdev;
+	}
+	return 0;
+}
+
+static int get_code_from_value(struct lua_State *ls, int index, int type)
+{
+	int code;
+	if (lua_type(ls, index) == LUA_TSTRING) {
+		size_t len;
+		const char *name = lua_tolstring(ls, index, &len);
+		const struct event_name_t *entry = event_name_find(name, len);
+		if (entry == NULL || entry->type != type || entry->code < 0)
+			return luaL_error(ls, "unknown code %s", name);
+		code = entry->code;
+	} else {
+		code = (int)luaL_checkinteger(ls, index);
+	}
+	if (code < 0 || code > libevdev_event_type_get_max(type))
+		return luaL_error(ls, "code out of range: %d", code);
+	return code;
+}
+
+static int get_opt_code(struct lua_State *ls, int table_index, const char *key, int type, int def)
+{
+	int code = def;
+	lua_getfield(ls, table_index, key);
+	if (lua_toboolean(ls, -1))
+		code = get_code_from_value(ls, lua_gettop(ls), type);
+	lua_pop(ls, 1);
+	return code;
+}
+
+static double get_opt_number(struct lua_State *ls, int table_index, const char *key, double def)
+{
+	lua_getfield(ls, table_index, key);
+	if (!lua_isnil(ls, -1))
+		def = luaL_checknumber(ls, -1);
+	lua_pop(ls, 1);
+	return def;
+}
+
+static void load_abs_curve(struct lua_State *ls, int table_index, struct abs_axis_t *axis)
+{
+	int16_t points[ABS_CURVE_SIZE];
+	unsigned count;
+
+	lua_getfield(ls, table_index, "curve");
+	switch (lua_type(ls, -1)) {
+	case LUA_TNUMBER:
+	{
+		// power curve, y = x ^ exponent
+		double exponent = lua_tonumber(ls, -1);
+		if (exponent <= 0)
+			luaL_error(ls, "invalid curve exponent %f", exponent);
+		count = ABS_CURVE_SIZE;
+		for (unsigned i = 0; i < count; i++)
+			points[i] = (int16_t)(pow((double)i / (count - 1), exponent) * ABS_NORM_MAX);
+		break;
+	}
+	case LUA_TTABLE:
+	{
+		// evenly spaced output values over the input range, in [0, 1]
+		lua_Integer len = luaL_len(ls, -1);
+		if (len < 2 || len > ABS_CURVE_SIZE)
+			luaL_error(ls, "curve needs 2 to %d points", ABS_CURVE_SIZE);
+		count = (unsigned)len;
+		for (unsigned i = 0; i < count; i++) {
+			double y;
+			lua_geti(ls, -1, i + 1);
+			y = luaL_checknumber(ls, -1);
+			lua_pop(ls, 1);
+			if (y < 0 || y > 1)
+				luaL_error(ls, "curve point out of range: %f", y);
+			points[i] = (int16_t)(y * ABS_NORM_MAX);
+		}
+		break;
+	}
+	default:
+		count = 0;
+	}
+	lua_pop(ls, 1);
+	abs_axis_set_curve(axis, points, count);
+}
+
+static void load_abs_axis(struct lua_State *ls, int table_index, struct libevdev *dev, int code, struct abs_axis_t *axis)
+{
+	const struct input_absinfo *in, *out;
+	int deadzone;
+	int out_code;
+	double threshold, hysteresis;
+
+	in = libevdev_get_abs_info(dev, code);
+	if (in == NULL)
+		luaL_error(ls, "device has no axis %d", code);
+
+	out_code = get_opt_code(ls, table_index, "map", EV_ABS, code);
+	out = libevdev_get_abs_info(dev, out_code);
+	if (out == NULL)
+		out = in;
+
+	// deadzone in raw units, defaults to what the driver reports as flat
+	deadzone = (int)get_opt_number(ls, table_index, "deadzone", in->flat);
+
+	memset(axis, 0, sizeof(struct abs_axis_t));
+	abs_axis_init(axis, in, out, deadzone);
+	axis->out_code = out_code;
+
+	lua_getfield(ls, table_index, "axis");
+	if (lua_isnil(ls, -1) || lua_toboolean(ls, -1))
+		axis->flags |= ABS_AXIS_OUTPUT;
+	lua_pop(ls, 1);
+
+	lua_getfield(ls, table_index, "invert");
+	if (lua_toboolean(ls, -1))
+		axis->flags |= ABS_AXIS_INVERT;
+	lua_pop(ls, 1);
+
+	load_abs_curve(ls, table_index, axis);
+
+	threshold = get_opt_number(ls, table_index, "threshold", 0.5);
+	hysteresis = get_opt_number(ls, table_index, "hysteresis", 0.1);
+	if (threshold <= 0 || threshold > 1 || hysteresis < 0 || hysteresis > threshold)
+		luaL_error(ls, "invalid threshold %f / hysteresis %f", threshold, hysteresis);
+	abs_axis_set_keys(axis,
+		get_opt_code(ls, table_index, "low", EV_KEY, 0),
+		get_opt_code(ls, table_index, "high", EV_KEY, 0),
+		(int)(threshold * ABS_NORM_MAX),
+		(int)((threshold - hysteresis) * ABS_NORM_MAX));
+}
+
+static int l_evdev_abs(struct lua_State *ls)
+{
+	uint64_t mask = 0;
+	struct evdev_t *evdev;
+	struct abs_axis_t *axis;
+	struct abs_engine_t *engine;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	if (!lua_toboolean(ls, 2)) {
+		abs_engine_destroy(evdev->abs);
+		evdev->abs = NULL;
+		return 0;
+	}
+	luaL_checktype(ls, 2, LUA_TTABLE);
+
+	// parse into collectable memory first, so that a bad config leaks nothing
+	axis = (struct abs_axis_t *)lua_newuserdata(ls, sizeof(struct abs_axis_t) * ABS_CNT);
+	lua_pushnil(ls);
+	while (lua_next(ls, 2)) {
+		int value_index = lua_gettop(ls);
+		if (lua_toboolean(ls, value_index)) {
+			int code = get_code_from_value(ls, value_index - 1, EV_ABS);
+			luaL_checktype(ls, value_index, LUA_TTABLE);
+			load_abs_axis(ls, value_index, evdev->dev, code, axis + code);
+			mask |= (uint64_t)1 << code;
+		}
+		lua_pop(ls, 1);
+	}
+
+	engine = abs_engine_create();
+	for (unsigned i = 0; engine && i < ABS_CNT; i++) {
+		if ((mask & ((uint64_t)1 << i)) == 0)
+			continue;
+		engine->axis[i] = (struct abs_axis_t *)malloc(sizeof(struct abs_axis_t));
+		if (engine->axis[i] == NULL) {
+			abs_engine_destroy(engine);
+			engine = NULL;
+			break;
+		}
+		*engine->axis[i] = axis[i];
+	}
+	if (engine == NULL)
+		return luaL_error(ls, "cannot create abs engine");
+
+	abs_engine_destroy(evdev->abs);
+	evdev->abs = engine;
+	return 0;
+}
+
+static int push_pointer_stat(struct lua_State *ls, struct pointer_stage_t *stage)
+{
+	int64_t now = get_time_ns();
+	lua_createtable(ls, 0, 3);
+	lua_pushinteger(ls, stage->events);
+	lua_setfield(ls, -2, "events");
+	lua_pushinteger(ls, stage->frames);
+	lua_setfield(ls, -2, "frames");
+	// events per second since the last report
+	if (now > stage->report_time) {
+		lua_pushnumber(ls, (double)(stage->events - stage->report_events) * 1e9 / (now - stage->report_time));
+		lua_setfield(ls, -2, "rate");
+	}
+	stage->report_events = stage->events;
+	stage->report_time = now;
+	return 1;
+}
+
+static void load_pointer_accel(struct lua_State *ls, int table_index, struct pointer_stage_t *stage)
+{
+	double speed[POINTER_ACCEL_SIZE];
+	double factor[POINTER_ACCEL_SIZE];
+	lua_Integer len;
+
+	lua_getfield(ls, table_index, "accel");
+	if (lua_isnil(ls, -1)) {
+		lua_pop(ls, 1);
+		return;
+	}
+	luaL_checktype(ls, -1, LUA_TTABLE);
+	len = luaL_len(ls, -1);
+	if (len < 1 || len > POINTER_ACCEL_SIZE)
+		luaL_error(ls, "accel needs 1 to %d points", POINTER_ACCEL_SIZE);
+	for (lua_Integer i = 0; i < len; i++) {
+		lua_geti(ls, -1, i + 1);
+		luaL_checktype(ls, -1, LUA_TTABLE);
+		lua_geti(ls, -1, 1);
+		lua_geti(ls, -2, 2);
+		speed[i] = luaL_checknumber(ls, -2);
+		factor[i] = luaL_checknumber(ls, -1);
+		lua_pop(ls, 3);
+		if (speed[i] < 0 || factor[i] < 0 || (i > 0 && speed[i] <= speed[i - 1]))
+			luaL_error(ls, "invalid accel point %d", (int)(i + 1));
+	}
+	lua_pop(ls, 1);
+	pointer_stage_set_accel(stage, speed, factor, (unsigned)len);
+}
+
+static void evdev_route_clear(struct lua_State *ls, struct evdev_t *evdev)
+{
+	struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT };
+	if (evdev->route == NULL)
+		return;
+	// a frame cut short still gets its end
+	evdev_route_sync(evdev, &syn);
+	for (unsigned i = 0; i < evdev->route->sink_count; i++)
+		luaL_unref(ls, LUA_REGISTRYINDEX, evdev->route->sink[i].ref);
+	route_stage_destroy(evdev->route);
+	evdev->route = NULL;
+}
+
+static int push_route_stat(struct lua_State *ls, const struct route_stage_t *stage)
+{
+	lua_createtable(ls, stage->sink_count, 0);
+	for (unsigned i = 0; i < stage->sink_count; i++) {
+		lua_createtable(ls, 0, 2);
+		lua_pushinteger(ls, stage->sink[i].events);
+		lua_setfield(ls, -2, "events");
+		lua_pushinteger(ls, stage->sink[i].writes);
+		lua_setfield(ls, -2, "writes");
+		lua_seti(ls, -2, i + 1);
+	}
+	return 1;
+}
+
+// a code name, a type name as "EV_REL" for all codes of it (code -1), or a number for a key code
+static int get_code_entry(struct lua_State *ls, int idx, int *type, int *code)
+{
+	*type = EV_KEY;
+	if (lua_type(ls, idx) == LUA_TNUMBER) {
+		*code = (int)lua_tointeger(ls, idx);
+	} else if (lua_type(ls, idx) == LUA_TSTRING) {
+		size_t len;
+		const char *name = lua_tolstring(ls, idx, &len);
+		const struct event_name_t *entry = event_name_find(name, len);
+		if (entry == NULL)
+			return EINVAL;
+		*type = entry->type;
+		*code = entry->code;
+	} else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static int route_entry(struct lua_State *ls, struct route_stage_t *stage, unsigned sink, int idx)
+{
+	int type, code;
+	int rc = get_code_entry(ls, idx, &type, &code);
+	if (rc != 0)
+		return rc;
+	return route_stage_set(stage, sink, type, code);
+}
+
+static int l_evdev_route(struct lua_State *ls)
+{
+	int len;
+	struct route_stage_t *stage;
+	struct evdev_t *evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	if (lua_isnone(ls, 2)) {
+		if (evdev->route == NULL)
+			return 0;
+		return push_route_stat(ls, evdev->route);
+	}
+	evdev_route_clear(ls, evdev);
+	if (!lua_toboolean(ls, 2))
+		return 0;
+	luaL_checktype(ls, 2, LUA_TTABLE);
+	len = luaL_len(ls, 2);
+	luaL_argcheck(ls, len > 0 && len <= ROUTE_SINK_MAX, 2, "invalid number of sinks");
+
+	stage = route_stage_create();
+	if (stage == NULL)
+		return luaL_error(ls, "cannot create route stage");
+	// owned by the device from here, so that an error below does not leak it
+	evdev->route = stage;
+	for (int i = 1; i <= len; i++) {
+		int n;
+		struct uinput_t *sink;
+		if (LUA_TTABLE != lua_geti(ls, 2, i)) {
+			evdev_route_clear(ls, evdev);
+			return luaL_error(ls, "invalid route %d", i);
+		}
+		lua_geti(ls, -1, 1);
+		sink = (struct uinput_t *)luaL_testudata(ls, -1, REG_NAME_UINPUT);
+		if (sink == NULL) {
+			evdev_route_clear(ls, evdev);
+			return luaL_error(ls, "route %d has no uinput device", i);
+		}
+		stage->sink[i - 1].sink = sink;
+		stage->sink[i - 1].ref = luaL_ref(ls, LUA_REGISTRYINDEX);
+		stage->sink_count = i;
+		n = luaL_len(ls, -1);
+		for (int j = 2; j <= n; j++) {
+			int rc;
+			lua_geti(ls, -1, j);
+			rc = route_entry(ls, stage, i - 1, lua_gettop(ls));
+			lua_pop(ls, 1);
+			if (rc != 0) {
+				evdev_route_clear(ls, evdev);
+				return luaL_error(ls, "invalid code %d of route %d", j - 1, i);
+			}
+		}
+		lua_pop(ls, 1);
+	}
+	return 0;
+}
+
+#define MASK_BITS_PER_LONG (8 * sizeof(unsigned long))
+#define MASK_LONGS(n) (((n) + MASK_BITS_PER_LONG - 1) / MASK_BITS_PER_LONG)
+
+// codes of each type the kernel filters, as evdev_get_mask_cnt(), the EV_SYN mask is of types
+static const unsigned short mask_code_count[EV_CNT] = {
+	[EV_SYN] = EV_CNT,
+	[EV_KEY] = KEY_CNT,
+	[EV_REL] = REL_CNT,
+	[EV_ABS] = ABS_CNT,
+	[EV_MSC] = MSC_CNT,
+	[EV_SW] = SW_CNT,
+	[EV_LED] = LED_CNT,
+	[EV_SND] = SND_CNT,
+	[EV_FF] = FF_CNT,
+};
+
+// bitmaps in the layout of EVIOCSMASK
+struct event_mask_t {
+	unsigned long types[MASK_LONGS(EV_CNT)];
+	unsigned long codes[EV_CNT][MASK_LONGS(KEY_CNT)];
+};
+
+static inline void mask_set(unsigned long *map, unsigned bit)
+{
+	map[bit / MASK_BITS_PER_LONG] |= 1UL << (bit % MASK_BITS_PER_LONG);
+}
+
+// an entry as of get_code_entry(), a type name lets all codes of the type through
+static int mask_add(struct event_mask_t *mask, int type, int code)
+{
+	if (type <= EV_SYN || type >= EV_CNT || code < -1)
+		return EINVAL;
+	mask_set(mask->types, type);
+	if (code < 0) {
+		memset(mask->codes[type], 0xff, sizeof(mask->codes[type]));
+		return 0;
+	}
+	// codes of types without a code mask pass with their type
+	if (mask_code_count[type] == 0)
+		return 0;
+	if (code >= mask_code_count[type])
+		return EINVAL;
+	mask_set(mask->codes[type], code);
+	return 0;
+}
+
+// code masks first, so that a type let through never passes codes it should not
+static int evdev_set_mask(int fd, const struct event_mask_t *mask)
+{
+	for (int type = EV_CNT - 1; type >= 0; type--) {
+		struct input_mask request;
+		if (mask_code_count[type] == 0)
+			continue;
+		request.type = type;
+		request.codes_size = MASK_LONGS(mask_code_count[type]) * sizeof(unsigned long);
+		request.codes_ptr = (uintptr_t)(type == EV_SYN ? mask->types : mask->codes[type]);
+		if (ioctl(fd, EVIOCSMASK, &request) < 0)
+			return errno;
+	}
+	return 0;
+}
+
+// a mask cannot be taken back, one letting everything through replaces it
+static int evdev_reset_mask(int fd)
+{
+	struct event_mask_t mask;
+	memset(&mask, 0xff, sizeof(mask));
+	return evdev_set_mask(fd, &mask);
+}
+
+/*
+ * Events left out are dropped by the kernel before they are queued for us, they never wake
+ * the loop. EV_SYN always passes, and the kernel drops frames left empty.
+ */
+static int l_evdev_mask(struct lua_State *ls)
+{
+	int rc;
+	int len;
+	struct event_mask_t mask;
+	struct evdev_t *evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	luaL_checkany(ls, 2);
+	if (!lua_toboolean(ls, 2)) {
+		rc = evdev->loop ? 0 : evdev_reset_mask(evdev->fd);
+		if (rc != 0)
+			return luaL_error(ls, "cannot set event mask: %s", strerror(rc));
+		return 0;
+	}
+	luaL_checktype(ls, 2, LUA_TTABLE);
+	memset(&mask, 0, sizeof(mask));
+	mask_set(mask.types, EV_SYN);
+	len = luaL_len(ls, 2);
+	for (int i = 1; i <= len; i++) {
+		int type, code;
+		lua_geti(ls, 2, i);
+		if (get_code_entry(ls, lua_gettop(ls), &type, &code) != 0 || mask_add(&mask, type, code) != 0)
+			return luaL_error(ls, "invalid mask entry %d", i);
+		lua_pop(ls, 1);
+	}
+	// nothing between a loopback device and us to filter
+	if (evdev->loop)
+		return 0;
+	rc = evdev_set_mask(evdev->fd, &mask);
+	if (rc != 0)
+		return luaL_error(ls, "cannot set event mask: %s", strerror(rc));
+	return 0;
+}
+
+static int push_log_stat(struct lua_State *ls, const struct event_log_t *log)
+{
+	lua_createtable(ls, 0, 5);
+	lua_pushinteger(ls, log->events);
+	lua_setfield(ls, -2, "events");
+	lua_pushinteger(ls, log->drops);
+	lua_setfield(ls, -2, "drops");
+	lua_pushinteger(ls, log->writes);
+	lua_setfield(ls, -2, "writes");
+	lua_pushinteger(ls, log->write_errors);
+	lua_setfield(ls, -2, "write_errors");
+	lua_pushinteger(ls, log->bytes);
+	lua_setfield(ls, -2, "bytes");
+	return 1;
+}
+
+static int l_evdev_log(struct lua_State *ls)
+{
+	static const char * const format_name[] = {"text", "json", "binary", NULL};
+	int format = EVENT_LOG_TEXT;
+	const char *path;
+	struct event_log_t *log;
+	struct evdev_t *evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	if (lua_isnone(ls, 2)) {
+		if (evdev->log == NULL)
+			return 0;
+		return push_log_stat(ls, evdev->log);
+	}
+	event_log_destroy(evdev->log);
+	evdev->log = NULL;
+	if (!lua_toboolean(ls, 2))
+		return 0;
+	path = luaL_checkstring(ls, 2);
+	if (!lua_isnoneornil(ls, 3))
+		luaL_checktype(ls, 3, LUA_TTABLE);
+	if (lua_istable(ls, 3)) {
+		lua_getfield(ls, 3, "format");
+		format = luaL_checkoption(ls, -1, "text", format_name);
+		lua_pop(ls, 1);
+	}
+
+	log = event_log_create(path, format);
+	if (log == NULL)
+		return luaL_error(ls, "cannot open log %s: %s", path, strerror(errno));
+	// owned by the device from here, so that an error below does not leak it
+	evdev->log = log;
+	if (lua_istable(ls, 3) && LUA_TTABLE == lua_getfield(ls, 3, "filter")) {
+		int len = luaL_len(ls, -1);
+		for (int i = 1; i <= len; i++) {
+			int type, code;
+			lua_geti(ls, -1, i);
+			if (get_code_entry(ls, lua_gettop(ls), &type, &code) != 0 || event_log_filter(log, type, code) != 0) {
+				event_log_destroy(log);
+				evdev->log = NULL;
+				return luaL_error(ls, "invalid filter entry %d", i);
+			}
+			lua_pop(ls, 1);
+		}
+	}
+	return 0;
+}
+
+static int l_evdev_pointer(struct lua_State *ls)
+{
+	double scale_x, scale_y, dpi;
+	struct evdev_t *evdev;
+	struct pointer_stage_t stage;
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	if (lua_isnone(ls, 2)) {
+		if (evdev->pointer == NULL)
+			return 0;
+		return push_pointer_stat(ls, evdev->pointer);
+	}
+	if (!lua_toboolean(ls, 2)) {
+		if (evdev->pointer) {
+			struct input_event ev = { .type = EV_REL };
+			evdev_pointer_flush(evdev);
+			// motion of the frame being read goes out as read, its SYN_REPORT is still to come
+			ev.code = REL_X;
+			ev.value = evdev->pointer->frame_dx;
+			if (ev.value)
+				evdev_emit(evdev, &ev);
+			ev.code = REL_Y;
+			ev.value = evdev->pointer->frame_dy;
+			if (ev.value)
+				evdev_emit(evdev, &ev);
+		}
+		free(evdev->pointer);
+		evdev->pointer = NULL;
+		return 0;
+	}
+	luaL_checktype(ls, 2, LUA_TTABLE);
+
+	lua_getfield(ls, 2, "scale");
+	if (lua_istable(ls, -1)) {
+		lua_geti(ls, -1, 1);
+		lua_geti(ls, -2, 2);
+		scale_x = luaL_checknumber(ls, -2);
+		scale_y = luaL_checknumber(ls, -1);
+		lua_pop(ls, 2);
+	} else {
+		scale_x = scale_y = luaL_optnumber(ls, -1, 1);
+	}
+	lua_pop(ls, 1);
+
+	// normalize to 1000 dpi
+	dpi = get_opt_number(ls, 2, "dpi", 1000);
+	if (dpi <= 0)
+		return luaL_error(ls, "invalid dpi %f", dpi);
+	pointer_stage_init(&stage, scale_x * 1000 / dpi, scale_y * 1000 / dpi);
+	load_pointer_accel(ls, 2, &stage);
+
+	if (evdev->pointer == NULL) {
+		evdev->pointer = (struct pointer_stage_t *)aligned_alloc(32, sizeof(struct pointer_stage_t));
+		if (evdev->pointer == NULL)
+			return luaL_error(ls, "cannot create pointer stage");
+	} else {
+		// keep the pending batch, and the motion of the frame being read for the new settings
+		evdev_pointer_flush(evdev);
+		stage.frame_dx = evdev->pointer->frame_dx;
+		stage.frame_dy = evdev->pointer->frame_dy;
+		stage.frame_events = evdev->pointer->frame_events;
+	}
+	*evdev->pointer = stage;
+	evdev->pointer->report_time = get_time_ns();
+	return 0;
+}
+
+static int l_evdev_led(struct lua_State *ls)
+{
+	int rc;
+	int index;
+	struct evdev_t *evdev;
+	uint32_t led_status = 0;	// assuming LED_CNT is less than 32
+
+	evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+
+	index = luaL_optinteger(ls, 2, -1);
+	if (index >= LED_CNT)
+		return luaL_error(ls, "LED out of range: %d", index);
+
+	if (evdev->loop) {
+		led_status = evdev->loop->led;
+	} else {
+		rc = ioctl(evdev->fd, EVIOCGLED(sizeof(led_status)), &led_status);
+		if (rc < 0)
+			return luaL_error(ls, "cannot get LED: %s", strerror(errno));
+	}
+
+	if (index >= 0) {
+		lua_pushboolean(ls, led_status & (1 << index));
+		return 1;
+	}
+
+	lua_newtable(ls);
+	for (index = 0; index < LED_CNT; index++) {
+		lua_pushboolean(ls, led_status & (1 << index));
+		lua_seti(ls, -2, index);
+	}
+	return 1;
+
+}
+
+#define EVDEV_SET_STR(ls, dev, key)		\
+do { 						\
+	const char *str;			\
+	lua_getfield((ls), -1, #key);		\
+	str = lua_tostring((ls), -1);		\
+	if (str)				\
+		libevdev_set_##key((dev), str);	\
+	lua_pop((ls), 1);			\
+} while (0)
+
+#define EVDEV_SET_INT(ls, dev, key) 			\
+do { 							\
+	int val, rc;					\
+	lua_getfield((ls), -1, #key);			\
+	val = lua_tointegerx((ls), -1, &rc);		\
+	if (rc)						\
+		libevdev_set_id_##key((dev), val);	\
+	lua_pop((ls), 1);				\
+} while (0)
+
+#define ABS_INFO_GET(ls, abs_info, key)		\
+do {						\
+	int val, rc;				\
+	lua_getfield((ls), -1, #key);		\
+	val = lua_tointegerx((ls), -1, &rc);	\
+	if (rc)					\
+		(abs_info)->key = val;	\
+	lua_pop((ls), 1);			\
+} while (0)
+
+
+static int get_abs_info_from_table(struct lua_State *ls, int table_index, int code, struct input_absinfo *abs_info)
+{
+	int rc = 0;
+	lua_getfield(ls, table_index, "abs_info");
+	if (lua_type(ls, -1) == LUA_TTABLE) {
+		const char *key = event_code_name(EV_ABS, code);
+		if (key) {
+			lua_getfield(ls, -1, key);
+			if (lua_type(ls, -1) == LUA_TTABLE) {
+				ABS_INFO_GET(ls, abs_info, value);
+				ABS_INFO_GET(ls, abs_info, minimum);
+				ABS_INFO_GET(ls, abs_info, maximum);
+				ABS_INFO_GET(ls, abs_info, fuzz);
+				ABS_INFO_GET(ls, abs_info, flat);
+				ABS_INFO_GET(ls, abs_info, resolution);
+				rc = 1;
+			}
+			lua_pop(ls, 1);
+		}
+	}
+	lua_pop(ls, 1);
+	return rc;
+}
+
+static void build_evdev_from_table(struct lua_State *ls, struct libevdev *dev)
+{
+	int table_index = lua_gettop(ls);
+	EVDEV_SET_STR(ls, dev, name);
+	EVDEV_SET_STR(ls, dev, phys);
+	EVDEV_SET_STR(ls, dev, uniq);
+	EVDEV_SET_INT(ls, dev, product);
 	EVDEV_SET_INT(ls, dev, vendor);
 	EVDEV_SET_INT(ls, dev, bustype);
 	EVDEV_SET_INT(ls, dev, version);
@@ -609,9 +2158,12 @@ static void build_evdev_from_table(struct lua_State *ls, struct libevdev *dev)
 		lua_pushnil(ls);
 		while (lua_next(ls, -2)) {
 			if (lua_type(ls, -2) == LUA_TSTRING && lua_toboolean(ls, -1)) {
-				int type;
-				const char *key = lua_tostring(ls, -2);
-				type = libevdev_event_type_from_name(key);
+				int type = -1;
+				size_t len;
+				const char *key = lua_tolstring(ls, -2, &len);
+				const struct event_name_t *entry = event_name_find(key, len);
+				if (entry && entry->code < 0)
+					type = entry->type;
 				if (type >= 0) {
 					int max = libevdev_event_type_get_max(type);
 					// libevdev_enable_event_type(dev, type);
@@ -630,24 +2182,239 @@ static void build_evdev_from_table(struct lua_State *ls, struct libevdev *dev)
 	lua_pop(ls, 1);
 }
 
+// codes produced by native stages must exist on a sink cloned from the device
+static void enable_native_codes(struct evdev_t *evdev)
+{
+	if (evdev->abs == NULL)
+		return;
+	for (unsigned i = 0; i < ABS_CNT; i++) {
+		const struct abs_axis_t *axis = evdev->abs->axis[i];
+		if (axis == NULL)
+			continue;
+		if (axis->key_low)
+			libevdev_enable_event_code(evdev->dev, EV_KEY, axis->key_low, NULL);
+		if (axis->key_high)
+			libevdev_enable_event_code(evdev->dev, EV_KEY, axis->key_high, NULL);
+		if ((axis->flags & ABS_AXIS_OUTPUT) && !libevdev_has_event_code(evdev->dev, EV_ABS, axis->out_code))
+			libevdev_enable_event_code(evdev->dev, EV_ABS, axis->out_code, libevdev_get_abs_info(evdev->dev, i));
+	}
+}
+
+static void copy_identity(struct libevdev *dst, const struct libevdev *src)
+{
+	libevdev_set_name(dst, libevdev_get_name(src));
+	libevdev_set_id_bustype(dst, libevdev_get_id_bustype(src));
+	libevdev_set_id_vendor(dst, libevdev_get_id_vendor(src));
+	libevdev_set_id_product(dst, libevdev_get_id_product(src));
+	libevdev_set_id_version(dst, libevdev_get_id_version(src));
+}
+
+static void merge_capabilities(struct libevdev *dst, const struct libevdev *src)
+{
+	for (unsigned prop = 0; prop <= INPUT_PROP_MAX; prop++) {
+		if (libevdev_has_property(src, prop))
+			libevdev_enable_property(dst, prop);
+	}
+	for (unsigned type = EV_SYN + 1; type <= EV_MAX; type++) {
+		int max = libevdev_event_type_get_max(type);
+		if (!libevdev_has_event_type(src, type))
+			continue;
+		libevdev_enable_event_type(dst, type);
+		for (int code = 0; code <= max; code++) {
+			const void *data = NULL;
+			int rep[REP_CNT];
+			if (!libevdev_has_event_code(src, type, code) || libevdev_has_event_code(dst, type, code))
+				continue;
+			if (type == EV_ABS) {
+				data = libevdev_get_abs_info(src, code);
+			} else if (type == EV_REP) {
+				libevdev_get_repeat(src, &rep[REP_DELAY], &rep[REP_PERIOD]);
+				data = &rep[code];
+			}
+			libevdev_enable_event_code(dst, type, code, data);
+		}
+	}
+}
+
+// one sink for several sources, ids from the first one, capabilities of all of them
+static void build_evdev_from_array(struct lua_State *ls, struct libevdev *dev)
+{
+	int len = luaL_len(ls, 1);
+	for (int i = 1; i <= len; i++) {
+		struct evdev_t *evdev;
+		lua_geti(ls, 1, i);
+		evdev = (struct evdev_t *)luaL_checkudata(ls, -1, REG_NAME_EVDEV);
+		lua_pop(ls, 1);
+		if (evdev->dev == NULL)
+			luaL_error(ls, "device %d is closed", i);
+		enable_native_codes(evdev);
+		if (i == 1)
+			copy_identity(dev, evdev->dev);
+		merge_capabilities(dev, evdev->dev);
+	}
+}
+
+// the evdev side of a loopback device, 0 when devname is one
+static int evdev_open_loopback(struct lua_State *ls, const char *devname, struct evdev_t *evdev)
+{
+	int fd;
+	struct libevdev *dev;
+	struct uinput_t *uinput;
+
+	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_LOOPBACK);
+	lua_getfield(ls, -1, devname);
+	uinput = (struct uinput_t *)luaL_testudata(ls, -1, REG_NAME_UINPUT);
+	lua_pop(ls, 2);
+	if (uinput == NULL || uinput->loop == NULL)
+		return ENOENT;
+
+	dev = libevdev_new();
+	if (dev == NULL)
+		return luaL_error(ls, "cannot create device: %d", -ENOMEM);
+	copy_identity(dev, uinput->loop->dev);
+	merge_capabilities(dev, uinput->loop->dev);
+	fd = loopback_open_reader(uinput->loop);
+	if (fd < 0) {
+		libevdev_free(dev);
+		return luaL_error(ls, "cannot open device %s: %s", devname, strerror(-fd));
+	}
+	evdev->dev = dev;
+	evdev->fd = fd;
+	evdev->loop = uinput->loop;
+	return 0;
+}
+
+static const char *uinput_node_name(const struct libevdev_uinput *dev)
+{
+	const char *ptr = NULL;
+	const char *node_name = libevdev_uinput_get_devnode((struct libevdev_uinput *)dev);
+	if (node_name)
+		ptr = strrchr(node_name, '/');
+	return ptr ? ptr + 1 : node_name;
+}
+
+static const char *uinput_node(const struct uinput_t *uinput)
+{
+	return uinput->adopted ? uinput->node : uinput_node_name(uinput->dev);
+}
+
+static inline uint64_t spec_hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+// identity and capabilities a uinput device is created with, FNV-1a
+static uint64_t device_spec(const struct libevdev *dev)
+{
+	int id[4];
+	const char *name = libevdev_get_name(dev);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	hash = spec_hash(hash, name, name ? strlen(name) : 0);
+	id[0] = libevdev_get_id_bustype(dev);
+	id[1] = libevdev_get_id_vendor(dev);
+	id[2] = libevdev_get_id_product(dev);
+	id[3] = libevdev_get_id_version(dev);
+	hash = spec_hash(hash, id, sizeof(id));
+	for (int type = 0; type < EV_CNT; type++) {
+		int max;
+		if (!libevdev_has_event_type(dev, type))
+			continue;
+		hash = spec_hash(hash, &type, sizeof(type));
+		max = libevdev_event_type_get_max(type);
+		for (int code = 0; code <= max; code++) {
+			if (!libevdev_has_event_code(dev, type, code))
+				continue;
+			hash = spec_hash(hash, &code, sizeof(code));
+			if (type == EV_ABS) {
+				const struct input_absinfo *abs = libevdev_get_abs_info(dev, code);
+				int range[5] = { abs->minimum, abs->maximum, abs->fuzz, abs->flat, abs->resolution };
+				hash = spec_hash(hash, range, sizeof(range));
+			}
+		}
+	}
+	for (int prop = 0; prop < INPUT_PROP_CNT; prop++) {
+		if (libevdev_has_property(dev, prop))
+			hash = spec_hash(hash, &prop, sizeof(prop));
+	}
+	return hash;
+}
+
+static void uinput_destroy_adopted(int fd)
+{
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+}
+
+// kept in a weak set, lua_device_handoff() finds it there
+static void uinput_track(struct lua_State *ls)
+{
+	lua_getfield(ls, LUA_REGISTRYINDEX, REG_UINPUTS);
+	lua_pushvalue(ls, -2);
+	lua_pushboolean(ls, 1);
+	lua_rawset(ls, -3);
+	lua_pop(ls, 1);
+}
+
+// the device as handed over by an earlier process, with the keys it reported down
+static int uinput_adopt(struct lua_State *ls, struct lua_device_info_t *info, uint64_t spec, const char *source)
+{
+	struct uinput_t uinput = { 0 };
+	struct handoff_entry_t *entry = info->handoff ? handoff_take(info->handoff, HANDOFF_UINPUT, source, spec) : NULL;
+
+	if (entry == NULL)
+		return 0;
+	uinput.fd = entry->fd;
+	uinput.spec = spec;
+	snprintf(uinput.source, sizeof(uinput.source), "%s", source);
+	uinput.adopted = 1;
+	snprintf(uinput.node, sizeof(uinput.node), "%s", entry->node);
+	memcpy(uinput.key_down, entry->key_down, sizeof(uinput.key_down));
+	L_NEW_OBJECT(&uinput, REG_NAME_UINPUT, uinput_destroy_adopted(entry->fd));
+	uinput_track(ls);
+	return 1;
+}
+
 static int l_uinput_create(struct lua_State *ls)
 {
 	int rc, needs_free_dev;
+	uint64_t spec;
+	const char *source = "";
 	struct libevdev *dev;
  	struct libevdev_uinput *uinput_dev;
+	struct uinput_t uinput = { 0 };
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
 	if (lua_type(ls, 1) == LUA_TUSERDATA) {
-		dev = *(struct libevdev **)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+		struct evdev_t *evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+		dev = evdev->dev;
 		needs_free_dev = 0;
+		source = evdev->name;
+		enable_native_codes(evdev);
 	} else {
+		int merge;
 		luaL_checktype(ls, 1, LUA_TTABLE);
+		merge = (LUA_TUSERDATA == lua_geti(ls, 1, 1));
+		lua_pop(ls, 1);
 		dev = libevdev_new();
 		needs_free_dev = 1;
 
-		// load from table
-		build_evdev_from_table(ls, dev);
+		if (merge)
+			build_evdev_from_array(ls, dev);
+		else
+			// load from table
+			build_evdev_from_table(ls, dev);
 	}
 
+	spec = device_spec(dev);
+	if (uinput_adopt(ls, info, spec, source)) {
+		if (needs_free_dev)
+			libevdev_free(dev);
+		return 1;
+	}
 	rc = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uinput_dev);
 	if (needs_free_dev)
 		libevdev_free(dev);
@@ -655,18 +2422,101 @@ static int l_uinput_create(struct lua_State *ls)
 	if (rc < 0)
 		return luaL_error(ls, "cannot create device: %d", rc);
 
-	L_NEW_OBJECT(uinput_dev, REG_NAME_UINPUT, libevdev_uinput_destroy(uinput_dev));
+	uinput.dev = uinput_dev;
+	uinput.fd = libevdev_uinput_get_fd(uinput_dev);
+	uinput.spec = spec;
+	snprintf(uinput.source, sizeof(uinput.source), "%s", source);
+	L_NEW_OBJECT(&uinput, REG_NAME_UINPUT, libevdev_uinput_destroy(uinput_dev));
+	uinput_track(ls);
+	// its own hotplug event goes nowhere
+	if (info->hotplug && uinput_node_name(uinput_dev))
+		hotplug_filter_own(info->hotplug, uinput_node_name(uinput_dev), 1);
 	// lua_pushlightuserdata(ls, uinput_dev);
 	// luaL_setmetatable(ls, REG_NAME_UINPUT);
 
 	return 1;
 }
 
+/*
+ * An in-memory device: what is written to the returned uinput object is read back by
+ * device.open() of its name, and goes through the same paths as events of a real device.
+ */
+static int l_loopback_create(struct lua_State *ls)
+{
+	struct libevdev *dev;
+	struct loopback_t *loop;
+	struct uinput_t uinput = { 0 };
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+
+	lua_settop(ls, 1);
+	dev = libevdev_new();
+	if (dev == NULL)
+		return luaL_error(ls, "cannot create device: %d", -ENOMEM);
+	if (lua_type(ls, 1) == LUA_TUSERDATA) {
+		struct evdev_t *evdev = (struct evdev_t *)luaL_checkudata(ls, 1, REG_NAME_EVDEV);
+		enable_native_codes(evdev);
+		copy_identity(dev, evdev->dev);
+		merge_capabilities(dev, evdev->dev);
+	} else {
+		int merge;
+		luaL_checktype(ls, 1, LUA_TTABLE);
+		merge = (LUA_TUSERDATA == lua_geti(ls, 1, 1));
+		lua_pop(ls, 1);
+		if (merge)
+			build_evdev_from_array(ls, dev);
+		else
+			build_evdev_from_table(ls, dev);
+	}
+
+	loop = loopback_create(dev, info->loopback_count++);
+	if (loop == NULL) {
+		libevdev_free(dev);
+		return luaL_error(ls, "cannot create device: %d", -errno);
+	}
+	uinput.loop = loop;
+	uinput.fd = loop->fd;
+	L_NEW_OBJECT(&uinput, REG_NAME_UINPUT, loopback_put(loop));
+
+	// found by name in device.open()
+	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_LOOPBACK);
+	lua_pushvalue(ls, -2);
+	lua_setfield(ls, -2, loop->name);
+	lua_pop(ls, 1);
+	return 1;
+}
+
 static int l_uinput_close(struct lua_State *ls)
 {
-	struct libevdev_uinput *dev;
-	dev = *(struct libevdev_uinput **)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
-	libevdev_uinput_destroy(dev);
+	struct uinput_t *uinput;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	if (uinput->player) {
+		if (info->macro)
+			macro_sched_unlink(info->macro, uinput->player);
+		macro_player_cleanup(uinput->player);
+		free(uinput->player);
+		uinput->player = NULL;
+	}
+	uinput_release_all(info->poll_group, uinput);
+	// queued writes refer to the fd
+	poll_group_flush(info->poll_group);
+	if (info->hotplug && (uinput->dev || uinput->adopted) && uinput_node(uinput))
+		hotplug_filter_own(info->hotplug, uinput_node(uinput), 0);
+	libevdev_uinput_destroy(uinput->dev);
+	if (uinput->adopted)
+		uinput_destroy_adopted(uinput->fd);
+	// evdev objects forwarding here may still hold a reference
+	uinput->dev = NULL;
+	uinput->adopted = 0;
+	if (uinput->loop) {
+		luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_LOOPBACK);
+		lua_pushnil(ls);
+		lua_setfield(ls, -2, uinput->loop->name);
+		lua_pop(ls, 1);
+		// an evdev object reading it keeps the queue
+		loopback_put(uinput->loop);
+		uinput->loop = NULL;
+	}
 
 	lua_pushnil(ls);
 	lua_setmetatable(ls, -2);
@@ -675,14 +2525,13 @@ static int l_uinput_close(struct lua_State *ls)
 
 static int l_uinput_name(struct lua_State *ls)
 {
-	struct libevdev_uinput *dev;
-	const char *node_name;
-	const char *ptr = NULL;
-	dev = *(struct libevdev_uinput **)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
-	node_name = libevdev_uinput_get_devnode(dev);
-	if (node_name)
-		ptr = strrchr(node_name, '/');
-	lua_pushstring(ls, ptr ? ptr + 1 : node_name);
+	struct uinput_t *uinput;
+	uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	if (uinput->loop) {
+		lua_pushstring(ls, uinput->loop->name);
+		return 1;
+	}
+	lua_pushstring(ls, uinput_node(uinput));
 	return 1;
 }
 
@@ -690,9 +2539,10 @@ static int l_uinput_write(struct lua_State *ls)
 {
 	int rc;
 	int len;
-	struct libevdev_uinput *dev;
+	struct uinput_t *uinput;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
-	dev = *(struct libevdev_uinput **)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
 	luaL_checktype(ls, 2, LUA_TTABLE);
 	len = luaL_len(ls, 2);
 	for (int i = 1; i <= len; ++i) {
@@ -700,6 +2550,10 @@ static int l_uinput_write(struct lua_State *ls)
 		int elem;
 		rc = lua_geti(ls, 2, i);
 		elem = lua_gettop(ls);
+#ifdef LUA_COMPAT_LUAJIT
+		// events of evdev:events() are written as they are
+		if (lua_type(ls, elem) != LUA_TCDATA)
+#endif
 		luaL_checktype(ls, elem, LUA_TTABLE);
 		lua_getfield(ls, elem, "type");
 		ev.type = luaL_checkinteger(ls, -1);
@@ -709,18 +2563,311 @@ static int l_uinput_write(struct lua_State *ls)
 		ev.value = luaL_checkinteger(ls, -1);
 		lua_pop(ls, 4);
 
-		rc = libevdev_uinput_write_event(dev, ev.type, ev.code, ev.value);
+		recorder_log(info->recorder, RECORDER_WRITE, uinput->fd, ev.type, ev.code, ev.value, 0);
+		rc = uinput_write_event(info->poll_group, uinput, ev.type, ev.code, ev.value);
 		if (rc != 0)
 			return luaL_error(ls, "cannot write device: %d", rc);
 	}
 	return 0;
 }
 
+static void macro_emit(void *sink, const struct input_event *ev, unsigned count, void *ctx)
+{
+	struct lua_device_info_t *info = (struct lua_device_info_t *)ctx;
+	struct uinput_t *uinput = (struct uinput_t *)sink;
+	for (unsigned i = 0; i < count; i++) {
+		recorder_log(info->recorder, RECORDER_WRITE, uinput->fd, ev[i].type, ev[i].code, ev[i].value, 0);
+		if (uinput_write_event(info->poll_group, uinput, ev[i].type, ev[i].code, ev[i].value) != 0)
+			info->macro->drops++;
+	}
+}
+
+static void macro_arm(struct macro_sched_t *sched, int64_t due)
+{
+	struct itimerspec ts = { 0 };
+	if (due == sched->armed)
+		return;
+	ts.it_value.tv_sec = due / 1000000000;
+	ts.it_value.tv_nsec = due % 1000000000;
+	timerfd_settime(sched->fd, due ? TFD_TIMER_ABSTIME : 0, &ts, NULL);
+	sched->armed = due;
+}
+
+// all players share one timer, set to the earliest frame due
+static struct macro_sched_t *macro_sched(struct lua_State *ls)
+{
+	int fd;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	if (info->macro)
+		return info->macro;
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		luaL_error(ls, "cannot create timer: %s", strerror(errno));
+	info->macro = (struct macro_sched_t *)malloc(sizeof(struct macro_sched_t));
+	if (info->macro == NULL) {
+		close(fd);
+		luaL_error(ls, "cannot create macro player");
+	}
+	macro_sched_init(info->macro, fd);
+	poll_group_add_drained(info->poll_group, fd);
+	return info->macro;
+}
+
+static void macro_sched_destroy(struct lua_device_info_t *info)
+{
+	if (info->macro == NULL)
+		return;
+	poll_group_del(info->poll_group, info->macro->fd);
+	close(info->macro->fd);
+	free(info->macro);
+	info->macro = NULL;
+}
+
+static int macro_handle(struct lua_device_info_t *info)
+{
+	uint64_t expirations;
+	struct macro_sched_t *sched = info->macro;
+	if (read(sched->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return LUA_OK;
+	sched->wakeups++;
+	sched->armed = 0;
+	macro_arm(sched, macro_sched_run(sched, info->now, macro_emit, info));
+	return LUA_OK;
+}
+
+static struct macro_player_t *uinput_player(struct lua_State *ls, struct uinput_t *uinput)
+{
+	if (uinput->player == NULL) {
+		uinput->player = (struct macro_player_t *)malloc(sizeof(struct macro_player_t));
+		if (uinput->player == NULL)
+			luaL_error(ls, "cannot create macro player");
+		macro_player_init(uinput->player, uinput);
+	}
+	return uinput->player;
+}
+
+static unsigned macro_add_step(struct macro_step_t *out, unsigned count, lua_Number *delay,
+			       int type, int code, int value)
+{
+	if (out) {
+		out[count].delay = (uint32_t)(*delay * 1000);
+		out[count].id = 0;
+		out[count].type = type;
+		out[count].code = code;
+		out[count].value = value;
+	}
+	*delay = 0;
+	return count + 1;
+}
+
+// numbers are delays in ms, a frame without SYN_REPORT gets one before the next delay
+static unsigned macro_compile(struct lua_State *ls, int idx, struct macro_step_t *out)
+{
+	unsigned count = 0;
+	unsigned frame = 0;
+	lua_Number delay = 0;
+	int len = luaL_len(ls, idx);
+
+	for (int i = 1; i <= len; i++) {
+		int type = lua_geti(ls, idx, i);
+		if (type == LUA_TNUMBER) {
+			delay += lua_tonumber(ls, -1);
+			if (!(delay >= 0 && delay <= 3600000))
+				luaL_error(ls, "invalid delay at step %d", i);
+			if (frame)
+				count = macro_add_step(out, count, &(lua_Number){ 0 }, EV_SYN, SYN_REPORT, 0);
+			frame = 0;
+		} else if (type == LUA_TTABLE) {
+			int ev_type, ev_code, ev_value;
+			lua_getfield(ls, -1, "type");
+			ev_type = luaL_checkinteger(ls, -1);
+			lua_getfield(ls, -2, "code");
+			ev_code = luaL_checkinteger(ls, -1);
+			lua_getfield(ls, -3, "value");
+			ev_value = luaL_checkinteger(ls, -1);
+			lua_pop(ls, 3);
+			count = macro_add_step(out, count, &delay, ev_type, ev_code, ev_value);
+			if (ev_type == EV_SYN && ev_code == SYN_REPORT)
+				frame = 0;
+			else if (++frame == MACRO_FRAME_MAX)
+				luaL_error(ls, "frame too long at step %d", i);
+		} else {
+			luaL_error(ls, "invalid macro step %d", i);
+		}
+		lua_pop(ls, 1);
+	}
+	if (frame)
+		count = macro_add_step(out, count, &delay, EV_SYN, SYN_REPORT, 0);
+	return count;
+}
+
+static void load_hotplug_rule(struct lua_State *ls, int table_index, struct hotplug_rule_t *rule)
+{
+	int len;
+	memset(rule, 0, sizeof(struct hotplug_rule_t));
+	lua_getfield(ls, table_index, "name");
+	if (!lua_isnil(ls, -1))
+		strncpy(rule->name, luaL_checkstring(ls, -1), HOTPLUG_NAME_SIZE - 1);
+	lua_pop(ls, 1);
+	rule->bustype = (int)get_opt_number(ls, table_index, "bustype", -1);
+	rule->vendor = (int)get_opt_number(ls, table_index, "vendor", -1);
+	rule->product = (int)get_opt_number(ls, table_index, "product", -1);
+
+	if (LUA_TTABLE == lua_getfield(ls, table_index, "capabilities")) {
+		len = luaL_len(ls, -1);
+		for (int i = 1; i <= len; i++) {
+			int type, code;
+			lua_geti(ls, -1, i);
+			if (get_code_entry(ls, lua_gettop(ls), &type, &code) != 0 ||
+			    hotplug_rule_require(rule, type, code) != 0)
+				luaL_error(ls, "invalid capability %d", i);
+			lua_pop(ls, 1);
+		}
+	}
+	lua_pop(ls, 1);
+}
+
+static int l_device_filter(struct lua_State *ls)
+{
+	int len;
+	struct hotplug_rule_t rule[HOTPLUG_RULE_MAX];
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+
+	if (info->hotplug == NULL)
+		return luaL_error(ls, "hotplug filter not available");
+	if (lua_isnone(ls, 1)) {
+		lua_createtable(ls, 0, 2);
+		lua_pushinteger(ls, info->hotplug->passed);
+		lua_setfield(ls, -2, "passed");
+		lua_pushinteger(ls, info->hotplug->skipped);
+		lua_setfield(ls, -2, "skipped");
+		return 1;
+	}
+	if (!lua_toboolean(ls, 1)) {
+		info->hotplug->rule_count = 0;
+		return 0;
+	}
+	luaL_checktype(ls, 1, LUA_TTABLE);
+	len = luaL_len(ls, 1);
+	luaL_argcheck(ls, len > 0 && len <= HOTPLUG_RULE_MAX, 1, "invalid number of rules");
+	for (int i = 1; i <= len; i++) {
+		if (LUA_TTABLE != lua_geti(ls, 1, i))
+			return luaL_error(ls, "invalid rule %d", i);
+		load_hotplug_rule(ls, lua_gettop(ls), rule + i - 1);
+		lua_pop(ls, 1);
+	}
+	// all or nothing, a bad rule leaves the filter as it was
+	memcpy(info->hotplug->rule, rule, sizeof(struct hotplug_rule_t) * len);
+	info->hotplug->rule_count = len;
+	return 0;
+}
+
+static int l_macro_compile(struct lua_State *ls)
+{
+	unsigned count;
+	struct macro_t *macro;
+	luaL_checktype(ls, 1, LUA_TTABLE);
+	count = macro_compile(ls, 1, NULL);
+	luaL_argcheck(ls, count > 0, 1, "empty macro");
+	luaL_argcheck(ls, count <= MACRO_QUEUE_MAX, 1, "macro too long");
+	macro = (struct macro_t *)lua_newuserdata(ls, sizeof(struct macro_t) + sizeof(struct macro_step_t) * count);
+	macro->count = count;
+	macro_compile(ls, 1, macro->step);
+	luaL_setmetatable(ls, REG_NAME_MACRO);
+	return 1;
+}
+
+static int l_macro_len(struct lua_State *ls)
+{
+	struct macro_t *macro = (struct macro_t *)luaL_checkudata(ls, 1, REG_NAME_MACRO);
+	lua_pushinteger(ls, macro->count);
+	return 1;
+}
+
+static int l_uinput_play(struct lua_State *ls)
+{
+	int rc;
+	struct uinput_t *uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	struct macro_t *macro = (struct macro_t *)luaL_checkudata(ls, 2, REG_NAME_MACRO);
+	struct macro_sched_t *sched = macro_sched(ls);
+	struct macro_player_t *player = uinput_player(ls, uinput);
+
+	if (++sched->last_id == 0)
+		sched->last_id = 1;
+	rc = macro_player_queue(player, macro->step, macro->count, sched->last_id, get_time_ns());
+	if (rc != 0)
+		return luaL_error(ls, "cannot queue macro: %s", strerror(rc));
+	sched->plays++;
+	macro_sched_link(sched, player);
+	if (sched->armed == 0 || player->due < sched->armed)
+		macro_arm(sched, player->due);
+	lua_pushinteger(ls, sched->last_id);
+	return 1;
+}
+
+static int l_uinput_cancel(struct lua_State *ls)
+{
+	unsigned removed, n;
+	struct input_event out[MACRO_FRAME_MAX];
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	struct uinput_t *uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	lua_Integer id = luaL_optinteger(ls, 2, 0);
+
+	if (uinput->player == NULL || info->macro == NULL) {
+		lua_pushinteger(ls, 0);
+		return 1;
+	}
+	removed = macro_player_cancel(uinput->player, (uint32_t)id);
+	if (removed) {
+		info->macro->cancels++;
+		// keys pressed by a macro cut short are released, a frame at a time
+		while ((n = macro_player_release(uinput->player, (uint32_t)id, out, MACRO_FRAME_MAX - 1)) > 0) {
+			memset(out + n, 0, sizeof(struct input_event));
+			out[n].type = EV_SYN;
+			out[n].code = SYN_REPORT;
+			macro_emit(uinput, out, n + 1, info);
+		}
+		// the next frame may now be due earlier than the timer is set
+		if (uinput->player->count && (info->macro->armed == 0 || uinput->player->due < info->macro->armed))
+			macro_arm(info->macro, uinput->player->due);
+	}
+	lua_pushinteger(ls, removed);
+	return 1;
+}
+
+static int l_uinput_stat(struct lua_State *ls)
+{
+	struct uinput_t *uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	lua_createtable(ls, 0, 3);
+	lua_pushinteger(ls, uinput->written);
+	lua_setfield(ls, -2, "written");
+	lua_pushinteger(ls, uinput->redundant);
+	lua_setfield(ls, -2, "redundant");
+	lua_pushinteger(ls, uinput->releases);
+	lua_setfield(ls, -2, "releases");
+	if (uinput->loop) {
+		lua_pushinteger(ls, uinput->loop->count);
+		lua_setfield(ls, -2, "queued");
+		lua_pushinteger(ls, uinput->loop->drops);
+		lua_setfield(ls, -2, "drops");
+	}
+	return 1;
+}
+
+static int l_uinput_rate(struct lua_State *ls)
+{
+	struct uinput_t *uinput = (struct uinput_t *)luaL_checkudata(ls, 1, REG_NAME_UINPUT);
+	lua_Integer rate = luaL_checkinteger(ls, 2);
+	luaL_argcheck(ls, rate > 0 && rate <= MACRO_MAX_RATE, 2, "invalid rate");
+	macro_player_set_rate(uinput_player(ls, uinput), (unsigned)rate);
+	return 0;
+}
+
 static int l_event_type_name(struct lua_State *ls)
 {
 	int type;
 	type = luaL_checkinteger(ls, 1);
-	lua_pushstring(ls, libevdev_event_type_get_name(type));
+	lua_pushstring(ls, event_type_name(type));
 	return 1;
 }
 
@@ -729,7 +2876,7 @@ static int l_event_code_name(struct lua_State *ls)
 	int type, code;
 	type = luaL_checkinteger(ls, 1);
 	code = luaL_checkinteger(ls, 2);
-	lua_pushstring(ls, libevdev_event_code_get_name(type, code));
+	lua_pushstring(ls, event_code_name(type, code));
 	return 1;
 }
 
@@ -745,28 +2892,25 @@ static int l_event_value_name(struct lua_State *ls)
 
 static int l_event_type_num(struct lua_State *ls)
 {
-	int type;
-	const char *name = luaL_checkstring(ls, 1);
-	type = libevdev_event_type_from_name(name);
-	if (type < 0)
+	size_t len;
+	const char *name = luaL_checklstring(ls, 1, &len);
+	const struct event_name_t *entry = event_name_find(name, len);
+	if (entry == NULL || entry->code >= 0)
 		return 0;
-	lua_pushinteger(ls, type);
+	lua_pushinteger(ls, entry->type);
 	return 1;
 }
 
 static int l_event_code_num(struct lua_State *ls)
 {
-	int type, code;
-	const char *name = luaL_checkstring(ls, 1);
-	type = libevdev_event_type_from_code_name(name);
-	code = libevdev_event_code_from_code_name(name);
+	size_t len;
+	const char *name = luaL_checklstring(ls, 1, &len);
+	const struct event_name_t *entry = event_name_find(name, len);
 
-	if (code < 0)
+	if (entry == NULL || entry->code < 0)
 		return 0;
-	lua_pushinteger(ls, code);
-	if (type < 0)
-		return 1;
-	lua_pushinteger(ls, type);
+	lua_pushinteger(ls, entry->code);
+	lua_pushinteger(ls, entry->type);
 	return 2;
 }
 
@@ -776,9 +2920,11 @@ static int l_event_value_num(struct lua_State *ls)
 	const char *name;
 
 	if (lua_type(ls, 1) == LUA_TSTRING) {
-		const char *code_name = luaL_checkstring(ls, 1);
-		type = libevdev_event_type_from_code_name(code_name);
-		code = libevdev_event_code_from_code_name(code_name);
+		size_t len;
+		const char *code_name = lua_tolstring(ls, 1, &len);
+		const struct event_name_t *entry = event_name_find(code_name, len);
+		type = entry ? entry->type : -1;
+		code = entry ? entry->code : -1;
 		arg_base = 2;
 	} else {
 		type = luaL_checkinteger(ls, 1);
@@ -802,7 +2948,14 @@ static const struct luaL_Reg sys_table[] = {
 	{"meminfo", l_sys_meminfo},
 	{"exit", l_sys_exit},
 	{"gettime", l_sys_gettime},
+	{"clock", l_sys_clock},
+	{"now", l_sys_now},
+	{"nocache", l_sys_nocache},
 	{"timer", l_sys_timer},
+	{"profile", l_sys_profile},
+	{"profile_dump", l_sys_profile_dump},
+	{"record_save", l_sys_record_save},
+	{"record_load", l_sys_record_load},
 	{NULL, NULL}
 };
 
@@ -810,6 +2963,7 @@ static const struct luaL_Reg timer_methods[] = {
 	{"close", l_timer_close},
 	{"handler", l_timer_handler},
 	{"set", l_timer_set},
+	{"at", l_timer_at},
 	{"get", l_timer_get},
 	{"cancel", l_timer_cancel},
 	{NULL, NULL}
@@ -818,6 +2972,9 @@ static const struct luaL_Reg timer_methods[] = {
 static const struct luaL_Reg device_table[] = {
 	{"open", l_evdev_open},
 	{"create", l_uinput_create},
+	{"loopback", l_loopback_create},
+	{"macro", l_macro_compile},
+	{"filter", l_device_filter},
 	{"type_name", l_event_type_name},
 	{"code_name", l_event_code_name},
 	{"value_name", l_event_value_name},
@@ -833,8 +2990,17 @@ static const struct luaL_Reg evdev_methods[] = {
 	{"handler", l_evdev_handler},
 	{"monitor", l_evdev_monitor},
 	{"grab", l_evdev_grab},
+	{"mask", l_evdev_mask},
 	{"read", l_evdev_read},
 	{"led", l_evdev_led},
+	{"forward", l_evdev_forward},
+	{"abs", l_evdev_abs},
+	{"pointer", l_evdev_pointer},
+	{"route", l_evdev_route},
+	{"log", l_evdev_log},
+#ifdef LUA_COMPAT_LUAJIT
+	{"events", l_evdev_events},
+#endif
 	{NULL, NULL}
 };
 
@@ -842,25 +3008,207 @@ static const struct luaL_Reg uinput_methods[] = {
 	{"close", l_uinput_close},
 	{"name", l_uinput_name},
 	{"write", l_uinput_write},
+	{"play", l_uinput_play},
+	{"cancel", l_uinput_cancel},
+	{"rate", l_uinput_rate},
+	{"stat", l_uinput_stat},
 	{NULL, NULL}
 };
 
+/*
+ * pushes the cache key of a require call, the resolved path followed by the arguments,
+ * returns 0 without pushing anything when an argument is not nil, a boolean, a number or a string
+ */
+static int module_key(struct lua_State *ls, int narg)
+{
+	const char *filename = lua_tostring(ls, 1);
+
+	luaL_checkstack(ls, 3 * narg, NULL);
+	if (filename[0] == '/')
+		lua_pushvalue(ls, 1);
+	else
+		luaL_gsub(ls, filename, ".", "/");
+	// tags start with a NUL, which no file name holds; lua_pushstring() would stop at it
+	for (int i = 2; i <= narg; i++) {
+		switch (lua_type(ls, i)) {
+		case LUA_TNIL:
+			lua_pushlstring(ls, "\0-", 2);
+			break;
+		case LUA_TBOOLEAN:
+			lua_pushlstring(ls, lua_toboolean(ls, i) ? "\0t" : "\0f", 2);
+			break;
+		case LUA_TNUMBER:
+			lua_pushlstring(ls, "\0n", 2);
+			lua_pushvalue(ls, i);
+			lua_tostring(ls, -1);
+			break;
+		case LUA_TSTRING:
+		{
+			size_t len;
+			lua_tolstring(ls, i, &len);
+			lua_pushlstring(ls, "\0s", 2);
+			lua_pushfstring(ls, "%d:", (int)len);
+			lua_pushvalue(ls, i);
+			break;
+		}
+		default:
+			lua_settop(ls, narg);
+			return 0;
+		}
+	}
+	lua_concat(ls, lua_gettop(ls) - narg);
+	return 1;
+}
+
 static int l_require(struct lua_State *ls)
 {
 	int rc;
 	int narg;
+	int nres;
+	int nocache;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
  	narg = lua_gettop(ls);
 	luaL_checkstring(ls, 1);
 
+	if (!module_key(ls, narg))
+		lua_pushnil(ls);
+	if (!lua_isnil(ls, -1)) {
+		luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_MODULES);
+		lua_pushvalue(ls, -2);
+		lua_rawget(ls, -2);
+		if (lua_istable(ls, -1)) {
+			// results of the first run
+			lua_getfield(ls, -1, "n");
+			nres = (int)lua_tointeger(ls, -1);
+			lua_pop(ls, 1);
+			luaL_checkstack(ls, nres, NULL);
+			for (int i = 1; i <= nres; i++)
+				lua_rawgeti(ls, narg + 3, i);
+			return nres;
+		}
+		lua_pop(ls, 2);
+	}
+	// the key goes below the arguments, which are replaced with the results
+	lua_insert(ls, 1);
+
+	nocache = info->nocache;
+	info->nocache = 0;
 	rc = lua_device_load(ls, narg);
 	if (rc != LUA_OK) {
+		info->nocache = nocache;
 		// err msg on stack
 		return lua_error(ls);
 	}
-	return lua_gettop(ls);
+	nres = lua_gettop(ls) - 1;
+	if (!lua_isnil(ls, 1) && !info->nocache) {
+		luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_MODULES);
+		lua_pushvalue(ls, 1);
+		lua_createtable(ls, nres, 1);
+		for (int i = 1; i <= nres; i++) {
+			lua_pushvalue(ls, i + 1);
+			lua_rawseti(ls, -2, i);
+		}
+		lua_pushinteger(ls, nres);
+		lua_setfield(ls, -2, "n");
+		lua_rawset(ls, -3);
+		lua_pop(ls, 1);
+	}
+	info->nocache = nocache;
+	return nres;
+}
+
+#ifdef LUA_COMPAT_LUAJIT
+// 5.2 and 5.3 table functions used by the builtin modules
+static const char lua_compat_chunk[] =
+	"table.unpack = table.unpack or unpack\n"
+	"table.pack = table.pack or function(...) return {n = select('#', ...), ...} end\n"
+	"table.move = table.move or function(a1, f, e, t, a2)\n"
+	"	a2 = a2 or a1\n"
+	"	if e >= f then\n"
+	"		if t > f and t <= e and a1 == a2 then\n"
+	"			for i = e - f, 0, -1 do a2[t + i] = a1[f + i] end\n"
+	"		else\n"
+	"			for i = 0, e - f do a2[t + i] = a1[f + i] end\n"
+	"		end\n"
+	"	end\n"
+	"	return a2\n"
+	"end\n";
+
+/*
+ * A 64 bit field reads as boxed int64_t cdata. Stamps are CLOCK_MONOTONIC, seconds and
+ * microseconds fit in 32 bits, so on 64 bit little endian only the low halves are read.
+ */
+#if __SIZEOF_LONG__ == 8 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LUA_FFI_STAMP "struct { uint32_t tv_sec, tv_sec_high, tv_usec, tv_usec_high; } stamp;"
+#else
+#define LUA_FFI_STAMP "struct { long tv_sec; long tv_usec; } stamp;"
+#endif
+_Static_assert(sizeof(struct input_event) == 2 * sizeof(long) + 8, "struct input_event of the FFI chunk");
+
+// casts the event queue of an evdev to an FFI array, ffi itself is not exposed to scripts
+static const char lua_ffi_chunk[] =
+	"local ffi = ...\n"
+	"ffi.cdef[[struct input_event { " LUA_FFI_STAMP
+	" unsigned short type; unsigned short code; int value; };]]\n"
+	// ev.time in ns as with evdev:read(), a number rather than int64_t cdata
+	"ffi.metatype('struct input_event', {__index = function(ev, key)\n"
+	"	if key == 'time' then return tonumber(ev.stamp.tv_sec) * 1000000000 + tonumber(ev.stamp.tv_usec) * 1000 end\n"
+	"end})\n"
+	"local event_ptr = ffi.typeof('struct input_event *')\n"
+	"return function(ptr) return ffi.cast(event_ptr, ptr) end\n";
+
+// LuaJIT libraries must be opened through a call, directly they leave more than the module on the stack
+static inline void luajit_open(struct lua_State *ls, lua_CFunction open)
+{
+	lua_pushcfunction(ls, open);
+	lua_call(ls, 0, 1);
 }
 
+static inline void load_std_libraries(struct lua_State *ls)
+{
+	// the jit library turns the compiler on, drop it from globals afterwards
+	luajit_open(ls, luaopen_base);
+	lua_pop(ls, 1);
+	luajit_open(ls, luaopen_jit);
+	lua_pop(ls, 1);
+	lua_pushnil(ls);
+	lua_setglobal(ls, "jit");
+
+	lua_pushglobaltable(ls);
+	// remove 'unsafe' methods
+	lua_pushnil(ls);
+	lua_setfield(ls, -2, "dofile");
+	lua_pushnil(ls);
+	lua_setfield(ls, -2, "loadfile");
+	lua_pushnil(ls);
+	lua_setfield(ls, -2, "load");
+	lua_pushnil(ls);
+	lua_setfield(ls, -2, "loadstring");
+	lua_pop(ls, 1);
+
+	// coroutine comes with base, there is no utf8, bit replaces bit32
+	luajit_open(ls, luaopen_table);
+	lua_setglobal(ls, "table");
+	luajit_open(ls, luaopen_string);
+	lua_setglobal(ls, "string");
+	luajit_open(ls, luaopen_bit);
+	lua_setglobal(ls, "bit");
+	luajit_open(ls, luaopen_math);
+	lua_setglobal(ls, "math");
+
+	luaL_loadbuffer(ls, lua_compat_chunk, sizeof(lua_compat_chunk) - 1, "=compat");
+	lua_call(ls, 0, 0);
+	luaL_loadbuffer(ls, lua_ffi_chunk, sizeof(lua_ffi_chunk) - 1, "=ffi");
+	luajit_open(ls, luaopen_ffi);
+	lua_call(ls, 1, 1);
+	lua_setfield(ls, LUA_REGISTRYINDEX, REG_FFI_CAST);
+
+	// custom 'require' method
+	lua_pushcfunction(ls, l_require);
+	lua_setglobal(ls, "require");
+}
+#else
 static inline void load_std_libraries(struct lua_State *ls)
 {
 	luaopen_base(ls);
@@ -883,8 +3231,10 @@ static inline void load_std_libraries(struct lua_State *ls)
 	lua_setglobal(ls, "string");
 	luaopen_utf8(ls);
 	lua_setglobal(ls, "utf8");
+#if LUA_VERSION_NUM < 504
 	luaopen_bit32(ls);
 	lua_setglobal(ls, "bit32");
+#endif
 	luaopen_math(ls);
 	lua_setglobal(ls, "math");
 
@@ -892,6 +3242,57 @@ static inline void load_std_libraries(struct lua_State *ls)
 	lua_pushcfunction(ls, l_require);
 	lua_setglobal(ls, "require");
 }
+#endif
+
+static int l_event_name_unknown(struct lua_State *ls)
+{
+	return luaL_error(ls, "unknown %s name %s", lua_tostring(ls, lua_upvalueindex(1)),
+		lua_type(ls, 2) == LUA_TSTRING ? lua_tostring(ls, 2) : luaL_typename(ls, 2));
+}
+
+static int l_event_name_write(struct lua_State *ls)
+{
+	return luaL_error(ls, "%s is read only", lua_tostring(ls, lua_upvalueindex(1)));
+}
+
+/*
+ * KEY, BTN, ABS, REL, LED and MSC globals, code names without their prefix to codes.
+ * Each is an empty proxy over the table of codes, an unknown name is an error rather than nil.
+ */
+static void load_event_names(struct lua_State *ls)
+{
+	static const char * const prefix[] = {"KEY", "BTN", "ABS", "REL", "LED", "MSC"};
+
+	for (unsigned i = 0; i < sizeof(prefix) / sizeof(prefix[0]); i++) {
+		size_t len = strlen(prefix[i]);
+
+		lua_newtable(ls);
+		lua_newtable(ls);
+		for (uint32_t slot = 0; slot <= event_name_slot_mask; slot++) {
+			const struct event_name_t *entry = event_name_slot + slot;
+			if (entry->name && entry->code >= 0 && 0 == strncmp(entry->name, prefix[i], len) && entry->name[len] == '_') {
+				lua_pushinteger(ls, entry->code);
+				lua_setfield(ls, -2, entry->name + len + 1);
+			}
+		}
+		lua_createtable(ls, 0, 1);
+		lua_pushstring(ls, prefix[i]);
+		lua_pushcclosure(ls, l_event_name_unknown, 1);
+		lua_setfield(ls, -2, "__index");
+		lua_setmetatable(ls, -2);
+
+		lua_createtable(ls, 0, 3);
+		lua_insert(ls, -2);
+		lua_setfield(ls, -2, "__index");
+		lua_pushstring(ls, prefix[i]);
+		lua_pushcclosure(ls, l_event_name_write, 1);
+		lua_setfield(ls, -2, "__newindex");
+		lua_pushboolean(ls, 1);
+		lua_setfield(ls, -2, "__metatable");
+		lua_setmetatable(ls, -2);
+		lua_setglobal(ls, prefix[i]);
+	}
+}
 
 static inline void load_device_libraries(struct lua_State *ls)
 {
@@ -915,6 +3316,7 @@ static inline void load_device_libraries(struct lua_State *ls)
 	// set device table
 	luaL_newlib(ls, device_table);
 	lua_setglobal(ls, "device");
+	load_event_names(ls);
 
 	// set evdev methods
 	luaL_newmetatable(ls, REG_NAME_EVDEV);
@@ -937,6 +3339,23 @@ static inline void load_device_libraries(struct lua_State *ls)
 	lua_pushboolean(ls, 1);
 	lua_setfield(ls, -2, "__metatable");
 	lua_pop(ls, 1);
+
+	// uinput objects, not kept alive by it
+	lua_newtable(ls);
+	lua_createtable(ls, 0, 1);
+	lua_pushliteral(ls, "k");
+	lua_setfield(ls, -2, "__mode");
+	lua_setmetatable(ls, -2);
+	lua_setfield(ls, LUA_REGISTRYINDEX, REG_UINPUTS);
+
+	// macros have no methods, # gives the number of steps
+	luaL_newmetatable(ls, REG_NAME_MACRO);
+	lua_pushcfunction(ls, l_macro_len);
+	lua_setfield(ls, -2, "__len");
+
+	lua_pushboolean(ls, 1);
+	lua_setfield(ls, -2, "__metatable");
+	lua_pop(ls, 1);
 }
 
 static int l_load_libraries(lua_State *ls) {
@@ -945,19 +3364,42 @@ static int l_load_libraries(lua_State *ls) {
 	return 0;
 }
 
+/*
+ * blocks start with the index of their context, 8 bytes keep the alignment Lua asks for.
+ * The header is not counted in mem_usage, so the memory limit still applies to what Lua sees.
+ */
+#define MEM_HEADER_SIZE 8
+
 static void *l_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 {
 	struct lua_device_info_t *info = (struct lua_device_info_t *)ud;
+	struct lua_mem_context_t *owner = NULL;
+	struct lua_mem_context_t *context;
+	uint32_t *block = NULL;
 
+	if (ptr) {
+		block = (uint32_t *)((char *)ptr - MEM_HEADER_SIZE);
+		owner = info->mem_contexts + *block;
+	}
 	if (nsize == 0) {
-		info->mem_usage -= osize;
-		free(ptr);
+		if (ptr) {
+			info->mem_usage -= osize;
+			info->free_count++;
+			owner->live -= osize;
+			owner->frees++;
+		}
+		free(block);
 		return NULL;
 	}
 	if (ptr && osize >= nsize) {
-		// shrink, assume realloc never fails
+		// shrink, the block stays with its owner; Lua counts on it not to fail,
+		// so when realloc does, the larger block is kept and counted at the new size
+		uint32_t *smaller = (uint32_t *)realloc(block, nsize + MEM_HEADER_SIZE);
 		info->mem_usage -= (osize - nsize);
-		return realloc(ptr, nsize);
+		owner->live -= osize - nsize;
+		if (smaller == NULL)
+			return ptr;
+		return (char *)smaller + MEM_HEADER_SIZE;
 	}
 	if (ptr == NULL) {
 		// osize encodes object type, which we do not need
@@ -968,20 +3410,129 @@ static void *l_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 	if (info->mem_limit && info->mem_usage + (nsize - osize) > info->mem_limit) {
 		// used memory exceeds limit, return NOMEM
 		return NULL;
+	}
+	block = (uint32_t *)realloc(block, nsize + MEM_HEADER_SIZE);
+	if (block == NULL)
+		return NULL;
+	info->mem_usage += (nsize - osize);
+	if (info->mem_usage > info->mem_peak)
+		info->mem_peak = info->mem_usage;
+	if (ptr == NULL)
+		info->alloc_count++;
+
+	// a growing block goes to the context growing it, such as a table filled by a handler
+	context = info->mem_contexts + info->mem_context;
+	if (owner) {
+		owner->live -= osize;
+		if (owner != context) {
+			owner->frees++;
+			context->allocs++;
+		}
 	} else {
-		void *block = realloc(ptr, nsize);
-		if (block)
-			info->mem_usage += (nsize - osize);
-		return block;
+		context->allocs++;
+	}
+	*block = info->mem_context;
+	context->live += nsize;
+	if (context->live > context->peak)
+		context->peak = context->live;
+	return (char *)block + MEM_HEADER_SIZE;
+}
+
+enum {
+	MEM_CONTEXT_LUA = 0,
+	MEM_CONTEXT_OTHER = 1,
+};
+
+static void mem_context_reset(struct lua_device_info_t *info)
+{
+	memset(info->mem_contexts, 0, sizeof(info->mem_contexts));
+	strcpy(info->mem_contexts[MEM_CONTEXT_LUA].name, "lua");
+	strcpy(info->mem_contexts[MEM_CONTEXT_OTHER].name, "other");
+	info->mem_context_count = 2;
+	info->mem_context = MEM_CONTEXT_LUA;
+}
+
+// index of the context of that name, created on first use
+static unsigned mem_context_find(struct lua_device_info_t *info, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static unsigned mem_context_find(struct lua_device_info_t *info, const char *fmt, ...)
+{
+	char name[LUA_MEM_CONTEXT_NAME_SIZE];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(name, sizeof(name), fmt, args);
+	va_end(args);
+	for (unsigned i = 0; i < info->mem_context_count; i++) {
+		if (0 == strcmp(info->mem_contexts[i].name, name))
+			return i;
+	}
+	if (info->mem_context_count == LUA_MEM_CONTEXT_MAX)
+		return MEM_CONTEXT_OTHER;
+	strcpy(info->mem_contexts[info->mem_context_count].name, name);
+	return info->mem_context_count++;
+}
+
+// allocations are counted in context from here, returns the context to go back to
+static inline unsigned mem_context_enter(struct lua_device_info_t *info, unsigned context)
+{
+	unsigned prev = info->mem_context;
+	info->mem_context = context;
+	return prev;
+}
+
+// names what started the next Lua call, as the root frame of its samples
+static void profile_root(struct lua_State *ls, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void profile_root(struct lua_State *ls, const char *fmt, ...)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	va_list args;
+	if (info->profiler == NULL || info->profiler->rate == 0)
+		return;
+	va_start(args, fmt);
+	vsnprintf(info->profile_root, LUA_PROFILE_ROOT_SIZE, fmt, args);
+	va_end(args);
+}
+
+static int set_gc_mode(struct lua_State *ls, const struct lua_device_info_t *info)
+{
+	switch (info->gc_mode) {
+	case LUA_GC_INCREMENTAL:
+#if LUA_VERSION_NUM >= 504
+		lua_gc(ls, LUA_GCINC, info->gc_param[0], info->gc_param[1], info->gc_param[2]);
+#else
+		if (info->gc_param[0])
+			lua_gc(ls, LUA_GCSETPAUSE, info->gc_param[0]);
+		if (info->gc_param[1])
+			lua_gc(ls, LUA_GCSETSTEPMUL, info->gc_param[1]);
+#endif
+		break;
+	case LUA_GC_GENERATIONAL:
+#if LUA_VERSION_NUM >= 504
+		lua_gc(ls, LUA_GCGEN, info->gc_param[0], info->gc_param[1]);
+		break;
+#else
+		return ENOTSUP;
+#endif
 	}
+	return 0;
 }
 
 struct lua_State *lua_device_create(struct lua_device_info_t *info)
 {
 	int rc;
-	struct lua_State *ls = lua_newstate(l_alloc, info);
-	if (ls == NULL)
+	struct lua_State *ls;
+
+	mem_context_reset(info);
+	ls = lua_newstate(l_alloc, info);
+	if (ls == NULL) {
+#ifdef LUA_COMPAT_LUAJIT
+		// x64 LuaJIT without GC64 keeps its heap in the low 2 GiB and takes no allocator
+		fprintf(stderr, "LuaJIT refused the allocator of lukeymap, build LuaJIT with GC64 (XCFLAGS=-DLUAJIT_ENABLE_GC64)\n");
+#else
+		fprintf(stderr, "failed to create lua_State, out of memory\n");
+#endif
 		return NULL;
+	}
 	// save poll_group pointer
 	*(struct lua_device_info_t **)lua_getextraspace(ls) = info;
 
@@ -992,19 +3543,86 @@ struct lua_State *lua_device_create(struct lua_device_info_t *info)
 		lua_close(ls);
 		return NULL;
 	}
+	if (set_gc_mode(ls, info) != 0) {
+		fprintf(stderr, "generational GC needs Lua 5.4\n");
+		lua_close(ls);
+		return NULL;
+	}
+	// profiling started before a reload, or by --profile
+	profile_hook_update(ls, info);
 
 	return ls;
 }
+int lua_device_handoff(struct lua_State *ls, struct handoff_t *handoff)
+{
+	int rc = 0;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+
+	// writes queued on the ring go out before the fds change hands
+	poll_group_flush(info->poll_group);
+	lua_getfield(ls, LUA_REGISTRYINDEX, REG_UINPUTS);
+	lua_pushnil(ls);
+	while (rc == 0 && lua_next(ls, -2)) {
+		struct handoff_entry_t *entry;
+		// closed ones have lost their metatable, loopback devices end with the state
+		struct uinput_t *uinput = (struct uinput_t *)luaL_testudata(ls, -2, REG_NAME_UINPUT);
+		lua_pop(ls, 1);
+		if (uinput == NULL || uinput->loop || !uinput_open(uinput))
+			continue;
+		entry = handoff_add(handoff, HANDOFF_UINPUT, uinput->fd);
+		if (entry == NULL) {
+			rc = ENOSPC;
+			lua_pop(ls, 1);
+			break;
+		}
+		entry->spec = uinput->spec;
+		snprintf(entry->source, sizeof(entry->source), "%s", uinput->source);
+		if (uinput_node(uinput))
+			snprintf(entry->node, sizeof(entry->node), "%s", uinput_node(uinput));
+		memcpy(entry->key_down, uinput->key_down, sizeof(entry->key_down));
+	}
+	lua_pop(ls, 1);
+
+	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_FD_MAP);
+	lua_pushnil(ls);
+	while (rc == 0 && lua_next(ls, -2)) {
+		struct handoff_entry_t *entry;
+		struct evdev_t *evdev = (struct evdev_t *)luaL_testudata(ls, -1, REG_NAME_EVDEV);
+		lua_pop(ls, 1);
+		if (evdev == NULL || evdev->loop || evdev->dev == NULL)
+			continue;
+		entry = handoff_add(handoff, HANDOFF_EVDEV, evdev->fd);
+		if (entry == NULL) {
+			rc = ENOSPC;
+			lua_pop(ls, 1);
+			break;
+		}
+		snprintf(entry->node, sizeof(entry->node), "%s", evdev->name);
+		entry->grabbed = evdev->grabbed;
+	}
+	lua_pop(ls, 1);
+	return rc;
+}
+
 void lua_device_destroy(struct lua_State *ls)
 {
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	// closing uinput devices unlinks their players, the timer goes after
 	lua_close(ls);
+	macro_sched_destroy(info);
+	// rules belong to the script, own nodes stay known until their removal is seen
+	if (info->hotplug)
+		info->hotplug->rule_count = 0;
 }
 
 int lua_device_start(struct lua_State *ls, const char *main_name, char **args)
 {
 	int rc;
 	int i = 0;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
+	loop_tick(info);
+	profile_root(ls, "main");
 	lua_pushstring(ls, main_name);
 	lua_pushglobaltable(ls);
 	luaL_getsubtable(ls, -1, "sys");
@@ -1058,29 +3676,108 @@ static int lua_err_handler(struct lua_State *ls)
 	return 1;
 }
 
+static inline void record_call_time(struct lua_State *ls, uint64_t time)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	unsigned bucket = 0;
+	while (bucket + 1 < LUA_HISTOGRAM_SIZE && (time >> (bucket + 1)))
+		bucket++;
+	info->lua_histogram[bucket]++;
+	info->lua_calls++;
+	info->lua_time += time;
+}
+
+// append one frame to a folded stack, ';' and ' ' are reserved by the format
+static size_t profile_frame(char *buf, size_t len, const lua_Debug *ar)
+{
+	size_t start = len;
+	int n;
+	// functions are told apart by where they are defined, not by the line running
+	if (ar->linedefined >= 0)
+		n = snprintf(buf + len, PROFILER_STACK_SIZE - len, ";%s@%s:%d",
+			     ar->name ? ar->name : "?", ar->short_src, ar->linedefined);
+	else
+		n = snprintf(buf + len, PROFILER_STACK_SIZE - len, ";%s@%s",
+			     ar->name ? ar->name : "?", ar->short_src);
+	if (n < 0 || (size_t)n >= PROFILER_STACK_SIZE - len)
+		return len;
+	len += n;
+	for (size_t i = start + 1; i < len; i++) {
+		if (buf[i] == ';' || buf[i] == ' ')
+			buf[i] = '_';
+	}
+	return len;
+}
+
+static void profile_hook(struct lua_State *ls, lua_Debug *hook_ar)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	struct profiler_t *prof = info->profiler;
+	char stack[PROFILER_STACK_SIZE];
+	int64_t now = get_time_ns();
+	lua_Debug ar;
+	size_t len;
+	int depth = 0;
+	(void)hook_ar;
+
+	if (now < prof->next)
+		return;
+	prof->next = now + prof->period;
+
+	while (depth < PROFILER_MAX_DEPTH && lua_getstack(ls, depth, &ar))
+		depth++;
+	// root is what woke the loop up, then outermost frame first
+	len = snprintf(stack, sizeof(stack), "%s", info->profile_root[0] ? info->profile_root : "lua");
+	for (int level = depth - 1; level >= 0; level--) {
+		if (!lua_getstack(ls, level, &ar) || !lua_getinfo(ls, "Sn", &ar))
+			continue;
+		len = profile_frame(stack, len, &ar);
+	}
+	profiler_add(prof, stack);
+}
+
 static int lua_do_call(struct lua_State *ls, int narg, int nres)
 {
 	int rc;
+	int64_t start;
 	int base = lua_gettop(ls) - narg;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 	lua_pushcfunction(ls, lua_err_handler);
 	lua_insert(ls, base);
 	alarm_start(ls);
+	start = get_time_ns();
 	rc = lua_pcall(ls, narg, nres, base);
+	record_call_time(ls, get_time_ns() - start);
 	alarm_stop(ls);
 	if (rc != LUA_OK) {
 		const char *msg = lua_tostring(ls, -1);
 		fprintf(stderr, "%s\n", msg);
+		recorder_log(info->recorder, RECORDER_ERROR, -1, 0, 0, rc, 0);
+		if (info->recorder && info->recorder->path)
+			recorder_save(info->recorder, info->recorder->path);
 		// keeps err msg on stack
 	}
 	lua_remove(ls, base);
 	return rc;
 }
 
+static const struct builtin_module_t *builtin_find(const char *name)
+{
+	for (const struct builtin_module_t *builtin = builtin_module; builtin->name; builtin++) {
+		if (0 == strcmp(builtin->name, name))
+			return builtin;
+	}
+	return NULL;
+}
+
 static int lua_device_load(struct lua_State *ls, int narg)
 {
 	int rc;
 	int base;
+	unsigned context;
 	const char *filename;
+	const struct builtin_module_t *builtin;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 
 	base = lua_gettop(ls) - narg + 1;
 	filename = lua_tostring(ls, base);
@@ -1089,9 +3786,14 @@ static int lua_device_load(struct lua_State *ls, int narg)
 		lua_pushfstring(ls, "invalid path %s", filename);
 		return LUA_ERRRUN;
 	}
+	// the chunk and what running it leaves behind belong to the module
+	context = mem_context_enter(info, mem_context_find(info, "module %s", filename));
 
 	if (filename[0] == '/') {
 		rc = luaL_loadfilex(ls, filename, "t");
+	} else if ((builtin = builtin_find(filename)) != NULL) {
+		// precompiled by ourselves, the only binary chunks accepted
+		rc = luaL_loadbufferx(ls, (const char *)builtin->chunk, builtin->size, builtin->name, "b");
 	} else {
 		luaL_gsub(ls, filename, ".", "/");
 		lua_pushliteral(ls, ".lua");
@@ -1100,6 +3802,7 @@ static int lua_device_load(struct lua_State *ls, int narg)
 		lua_replace(ls, -2);
 	}
 	if (rc != LUA_OK) {
+		mem_context_enter(info, context);
 		// err msg already on stack
 		return rc;
 	}
@@ -1108,6 +3811,7 @@ static int lua_device_load(struct lua_State *ls, int narg)
 
 	// fprintf(stderr, "loading %s\n", modname);
 	rc = lua_do_call(ls, narg, LUA_MULTRET);
+	mem_context_enter(info, context);
 
 	if (rc != LUA_OK) {
 		// err msg already on stack
@@ -1117,39 +3821,377 @@ static int lua_device_load(struct lua_State *ls, int narg)
 	return rc;
 }
 
-int lua_device_event(struct lua_State *ls, int op, const char *dev_name)
+int lua_device_event(struct lua_State *ls, int op, const char *dev_name, const struct uevent_t *uevent)
 {
 	int rc;
+	unsigned context;
+	int dev_num = -1;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 	int top = lua_gettop(ls);
-	luaL_checkstack(ls, 4, NULL);
-
+	luaL_checkstack(ls, 5, NULL);
+
+	profile_root(ls, "hotplug");
+	loop_tick(info);
+	if (0 == strncmp(dev_name, "event", 5))
+		dev_num = atoi(dev_name + 5);
+	recorder_log(info->recorder, RECORDER_HOTPLUG, -1, 0, op, dev_num, 0);
+	// own devices and devices no rule asks for never reach Lua
+	if (info->hotplug && !hotplug_filter_pass(info->hotplug, op, dev_name))
+		return LUA_OK;
+	context = mem_context_enter(info, mem_context_find(info, "hotplug"));
 	lua_pushvalue(ls, -1);
 	if (op)
 		lua_pushliteral(ls, "add");
 	else
 		lua_pushliteral(ls, "del");
 	lua_pushstring(ls, dev_name);
-	rc = lua_do_call(ls, 2, 0);
+	if (uevent) {
+		lua_createtable(ls, 0, uevent->count);
+		for (unsigned i = 0; i < uevent->count; i++) {
+			lua_pushstring(ls, uevent->value[i]);
+			lua_setfield(ls, -2, uevent->key[i]);
+		}
+	}
+	rc = lua_do_call(ls, uevent ? 3 : 2, 0);
+	mem_context_enter(info, context);
+	lua_settop(ls, top);
+	return rc;
+}
+
+// calls the handler on top of the stack with the evdev object below it, which is left in place
+static int evdev_call(struct lua_State *ls, struct lua_device_info_t *info, struct evdev_t *evdev)
+{
+	int rc;
+	unsigned context;
+	struct evdev_t *writer;
+	int top = lua_gettop(ls);
+	int64_t start = get_time_ns();
+
+	if (evdev->mem_context == 0)
+		evdev->mem_context = mem_context_find(info, "device %s", evdev->name);
+	profile_root(ls, "%s", evdev->name);
+	recorder_log(info->recorder, RECORDER_DISPATCH, evdev->fd, 0, 0, evdev->count, 0);
+	lua_pushvalue(ls, -2);
+	context = mem_context_enter(info, evdev->mem_context);
+	writer = evdev_enter_sink(evdev);
+	rc = lua_do_call(ls, 1, 0);
+	evdev_leave_sink(evdev, writer);
+	mem_context_enter(info, context);
+	recorder_log(info->recorder, RECORDER_RETURN, evdev->fd, 0, 0, rc, (get_time_ns() - start) / 1000);
+	lua_settop(ls, top - 1);
+	if (evdev->dev) {
+		evdev->stat.lua_calls++;
+		evdev->stat.lua_time += get_time_ns() - start;
+	}
+	return rc;
+}
+
+// the evdev object is on top of the stack
+static int evdev_handle(struct lua_State *ls, struct lua_device_info_t *info, struct evdev_t *evdev)
+{
+	int rc = LUA_OK;
+	int status;
+	int top = lua_gettop(ls);
+
+	// a resync frame is handed over in a call of its own, hence the loop
+	while (1) {
+		// run native stages first, Lua is only called when it has something to see
+		status = evdev_pump(evdev);
+		if (evdev->count == 0 && (status == -EAGAIN || status == EVDEV_PUMP_BUDGET))
+			break;
+		if (LUA_TFUNCTION != lua_getuservalue(ls, -1)) {
+			lua_pop(ls, 1);
+			// nobody reads the queue, as for a device that is only logged, so drop it and read on
+			evdev->count = 0;
+			evdev->resync = 0;
+			if (status < 0 || status == EVDEV_PUMP_BUDGET)
+				break;
+			continue;
+		}
+		rc = evdev_call(ls, info, evdev);
+		if (evdev->dev == NULL)
+			break;
+		// a handler that left events queued is not called again in this wakeup
+		if (rc != LUA_OK || evdev->count || evdev->wake_events >= evdev->budget ||
+		    (status != EVDEV_PUMP_BOUNDARY && evdev->read_flag != LIBEVDEV_READ_FLAG_SYNC))
+			break;
+	}
+
+	if (evdev->dev) {
+		evdev_wakeup_done(evdev);
+		evdev_left_pending(evdev, status);
+	}
+	// the handler may have failed between a press and its release
+	if (rc != LUA_OK && evdev_has_sink(evdev))
+		uinput_release_all(info->poll_group, evdev->sink);
 	lua_settop(ls, top);
 	return rc;
 }
 
+struct merge_source_t {
+	struct evdev_t *evdev;
+	// stack index of its object
+	int index;
+	// of its last pump
+	int status;
+	// nothing more to hand over in this wakeup
+	int done;
+};
+
+// a source with a frame queued, or with a read error its handler has not seen yet
+static inline int merge_pending(const struct merge_source_t *source)
+{
+	if (source->done || source->evdev->dev == NULL)
+		return 0;
+	return source->evdev->count || (source->status < 0 && source->status != -EAGAIN);
+}
+
+static inline int merge_before(const struct merge_source_t *a, const struct merge_source_t *b)
+{
+	// errors first, there is nothing to order them by
+	if (a->evdev->count == 0 || b->evdev->count == 0)
+		return a->evdev->count == 0 && b->evdev->count != 0;
+	return event_time_ns(a->evdev->queue) < event_time_ns(b->evdev->queue);
+}
+
+/*
+ * Sources merged into one sink are read a frame at a time, and frames are handed over
+ * in the order of their kernel timestamp: a k-way merge of the sources, each in order
+ * already. All events of a frame share its timestamp. FD_MAP is on top of the stack.
+ */
+static int evdev_handle_merged(struct lua_State *ls, struct lua_device_info_t *info, struct uinput_t *sink)
+{
+	int rc = LUA_OK;
+	int map = lua_gettop(ls);
+	unsigned count = 0;
+	struct evdev_t *evdev;
+	struct merge_source_t source[EVDEV_MERGE_MAX];
+
+	luaL_checkstack(ls, EVDEV_MERGE_MAX + 4, NULL);
+	// evdev:forward refuses more sources than that
+	for (evdev = sink->sources; evdev && count < EVDEV_MERGE_MAX; evdev = evdev->next_source) {
+		if (evdev->dev == NULL)
+			continue;
+		// keeps the object alive while handlers of the others run
+		lua_geti(ls, map, evdev->fd);
+		evdev->merged = 1;
+		source[count].evdev = evdev;
+		source[count].index = lua_gettop(ls);
+		source[count].status = evdev_pump(evdev);
+		source[count].done = 0;
+		count++;
+	}
+	while (rc == LUA_OK) {
+		struct merge_source_t *next = NULL;
+		for (unsigned i = 0; i < count; i++) {
+			if (merge_pending(source + i) && (next == NULL || merge_before(source + i, next)))
+				next = source + i;
+		}
+		if (next == NULL)
+			break;
+		evdev = next->evdev;
+		lua_pushvalue(ls, next->index);
+		if (LUA_TFUNCTION == lua_getuservalue(ls, -1)) {
+			rc = evdev_call(ls, info, evdev);
+		} else {
+			lua_pop(ls, 1);
+			evdev->count = 0;
+			evdev->resync = 0;
+		}
+		lua_pop(ls, 1);
+		// a handler that left its frame queued, or has seen the error, is not called again
+		if (evdev->dev == NULL || evdev->count || next->status < 0 || next->status == EVDEV_PUMP_BUDGET ||
+		    evdev->wake_events >= evdev->budget)
+			next->done = 1;
+		else
+			next->status = evdev_pump(evdev);
+	}
+	for (unsigned i = 0; i < count; i++) {
+		evdev = source[i].evdev;
+		evdev->merged = 0;
+		if (evdev->dev) {
+			evdev_wakeup_done(evdev);
+			evdev_left_pending(evdev, source[i].status);
+		}
+	}
+	// the handler may have failed between a press and its release
+	if (rc != LUA_OK)
+		uinput_release_all(info->poll_group, sink);
+	return rc;
+}
+
 int lua_device_handle_fd(struct lua_State *ls, int fd)
 {
 	int rc = 0;
 	int top = lua_gettop(ls);
+	struct evdev_t *evdev;
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
 	luaL_checkstack(ls, 4, NULL);
 
+	loop_tick(info);
+	if (info->macro && fd == info->macro->fd)
+		return macro_handle(info);
 	luaL_getsubtable(ls, LUA_REGISTRYINDEX, REG_FD_MAP);
 	lua_geti(ls, -1, fd);
 	if (!lua_isuserdata(ls, -1)) {
 		lua_settop(ls, top);
 		return LUA_OK;
 	}
-	if (LUA_TFUNCTION == lua_getuservalue(ls, -1)) {
-		lua_pushvalue(ls, -2);
-		rc = lua_do_call(ls, 1, 0);
+	evdev = (struct evdev_t *)luaL_testudata(ls, -1, REG_NAME_EVDEV);
+	if (evdev == NULL) {
+		if (LUA_TFUNCTION == lua_getuservalue(ls, -1)) {
+			int64_t start = get_time_ns();
+			unsigned context = mem_context_enter(info, mem_context_find(info, "fd%d", fd));
+			profile_root(ls, "fd%d", fd);
+			recorder_log(info->recorder, RECORDER_DISPATCH, fd, 0, 0, 0, 0);
+			lua_pushvalue(ls, -2);
+			rc = lua_do_call(ls, 1, 0);
+			mem_context_enter(info, context);
+			recorder_log(info->recorder, RECORDER_RETURN, fd, 0, 0, rc, (get_time_ns() - start) / 1000);
+		}
+		lua_settop(ls, top);
+		return rc;
+	}
+
+	if (evdev_has_sink(evdev) && evdev->sink->sources && evdev->sink->sources->next_source) {
+		lua_pop(ls, 1);
+		rc = evdev_handle_merged(ls, info, evdev->sink);
+	} else {
+		rc = evdev_handle(ls, info, evdev);
 	}
 	lua_settop(ls, top);
 	return rc;
 }
+
+void lua_device_report(struct lua_State *ls, FILE *out)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	const struct poll_group_t *group = info->poll_group;
+	struct rusage usage;
+
+	fprintf(out, "memory used=%zu peak=%zu limit=%zu allocs=%llu frees=%llu gc_kbytes=%d\n",
+		info->mem_usage, info->mem_peak, info->mem_limit,
+		(unsigned long long)info->alloc_count, (unsigned long long)info->free_count,
+		lua_gc(ls, LUA_GCCOUNT, 0));
+	for (unsigned i = 0; i < info->mem_context_count; i++) {
+		const struct lua_mem_context_t *context = info->mem_contexts + i;
+		if (context->allocs == 0)
+			continue;
+		fprintf(out, "memory context=\"%s\" live=%zu peak=%zu allocs=%llu frees=%llu\n",
+			context->name, context->live, context->peak,
+			(unsigned long long)context->allocs, (unsigned long long)context->frees);
+	}
+	fprintf(out, "loop fds=%u timers=%u backend=%s waits=%llu syscalls=%llu sqes=%llu cqes=%llu writes=%llu write_errors=%llu\n",
+		group->size, info->timer_count, group->uring ? "io_uring" : "poll",
+		(unsigned long long)group->stat.waits, (unsigned long long)group->stat.syscalls,
+		(unsigned long long)group->stat.sqes, (unsigned long long)group->stat.cqes,
+		(unsigned long long)group->stat.writes, (unsigned long long)group->stat.write_errors);
+	if (group->spin_max) {
+		fprintf(out, "spin max_us=%lld window_us=%lld spins=%llu hits=%llu time_us=%llu\n",
+			(long long)group->spin_max / 1000, (long long)group->spin_window / 1000,
+			(unsigned long long)group->stat.spins, (unsigned long long)group->stat.spin_hits,
+			(unsigned long long)group->stat.spin_ns / 1000);
+	}
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		fprintf(out, "cpu user_us=%lld sys_us=%lld\n",
+			(long long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+			(long long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec);
+	}
+	if (info->macro) {
+		fprintf(out, "macro plays=%llu wakeups=%llu frames=%llu events=%llu cancels=%llu drops=%llu\n",
+			(unsigned long long)info->macro->plays, (unsigned long long)info->macro->wakeups,
+			(unsigned long long)info->macro->frames, (unsigned long long)info->macro->events,
+			(unsigned long long)info->macro->cancels, (unsigned long long)info->macro->drops);
+	}
+	if (info->hotplug) {
+		fprintf(out, "hotplug rules=%u passed=%llu skipped=%llu\n", info->hotplug->rule_count,
+			(unsigned long long)info->hotplug->passed, (unsigned long long)info->hotplug->skipped);
+	}
+	fprintf(out, "lua calls=%llu time_ns=%llu\n",
+		(unsigned long long)info->lua_calls, (unsigned long long)info->lua_time);
+
+	if (LUA_TTABLE != lua_getfield(ls, LUA_REGISTRYINDEX, REG_FD_MAP)) {
+		lua_pop(ls, 1);
+		return;
+	}
+	lua_pushnil(ls);
+	while (lua_next(ls, -2)) {
+		const struct evdev_t *evdev = (struct evdev_t *)luaL_testudata(ls, -1, REG_NAME_EVDEV);
+		if (evdev && evdev->dev) {
+			const struct evdev_stat_t *stat = &evdev->stat;
+			uint64_t routed = 0;
+			for (unsigned i = 0; evdev->route && i < evdev->route->sink_count; i++)
+				routed += evdev->route->sink[i].events;
+			fprintf(out, "device %s fd=%d in=%llu lua=%llu native=%llu drops=%llu calls=%llu time_ns=%llu "
+				"syn_dropped=%llu sync=%llu depth=%u depth_max=%u budget=%u passthrough=%u "
+				"wake_avg_ns=%llu wake_max_ns=%llu "
+				"out=%llu redundant=%llu releases=%llu routed=%llu name=%s\n",
+				evdev->name, evdev->fd,
+				(unsigned long long)stat->events_in, (unsigned long long)stat->events_lua,
+				(unsigned long long)stat->events_native, (unsigned long long)stat->drops,
+				(unsigned long long)stat->lua_calls, (unsigned long long)stat->lua_time,
+				(unsigned long long)stat->syn_dropped, (unsigned long long)stat->sync_events,
+				stat->depth_last, stat->depth_max, evdev->budget,
+				evdev->passthrough,
+				(unsigned long long)(stat->wake_count ? stat->wake_ns / stat->wake_count : 0),
+				(unsigned long long)stat->wake_max_ns,
+				(unsigned long long)(evdev_has_sink(evdev) ? evdev->sink->written : 0),
+				(unsigned long long)(evdev_has_sink(evdev) ? evdev->sink->redundant : 0),
+				(unsigned long long)(evdev_has_sink(evdev) ? evdev->sink->releases : 0),
+				(unsigned long long)routed,
+				libevdev_get_name(evdev->dev));
+		}
+		lua_pop(ls, 1);
+	}
+	lua_pop(ls, 1);
+}
+
+void lua_device_histogram(struct lua_State *ls, FILE *out)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	for (unsigned i = 0; i < LUA_HISTOGRAM_SIZE; i++) {
+		if (info->lua_histogram[i])
+			fprintf(out, "lua_ns %llu %llu\n", 1ULL << i, (unsigned long long)info->lua_histogram[i]);
+	}
+}
+
+int lua_device_passthrough(struct lua_State *ls, const char *dev_name, int enable)
+{
+	int rc = ENOENT;
+	if (LUA_TTABLE != lua_getfield(ls, LUA_REGISTRYINDEX, REG_FD_MAP)) {
+		lua_pop(ls, 1);
+		return rc;
+	}
+	lua_pushnil(ls);
+	while (lua_next(ls, -2)) {
+		struct evdev_t *evdev = (struct evdev_t *)luaL_testudata(ls, -1, REG_NAME_EVDEV);
+		if (evdev && evdev->dev && 0 == strcmp(evdev->name, dev_name)) {
+			evdev->passthrough = enable;
+			rc = evdev_has_sink(evdev) ? 0 : ENODEV;
+		}
+		lua_pop(ls, 1);
+	}
+	lua_pop(ls, 1);
+	return rc;
+}
+
+int lua_device_profile(struct lua_State *ls, const char *cmd, FILE *out)
+{
+	struct lua_device_info_t *info = *(struct lua_device_info_t **)lua_getextraspace(ls);
+	char *endptr;
+	unsigned long rate;
+
+	if (cmd == NULL || 0 == strcmp(cmd, "dump") || 0 == strcmp(cmd, "reset")) {
+		if (info->profiler == NULL)
+			return ENOENT;
+		if (cmd && cmd[0] == 'r')
+			profiler_reset(info->profiler);
+		else
+			profiler_dump(info->profiler, out);
+		return 0;
+	}
+	rate = strtoul(cmd, &endptr, 0);
+	if (*endptr != 0 || rate > PROFILER_MAX_RATE)
+		return EINVAL;
+	return profile_set_rate(ls, info, (unsigned)rate);
+}
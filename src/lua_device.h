@@ -1,25 +1,96 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 struct lua_State;
 struct poll_group_t;
 struct input_event;
+struct profiler_t;
+struct recorder_t;
+struct macro_sched_t;
+struct uevent_t;
+struct hotplug_filter_t;
+struct handoff_t;
+
+// log2 buckets of Lua call time in ns
+#define LUA_HISTOGRAM_SIZE 32
+#define LUA_PROFILE_ROOT_SIZE 32
+// allocation contexts, the first two are the runtime itself and contexts beyond the last
+#define LUA_MEM_CONTEXT_MAX 64
+#define LUA_MEM_CONTEXT_NAME_SIZE 48
+
+enum {
+	LUA_GC_DEFAULT = 0,
+	LUA_GC_INCREMENTAL,
+	LUA_GC_GENERATIONAL,
+};
+
+// Lua memory of a module being loaded, or of a device, timer or hotplug handler running
+struct lua_mem_context_t {
+	char name[LUA_MEM_CONTEXT_NAME_SIZE];
+	size_t live;
+	size_t peak;
+	// blocks taken over from another context count as allocated here and freed there
+	uint64_t allocs;
+	uint64_t frees;
+};
 
 struct lua_device_info_t {
+	// the extra space of a LuaJIT state, which has none, see lua_compat.h; stays first
+	struct lua_device_info_t *self;
 	size_t mem_usage;
 	size_t mem_limit;
+	size_t mem_peak;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	// per state, every block is tagged with the context it is counted in
+	unsigned mem_context;
+	unsigned mem_context_count;
+	struct lua_mem_context_t mem_contexts[LUA_MEM_CONTEXT_MAX];
 	struct poll_group_t *poll_group;
 	int dev_dir_fd;
 	timer_t timer_id;
 	unsigned time_limit;
 	unsigned timer_ref;
+	unsigned timer_count;
+	uint64_t lua_calls;
+	uint64_t lua_time;
+	uint64_t lua_histogram[LUA_HISTOGRAM_SIZE];
+	// sampling profiler, hooked into Lua calls only while it has a rate
+	struct profiler_t *profiler;
+	char profile_root[LUA_PROFILE_ROOT_SIZE];
+	// flight recorder, optional
+	struct recorder_t *recorder;
+	// collector mode and its parameters in lua_gc() order, 0 keeps the default
+	int gc_mode;
+	int gc_param[3];
+	// macro players of the state, created on first use
+	struct macro_sched_t *macro;
+	// loopback devices created, numbers their names
+	unsigned loopback_count;
+	// hotplug pre-filter, optional, outlives the state
+	struct hotplug_filter_t *hotplug;
+	// monotonic ns taken once per loop iteration, sys.now()
+	int64_t now;
+	// set by sys.nocache() while a required module runs
+	int nocache;
+	// devices of the process before a restart, adopted by device.create() and device.open()
+	struct handoff_t *handoff;
 };
 
 struct lua_State *lua_device_create(struct lua_device_info_t *info);
 void lua_device_destroy(struct lua_State *ls);
+// adds every open uinput and evdev device, the state must not be closed after that
+int lua_device_handoff(struct lua_State *ls, struct handoff_t *handoff);
 int lua_device_start(struct lua_State *ls, const char *main_name, char **args);
-int lua_device_event(struct lua_State *ls, int op, const char *dev_name);
+// uevent, when the monitor has one, is handed over as a table of its properties
+int lua_device_event(struct lua_State *ls, int op, const char *dev_name, const struct uevent_t *uevent);
 int lua_device_handle_fd(struct lua_State *ls, int fd);
+void lua_device_report(struct lua_State *ls, FILE *out);
+void lua_device_histogram(struct lua_State *ls, FILE *out);
+int lua_device_passthrough(struct lua_State *ls, const char *dev_name, int enable);
+int lua_device_profile(struct lua_State *ls, const char *cmd, FILE *out);
 
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
@@ -14,9 +15,20 @@
 
 #include "poll_group.h"
 #include "monitor.h"
+#include "uevent.h"
 #include "lua_device.h"
+#include "control.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "hotplug.h"
+#include "handoff.h"
 
 #define DEV_INPUT_PATH "/dev/input/"
+// flight recorder dumps go to the runtime directory of the service, of the user, or this one
+#define RECORDER_DIR "/run/lukeymap"
+#define RECORDER_NAME "lukeymap.rec"
+// a process restarted sooner than this after the last restart fails instead
+#define RESTART_INTERVAL_NS (1000 * 1000 * 1000)
 
 static const char * const doc = "Lua scripted key remapping program";
 static const char * const args_doc = "MAIN [ param ... ]";
@@ -24,10 +36,20 @@ static const char * const args_doc = "MAIN [ param ... ]";
 struct argp_info_t {
 	char *main;
 	char **parameters;
+	char *socket;
+	char *profile;
+	char *record;
 	size_t memory;
 	int nice;
 	int mlock;
+	int uring;
+	int uevent;
+	int handoff;
+	unsigned busy_poll;
 	unsigned time;
+	unsigned profile_rate;
+	int gc_mode;
+	int gc_param[3];
 };
 
 static const struct argp_option options[] = {
@@ -35,6 +57,15 @@ static const struct argp_option options[] = {
 	{"memory", 'm', "MEMORY", 0, "set memory limit for Lua runtime, supports K/M/G postfix"},
 	{"lock", 'l', 0, 0, "lock memory using mlockall(2), must be used with -m"},
 	{"time", 't', "TIME", 0, "set script running time limit in ms, default 1000, set 0 to disable"},
+	{"socket", 's', "PATH", 0, "serve control commands on unix socket at PATH"},
+	{"profile", 'p', "FILE", 0, "sample Lua call stacks, write folded stacks to FILE on exit"},
+	{"rate", 'r', "HZ", 0, "profiler sample rate, default 997"},
+	{"record", 'f', "FILE", 0, "flight recorder dump file, default lukeymap.rec in $RUNTIME_DIRECTORY, $XDG_RUNTIME_DIR or " RECORDER_DIR},
+	{"uring", 'u', 0, 0, "wait for devices and write outputs through io_uring, falls back to poll(2)"},
+	{"busy-poll", 'b', "US", 0, "after input, busy poll up to US microseconds before blocking, adapts to idle input"},
+	{"uevent", 'e', "SOURCE", OPTION_ARG_OPTIONAL, "watch hotplug through netlink uevents of udev (default) or kernel"},
+	{"gc", 'g', "MODE", 0, "Lua collector, inc[,pause,stepmul,stepsize] or gen[,minormul,majormul]"},
+	{"handoff", 'H', "MODE", OPTION_ARG_OPTIONAL, "restart on Lua errors keeping devices open, by exec (default) or through the systemd fd store"},
 	{ 0 }
 };
 
@@ -92,6 +123,72 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		info->time = (unsigned)value;
 		break;
 	}
+	case 's':
+		info->socket = arg;
+		break;
+	case 'p':
+		info->profile = arg;
+		break;
+	case 'f':
+		info->record = arg;
+		break;
+	case 'u':
+		info->uring = 1;
+		break;
+	case 'b':
+	{
+		char *endptr;
+		unsigned long value = strtoul(arg, &endptr, 0);
+		if (*endptr != 0 || value > 1000000)
+			argp_error(state, "invalid busy poll value %s", arg);
+		info->busy_poll = (unsigned)value;
+		break;
+	}
+	case 'e':
+		if (arg == NULL || 0 == strcmp(arg, "udev"))
+			info->uevent = UEVENT_SOURCE_UDEV;
+		else if (0 == strcmp(arg, "kernel"))
+			info->uevent = UEVENT_SOURCE_KERNEL;
+		else
+			argp_error(state, "invalid uevent source %s", arg);
+		break;
+	case 'H':
+		if (arg == NULL || 0 == strcmp(arg, "exec"))
+			info->handoff = HANDOFF_MODE_EXEC;
+		else if (0 == strcmp(arg, "store"))
+			info->handoff = HANDOFF_MODE_STORE;
+		else
+			argp_error(state, "invalid handoff mode %s", arg);
+		break;
+	case 'g':
+	{
+		char *endptr = arg + 3;
+		if (0 == strncmp(arg, "inc", 3))
+			info->gc_mode = LUA_GC_INCREMENTAL;
+		else if (0 == strncmp(arg, "gen", 3))
+			info->gc_mode = LUA_GC_GENERATIONAL;
+		else
+			argp_error(state, "invalid gc mode %s", arg);
+		for (unsigned i = 0; *endptr == ',' && i < 3; i++) {
+			char *start = endptr + 1;
+			long value = strtol(start, &endptr, 0);
+			if (endptr == start || value < 0 || value > 1000)
+				argp_error(state, "invalid gc parameter %s", arg);
+			info->gc_param[i] = (int)value;
+		}
+		if (*endptr != 0)
+			argp_error(state, "invalid gc mode %s", arg);
+		break;
+	}
+	case 'r':
+	{
+		char *endptr;
+		unsigned long value = strtoul(arg, &endptr, 0);
+		if (*endptr != 0 || value == 0 || value > 100000)
+			argp_error(state, "invalid rate value %s", arg);
+		info->profile_rate = (unsigned)value;
+		break;
+	}
 	case ARGP_KEY_ARG:
 		info->main = arg;
 		info->parameters = &state->argv[state->next];
@@ -113,10 +210,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 static const struct argp argp = {options, parse_opt, args_doc, doc};
 
 static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t reload = 0;
+static volatile sig_atomic_t restart = 0;
+// preallocated and always on, dumped from signal handlers
+static struct recorder_t recorder;
+// devices handed over to this process, then the ones it hands over itself
+static struct handoff_t handoff;
+static char recorder_path[PATH_MAX];
 
 static void sig_quit(int signum)
 {
 	switch (signum) {
+	case SIGHUP:
+		reload = 1;
+		return;
+	case SIGUSR2:
+		restart = 1;
+		return;
+	case SIGUSR1:
+		recorder_save(&recorder, recorder.path);
+		return;
 	case SIGINT:
 		if (0 == quit++)
 			return;
@@ -125,6 +238,8 @@ static void sig_quit(int signum)
 		break;
 	case SIGALRM:
 		fprintf(stderr, "script running too long");
+		recorder_log(&recorder, RECORDER_ERROR, -1, 0, 0, -ETIME, 0);
+		recorder_save(&recorder, recorder.path);
 		break;
 	}
 
@@ -141,14 +256,20 @@ static inline void set_signal(void)
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGALRM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+	// a log or control reader going away is a write error, not the end of the program
+	signal(SIGPIPE, SIG_IGN);
 }
 
 static inline int walk_devices(struct lua_State *ls)
 {
 	int rc = 0;
 	DIR *dir = opendir(DEV_INPUT_PATH);
+	// no input devices in a container, loopback devices still work
 	if (dir == NULL)
-		return errno;
+		return errno == ENOENT ? 0 : errno;
 	while (!quit) {
 		errno = 0;
 		struct dirent *entry = readdir(dir);
@@ -157,7 +278,7 @@ static inline int walk_devices(struct lua_State *ls)
 			break;
 		}
 		if (entry->d_type == DT_CHR) {
-			rc = lua_device_event(ls, 1, entry->d_name);
+			rc = lua_device_event(ls, 1, entry->d_name, NULL);
 			if (rc != 0)
 				break;
 		}
@@ -166,43 +287,256 @@ static inline int walk_devices(struct lua_State *ls)
 	return rc;
 }
 
+// an added node is only announced once it exists as a character device
+static int hotplug(struct lua_State *ls, int dev_dir_fd, int event, const char *name, const struct uevent_t *uevent)
+{
+	// no script after a failed reload, walk_devices announces what is there once one runs again
+	if (ls == NULL)
+		return 0;
+	if (event == DEVICE_MONITOR_EVENT_ADD) {
+		struct stat statbuf;
+		if (fstatat(dev_dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+			return 0;
+		if ((statbuf.st_mode & S_IFMT) != S_IFCHR)
+			return 0;
+	}
+	return lua_device_event(ls, (event == DEVICE_MONITOR_EVENT_ADD), name, uevent);
+}
+
+// a synthetic kernel uevent from words such as add@/devices/virtual/input/input9/event9 KEY=VALUE ...
+static int inject_uevent(struct lua_State *ls, int dev_dir_fd, int argc, char **argv)
+{
+	char buf[CONTROL_LINE_SIZE + 1];
+	size_t len = 0;
+	struct uevent_t uevent;
+
+	for (int i = 1; i < argc; i++) {
+		size_t n = strlen(argv[i]) + 1;
+		if (len + n > CONTROL_LINE_SIZE)
+			return EMSGSIZE;
+		memcpy(buf + len, argv[i], n);
+		len += n;
+	}
+	if (uevent_parse(buf, len, &uevent) != 0)
+		return EINVAL;
+	if (!uevent_accept(&uevent))
+		return 0;
+	return hotplug(ls, dev_dir_fd, uevent.action, uevent.name, &uevent);
+}
+
+struct control_arg_t {
+	struct lua_State **ls;
+	int dev_dir_fd;
+};
+
+static int control_handler(void *arg, int argc, char **argv, FILE *out)
+{
+	struct control_arg_t *control_arg = (struct control_arg_t *)arg;
+	struct lua_State *ls = *control_arg->ls;
+
+	// after a failed reload, only commands that need no script work
+	if (ls == NULL && strcmp(argv[0], "record") && strcmp(argv[0], "reload") && strcmp(argv[0], "restart")) {
+		fprintf(out, "no script running, reload to start it again\n");
+		return ENOENT;
+	}
+	if (0 == strcmp(argv[0], "stats")) {
+		lua_device_report(ls, out);
+	} else if (0 == strcmp(argv[0], "histogram")) {
+		lua_device_histogram(ls, out);
+	} else if (0 == strcmp(argv[0], "passthrough") && argc == 3) {
+		int rc = lua_device_passthrough(ls, argv[1], 0 == strcmp(argv[2], "on"));
+		if (rc != 0)
+			return rc;
+		fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "profile") && argc <= 2) {
+		int rc = lua_device_profile(ls, argv[1], out);
+		if (rc != 0)
+			return rc;
+		if (argc == 2 && strcmp(argv[1], "dump"))
+			fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "record") && argc <= 2) {
+		int rc = recorder_save(&recorder, argc == 2 ? argv[1] : recorder.path);
+		if (rc != 0)
+			return rc;
+		fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "hotplug") && argc == 3 &&
+		   (0 == strcmp(argv[1], "add") || 0 == strcmp(argv[1], "del"))) {
+		// announces a device the same way as the monitor does, loopback devices have no node to watch
+		int rc = lua_device_event(ls, argv[1][0] == 'a', argv[2], NULL);
+		if (rc != 0)
+			return rc;
+		fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "uevent") && argc >= 2) {
+		int rc = inject_uevent(ls, control_arg->dev_dir_fd, argc, argv);
+		if (rc != 0)
+			return rc;
+		fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "reload")) {
+		reload = 1;
+		fprintf(out, "ok\n");
+	} else if (0 == strcmp(argv[0], "restart")) {
+		restart = 1;
+		fprintf(out, "ok\n");
+	} else {
+		fprintf(out, "commands: stats, histogram, passthrough DEVICE on|off, profile [dump|reset|HZ], record [FILE], hotplug add|del DEVICE, uevent ACTION@DEVPATH KEY=VALUE..., reload, restart\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static inline int start_lua(struct lua_State **ls, struct lua_device_info_t *lua_info, struct argp_info_t *argp_info)
+{
+	int rc;
+	*ls = lua_device_create(lua_info);
+	if (*ls == NULL)
+		return ENOMEM;
+
+	rc = lua_device_start(*ls, argp_info->main, argp_info->parameters);
+	if (rc != 0)
+		return rc;
+
+	return walk_devices(*ls);
+}
+
+static inline int64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// devices handed over and not taken by the script are closed, their nodes go away
+static void handoff_done(struct lua_device_info_t *lua_info)
+{
+	for (unsigned i = 0; i < handoff.count; i++) {
+		const struct handoff_entry_t *entry = handoff.entry + i;
+		if (entry->kind == HANDOFF_UINPUT && !entry->adopted && lua_info->hotplug)
+			hotplug_filter_own(lua_info->hotplug, entry->node, 0);
+	}
+	handoff_release(&handoff);
+}
+
+// runs the binary again with the devices of the state, returns only when that fails
+static int restart_process(struct lua_State *ls, int mode, char **argv)
+{
+	int rc;
+	int64_t time = handoff.time;
+	// neither exec() nor _exit() flush stdio
+	fflush(NULL);
+	handoff_init(&handoff);
+	// without a script there are no devices to hand over
+	rc = ls ? lua_device_handoff(ls, &handoff) : 0;
+	if (rc == 0 && mode == HANDOFF_MODE_STORE) {
+		rc = handoff_store(&handoff);
+		// closing the state would destroy the uinput devices the store keeps
+		if (rc == 0)
+			_exit(HANDOFF_EXIT_STATUS);
+	} else if (rc == 0) {
+		rc = handoff_exec(&handoff, argv);
+	}
+	// the devices are still the state's
+	handoff_init(&handoff);
+	handoff.time = time;
+	fprintf(stderr, "cannot restart: %s\n", strerror(rc));
+	return rc;
+}
+
+// a directory only we can write to, never a name in /tmp that someone else can take first
+static const char *recorder_default_path(void)
+{
+	const char *dir = getenv("RUNTIME_DIRECTORY");
+	if (dir == NULL || dir[0] == 0)
+		dir = getenv("XDG_RUNTIME_DIR");
+	if (dir == NULL || dir[0] == 0) {
+		dir = RECORDER_DIR;
+		// dumps fail later if it cannot be made
+		mkdir(dir, 0700);
+	}
+	// systemd lists several directories separated by ':', the first one is taken
+	snprintf(recorder_path, sizeof(recorder_path), "%.*s/" RECORDER_NAME, (int)strcspn(dir, ":"), dir);
+	return recorder_path;
+}
+
 int main(int argc, char **argv)
 {
 	int rc;
+	int started = 0;
 	int monitor_fd = -1;
+	int uevent_fd = -1;
+	int control_fd = -1;
 	struct lua_State *ls = NULL;
 	struct poll_group_t poll_group;
 	struct device_monitor_t monitor;
+	struct uevent_monitor_t uevent;
+	struct control_t control;
+	struct control_arg_t control_arg = {
+		.ls = &ls,
+		.dev_dir_fd = -1,
+	};
 	struct lua_device_info_t lua_info = {
 		.poll_group = &poll_group,
 		.dev_dir_fd = -1,
+		.recorder = &recorder,
 	};
 	struct argp_info_t argp_info = {
-		.time = 1000
+		.time = 1000,
+		.profile_rate = PROFILER_DEFAULT_RATE,
 	};
 
 	rc = argp_parse(&argp, argc, argv, 0, NULL, &argp_info);
 	if (rc != 0)
 		return rc;
+	recorder.path = argp_info.record ? argp_info.record : recorder_default_path();
+	rc = handoff_receive(&handoff);
+	if (rc != 0 && rc != ENOENT)
+		fprintf(stderr, "cannot take over devices, starting afresh: %s\n", strerror(rc));
+	lua_info.handoff = &handoff;
 
 	rc = poll_group_init(&poll_group);
 	if (rc != 0)
 		return rc;
+	if (argp_info.uring) {
+		rc = poll_group_use_uring(&poll_group);
+		if (rc != 0)
+			fprintf(stderr, "io_uring unavailable, using poll: %s\n", strerror(rc));
+	}
+	poll_group_set_spin(&poll_group, argp_info.busy_poll);
 
-	rc = open(DEV_INPUT_PATH, O_DIRECTORY | O_PATH);
-	if (rc < 0) {
+	rc = open(DEV_INPUT_PATH, O_DIRECTORY | O_PATH | O_CLOEXEC);
+	if (rc < 0 && errno == ENOENT) {
+		fprintf(stderr, "no %s, only loopback devices available\n", DEV_INPUT_PATH);
+	} else if (rc < 0) {
 		rc = errno;
 		goto end;
 	} else {
 		lua_info.dev_dir_fd = rc;
 	}
-	rc = device_monitor_init(&monitor, DEV_INPUT_PATH);
-	if (rc != 0)
-		goto end;
-	monitor_fd = device_monitor_get_fd(&monitor);
-	rc = poll_group_add(&poll_group, monitor_fd);
-	if (rc != 0)
-		goto end;
+	control_arg.dev_dir_fd = lua_info.dev_dir_fd;
+	if (lua_info.dev_dir_fd >= 0 && argp_info.uevent) {
+		rc = uevent_monitor_init(&uevent, argp_info.uevent);
+		if (rc != 0)
+			goto end;
+		uevent_fd = uevent.fd;
+		// both are read until EAGAIN below
+		rc = poll_group_add_drained(&poll_group, uevent_fd);
+		if (rc != 0)
+			goto end;
+	} else if (lua_info.dev_dir_fd >= 0) {
+		rc = device_monitor_init(&monitor, DEV_INPUT_PATH);
+		if (rc != 0)
+			goto end;
+		monitor_fd = device_monitor_get_fd(&monitor);
+		rc = poll_group_add_drained(&poll_group, monitor_fd);
+		if (rc != 0)
+			goto end;
+	}
+
+	if (argp_info.socket) {
+		rc = control_init(&control, argp_info.socket, &poll_group);
+		if (rc != 0)
+			goto end;
+		control_fd = control.fd;
+	}
 
 	if (argp_info.mlock) {
 		rc = mlockall(MCL_CURRENT | MCL_FUTURE);
@@ -212,7 +546,19 @@ int main(int argc, char **argv)
 		}
 	}
 
+	lua_info.hotplug = hotplug_filter_create();
+	if (lua_info.hotplug == NULL) {
+		rc = ENOMEM;
+		goto end;
+	}
+	// handed over uinput devices are ours, whether the script takes them or not
+	for (unsigned i = 0; i < handoff.count; i++) {
+		if (handoff.entry[i].kind == HANDOFF_UINPUT)
+			hotplug_filter_own(lua_info.hotplug, handoff.entry[i].node, 1);
+	}
 	lua_info.mem_limit = argp_info.memory;
+	lua_info.gc_mode = argp_info.gc_mode;
+	memcpy(lua_info.gc_param, argp_info.gc_param, sizeof(lua_info.gc_param));
 	if (argp_info.time) {
 		rc = timer_create(CLOCK_MONOTONIC, NULL, &lua_info.timer_id);
 		if (rc != 0) {
@@ -222,6 +568,15 @@ int main(int argc, char **argv)
 		lua_info.time_limit = argp_info.time;
 	}
 
+	if (argp_info.profile) {
+		lua_info.profiler = profiler_create();
+		if (lua_info.profiler == NULL) {
+			rc = ENOMEM;
+			goto end;
+		}
+		profiler_set_rate(lua_info.profiler, argp_info.profile_rate);
+	}
+
 	if (argp_info.nice < 0) {
 		errno = 0;
 		rc = nice(argp_info.nice);
@@ -230,20 +585,32 @@ int main(int argc, char **argv)
 	}
 
 	set_signal();
-	ls = lua_device_create(&lua_info);
-	if (ls == NULL)
-		goto end;
-
-	rc = lua_device_start(ls, argp_info.main, argp_info.parameters);
-	if (rc != 0)
-		goto end;
-
-	rc = walk_devices(ls);
+	rc = start_lua(&ls, &lua_info, &argp_info);
+	handoff_done(&lua_info);
 	if (rc != 0)
 		goto end;
+	started = 1;
 
 	while (!quit) {
 		int fd;
+		if (restart) {
+			restart = 0;
+			restart_process(ls, argp_info.handoff ? argp_info.handoff : HANDOFF_MODE_EXEC, argv);
+		}
+		if (reload) {
+			// closing the state releases all devices and timers of it
+			reload = 0;
+			if (ls)
+				lua_device_destroy(ls);
+			rc = start_lua(&ls, &lua_info, &argp_info);
+			if (rc != 0) {
+				// a broken config does not take the daemon down, it waits for the next reload
+				fprintf(stderr, "reload failed with error %d, no script runs until the next reload\n", rc);
+				if (ls)
+					lua_device_destroy(ls);
+				ls = NULL;
+			}
+		}
 		rc = poll_group_next(&poll_group, &fd);
 		if (rc == EINTR || rc == EAGAIN)
 			continue;
@@ -261,25 +628,32 @@ int main(int argc, char **argv)
 				if (rc != 0)
 					goto end;
 
-				switch (event) {
-				case DEVICE_MONITOR_EVENT_ADD:
-				{
-					struct stat statbuf;
-					rc = fstatat(lua_info.dev_dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW);
-					if (rc != 0)
-						break;
-					if ((statbuf.st_mode & S_IFMT) != S_IFCHR)
-						break;
-				}
-				// fallthrough
-				case DEVICE_MONITOR_EVENT_DEL:
-					rc = lua_device_event(ls, (event == DEVICE_MONITOR_EVENT_ADD), name);
-					if (rc != 0)
-						goto end;
+				rc = hotplug(ls, lua_info.dev_dir_fd, event, name, NULL);
+				if (rc != 0)
+					goto end;
+			} while (1);
+		} else if (fd == uevent_fd) {
+			struct uevent_t ev;
+			do {
+				rc = uevent_monitor_next(&uevent, &ev);
+				if (rc == EINTR)
+					continue;
+				if (rc == EAGAIN)
 					break;
-				}
+				// a burst of uevents overflowed the socket, later ones still come
+				if (rc == ENOBUFS)
+					continue;
+				if (rc != 0)
+					goto end;
+				rc = hotplug(ls, lua_info.dev_dir_fd, ev.action, ev.name, &ev);
+				if (rc != 0)
+					goto end;
 			} while (1);
-		} else {
+		} else if (control_fd >= 0 && control_owns(&control, fd)) {
+			rc = control_handle(&control, fd, control_handler, &control_arg);
+			if (rc != 0)
+				goto end;
+		} else if (ls) {
 			rc = lua_device_handle_fd(ls, fd);
 			if (rc != 0)
 				goto end;
@@ -288,10 +662,31 @@ int main(int argc, char **argv)
 
 	rc = 0;
 end:
+	// an error while running hands the devices over to a fresh process instead of closing them
+	if (rc != 0 && started && argp_info.handoff && get_time_ns() - handoff.time >= RESTART_INTERVAL_NS) {
+		fprintf(stderr, "restarting after error %d\n", rc);
+		restart_process(ls, argp_info.handoff, argv);
+	}
+	handoff_release(&handoff);
 	if (ls)
 		lua_device_destroy(ls);
+	if (argp_info.profile && lua_info.profiler) {
+		FILE *out = fopen(argp_info.profile, "w");
+		if (out) {
+			profiler_dump(lua_info.profiler, out);
+			fclose(out);
+		} else {
+			fprintf(stderr, "cannot write profile %s: %s\n", argp_info.profile, strerror(errno));
+		}
+	}
+	profiler_destroy(lua_info.profiler);
+	hotplug_filter_destroy(lua_info.hotplug);
 	if (monitor_fd >= 0)
 		device_monitor_cleanup(&monitor);
+	if (uevent_fd >= 0)
+		uevent_monitor_cleanup(&uevent);
+	if (control_fd >= 0)
+		control_cleanup(&control);
 	if (lua_info.time_limit > 0)
 		timer_delete(lua_info.timer_id);
 	if (lua_info.dev_dir_fd >= 0)
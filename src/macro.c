@@ -0,0 +1,199 @@
+#include "macro.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/input.h>
+
+void macro_player_init(struct macro_player_t *player, void *sink)
+{
+	memset(player, 0, sizeof(struct macro_player_t));
+	player->sink = sink;
+	macro_player_set_rate(player, MACRO_DEFAULT_RATE);
+}
+
+void macro_player_cleanup(struct macro_player_t *player)
+{
+	free(player->step);
+	player->step = NULL;
+	player->head = 0;
+	player->count = 0;
+	player->capacity = 0;
+}
+
+void macro_player_set_rate(struct macro_player_t *player, unsigned rate)
+{
+	player->interval = 1000000000LL / (rate ? rate : MACRO_DEFAULT_RATE);
+}
+
+// the next frame is at least an interval after the last one, wherever the schedule would have it
+static inline void macro_player_advance(struct macro_player_t *player, int64_t from)
+{
+	player->due = from + (int64_t)player->step[player->head].delay * 1000;
+	if (player->due < player->last + player->interval)
+		player->due = player->last + player->interval;
+}
+
+int macro_player_queue(struct macro_player_t *player, const struct macro_step_t *step, unsigned count,
+		       uint32_t id, int64_t now)
+{
+	struct macro_step_t *tail;
+
+	if (player->count + count > MACRO_QUEUE_MAX)
+		return ENOSPC;
+	if (player->head + player->count + count > player->capacity) {
+		// compact first, grow only when that is not enough
+		memmove(player->step, player->step + player->head, sizeof(struct macro_step_t) * player->count);
+		player->head = 0;
+		if (player->count + count > player->capacity) {
+			unsigned capacity = player->capacity ? player->capacity : 64;
+			void *p;
+			while (capacity < player->count + count)
+				capacity *= 2;
+			p = realloc(player->step, sizeof(struct macro_step_t) * capacity);
+			if (p == NULL)
+				return ENOMEM;
+			player->step = (struct macro_step_t *)p;
+			player->capacity = capacity;
+		}
+	}
+	tail = player->step + player->head + player->count;
+	memcpy(tail, step, sizeof(struct macro_step_t) * count);
+	for (unsigned i = 0; i < count; i++)
+		tail[i].id = id;
+	player->count += count;
+	if (player->count == count)
+		macro_player_advance(player, now);
+	return 0;
+}
+
+unsigned macro_player_cancel(struct macro_player_t *player, uint32_t id)
+{
+	unsigned kept = 0;
+	unsigned removed;
+	struct macro_step_t *step = player->step + player->head;
+	int head_removed = player->count && (id == 0 || step[0].id == id);
+	// what the removed frame was scheduled from
+	int64_t from = player->count ? player->due - (int64_t)step[0].delay * 1000 : 0;
+
+	for (unsigned i = 0; i < player->count; i++) {
+		if (id != 0 && step[i].id != id)
+			step[kept++] = step[i];
+	}
+	removed = player->count - kept;
+	player->count = kept;
+	if (kept == 0)
+		player->head = 0;
+	// the frame now first waits its own delay instead of the one dropped
+	else if (head_removed)
+		macro_player_advance(player, from);
+	return removed;
+}
+
+unsigned macro_player_release(struct macro_player_t *player, uint32_t id, struct input_event *out, unsigned max)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < sizeof(player->held) && n < max; i++) {
+		for (uint8_t keys = player->held[i]; keys && n < max; keys &= keys - 1) {
+			unsigned bit = __builtin_ctz(keys);
+			unsigned code = i * 8 + bit;
+			if (id != 0 && player->held_id[code] != id)
+				continue;
+			player->held[i] &= ~(1u << bit);
+			memset(out + n, 0, sizeof(struct input_event));
+			out[n].type = EV_KEY;
+			out[n].code = code;
+			out[n].value = 0;
+			n++;
+		}
+	}
+	return n;
+}
+
+static unsigned macro_player_frame(struct macro_player_t *player, struct input_event *out)
+{
+	unsigned n = 0;
+	while (player->count && n < MACRO_FRAME_MAX) {
+		const struct macro_step_t *step = player->step + player->head;
+		memset(out + n, 0, sizeof(struct input_event));
+		out[n].type = step->type;
+		out[n].code = step->code;
+		out[n].value = step->value;
+		n++;
+		player->head++;
+		player->count--;
+		if (step->type == EV_KEY && step->code < KEY_CNT) {
+			if (step->value) {
+				player->held[step->code / 8] |= 1u << (step->code % 8);
+				player->held_id[step->code] = step->id;
+			} else
+				player->held[step->code / 8] &= ~(1u << (step->code % 8));
+		}
+		if (step->type == EV_SYN && step->code == SYN_REPORT)
+			break;
+	}
+	if (player->count == 0)
+		player->head = 0;
+	return n;
+}
+
+void macro_sched_init(struct macro_sched_t *sched, int fd)
+{
+	memset(sched, 0, sizeof(struct macro_sched_t));
+	sched->fd = fd;
+}
+
+void macro_sched_link(struct macro_sched_t *sched, struct macro_player_t *player)
+{
+	if (player->linked)
+		return;
+	player->next = sched->active;
+	sched->active = player;
+	player->linked = 1;
+}
+
+void macro_sched_unlink(struct macro_sched_t *sched, struct macro_player_t *player)
+{
+	struct macro_player_t **p;
+	if (!player->linked)
+		return;
+	for (p = &sched->active; *p; p = &(*p)->next) {
+		if (*p == player) {
+			*p = player->next;
+			break;
+		}
+	}
+	player->next = NULL;
+	player->linked = 0;
+}
+
+int64_t macro_sched_run(struct macro_sched_t *sched, int64_t now, macro_emit_t emit, void *ctx)
+{
+	int64_t next = 0;
+	struct macro_player_t **p = &sched->active;
+	struct input_event out[MACRO_FRAME_MAX];
+
+	while (*p) {
+		struct macro_player_t *player = *p;
+		// one frame per sink and wakeup, a late timer does not write a burst
+		if (player->count && player->due <= now) {
+			unsigned n = macro_player_frame(player, out);
+			emit(player->sink, out, n, ctx);
+			sched->frames++;
+			sched->events += n;
+			player->last = now;
+			// from when it was due rather than when it ran, late wakeups do not add up
+			if (player->count)
+				macro_player_advance(player, player->due);
+		}
+		if (player->count == 0) {
+			*p = player->next;
+			player->next = NULL;
+			player->linked = 0;
+			continue;
+		}
+		if (next == 0 || player->due < next)
+			next = player->due;
+		p = &player->next;
+	}
+	return next;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <linux/input-event-codes.h>
+
+struct input_event;
+
+// steps queued per sink, typing a character takes four
+#define MACRO_QUEUE_MAX 8192
+// events of one frame, up to and including its SYN_REPORT
+#define MACRO_FRAME_MAX 32
+// frames per second written to one sink
+#define MACRO_DEFAULT_RATE 1000
+#define MACRO_MAX_RATE 100000
+
+struct macro_step_t {
+	uint32_t delay;		// us to wait before the frame starting with this step
+	uint32_t id;
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+struct macro_player_t {
+	// next player with queued steps
+	struct macro_player_t *next;
+	int linked;
+	void *sink;
+	// monotonic ns of the next frame, and of the last one written
+	int64_t due;
+	int64_t last;
+	int64_t interval;
+	struct macro_step_t *step;
+	unsigned head;
+	unsigned count;
+	unsigned capacity;
+	// keys pressed by macros and not released yet, and the macro that pressed each
+	uint8_t held[KEY_CNT / 8];
+	uint32_t held_id[KEY_CNT];
+};
+
+struct macro_sched_t {
+	struct macro_player_t *active;
+	uint32_t last_id;
+	int fd;
+	// deadline the timer is set to, 0 when disarmed
+	int64_t armed;
+	uint64_t plays;
+	uint64_t wakeups;
+	uint64_t frames;
+	uint64_t events;
+	uint64_t cancels;
+	uint64_t drops;
+};
+
+typedef void (*macro_emit_t)(void *sink, const struct input_event *ev, unsigned count, void *ctx);
+
+void macro_player_init(struct macro_player_t *player, void *sink);
+void macro_player_cleanup(struct macro_player_t *player);
+void macro_player_set_rate(struct macro_player_t *player, unsigned rate);
+int macro_player_queue(struct macro_player_t *player, const struct macro_step_t *step, unsigned count,
+		       uint32_t id, int64_t now);
+// drops queued steps of macro id, or all of them for id 0, returns how many
+unsigned macro_player_cancel(struct macro_player_t *player, uint32_t id);
+// releases of keys held by macro id, or by any for id 0, at most max of them, call until it returns 0
+unsigned macro_player_release(struct macro_player_t *player, uint32_t id, struct input_event *out, unsigned max);
+
+void macro_sched_init(struct macro_sched_t *sched, int fd);
+void macro_sched_link(struct macro_sched_t *sched, struct macro_player_t *player);
+void macro_sched_unlink(struct macro_sched_t *sched, struct macro_player_t *player);
+// writes the frames due at now, returns the next deadline or 0 when nothing is queued
+int64_t macro_sched_run(struct macro_sched_t *sched, int64_t now, macro_emit_t emit, void *ctx);
@@ -9,7 +9,7 @@
 int device_monitor_init(struct device_monitor_t *monitor, const char *path)
 {
 	int rc;
-	monitor->fd = inotify_init1(IN_NONBLOCK);
+	monitor->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 	if (monitor->fd < 0)
 		return errno;
 	rc = inotify_add_watch(monitor->fd, path, IN_CREATE | IN_DELETE | IN_ONLYDIR);
@@ -0,0 +1,128 @@
+#include "pointer.h"
+#include <string.h>
+
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef int64_t v4di __attribute__((vector_size(32)));
+
+#define VECTOR_WIDTH (sizeof(v4si) / sizeof(int32_t))
+
+static inline int32_t to_fixed(double value)
+{
+	return (int32_t)(value * POINTER_ONE + (value < 0 ? -0.5 : 0.5));
+}
+
+void pointer_stage_init(struct pointer_stage_t *stage, double scale_x, double scale_y)
+{
+	memset(stage, 0, sizeof(struct pointer_stage_t));
+	stage->scale[0] = to_fixed(scale_x);
+	stage->scale[1] = to_fixed(scale_y);
+	for (unsigned i = 0; i < POINTER_ACCEL_SIZE; i++)
+		stage->accel[i] = POINTER_ONE;
+}
+
+void pointer_stage_set_accel(struct pointer_stage_t *stage, const double *speed, const double *factor, unsigned count)
+{
+	unsigned j = 0;
+	// piecewise linear between points sorted by speed, flat outside
+	for (unsigned i = 0; i < POINTER_ACCEL_SIZE; i++) {
+		double value;
+		while (j < count && speed[j] <= i)
+			j++;
+		if (count == 0)
+			value = 1;
+		else if (j == 0)
+			value = factor[0];
+		else if (j == count)
+			value = factor[count - 1];
+		else
+			value = factor[j - 1] + (factor[j] - factor[j - 1]) * (i - speed[j - 1]) / (speed[j] - speed[j - 1]);
+		stage->accel[i] = to_fixed(value);
+	}
+}
+
+int pointer_stage_push(struct pointer_stage_t *stage, const struct timeval *time)
+{
+	if (stage->frame_events == 0)
+		return 0;
+	stage->dx[stage->count] = stage->frame_dx;
+	stage->dy[stage->count] = stage->frame_dy;
+	stage->time[stage->count] = *time;
+	stage->count++;
+	stage->events += stage->frame_events;
+	stage->frames++;
+	stage->frame_dx = 0;
+	stage->frame_dy = 0;
+	stage->frame_events = 0;
+	return stage->count == POINTER_BATCH_SIZE;
+}
+
+// unsigned, so that the magnitude of INT32_MIN is 2^31 rather than negative
+static inline v4su v4si_abs(v4si x)
+{
+	v4su sign = (v4su)(x >> 31);
+	return ((v4su)x ^ sign) - sign;
+}
+
+static inline v4su v4su_select(v4si mask, v4su a, v4su b)
+{
+	return (a & (v4su)mask) | (b & ~(v4su)mask);
+}
+
+static inline int32_t saturate_int32(int64_t value)
+{
+	if (value > INT32_MAX)
+		return INT32_MAX;
+	if (value < INT32_MIN)
+		return INT32_MIN;
+	return (int32_t)value;
+}
+
+// resolve the batch into integer counts in place, carrying sub-count remainders over
+void pointer_stage_process(struct pointer_stage_t *stage)
+{
+	int64_t gx[POINTER_BATCH_SIZE] __attribute__((aligned(32)));
+	int64_t gy[POINTER_BATCH_SIZE] __attribute__((aligned(32)));
+	const v4su limit = { POINTER_ACCEL_SIZE - 1, POINTER_ACCEL_SIZE - 1, POINTER_ACCEL_SIZE - 1, POINTER_ACCEL_SIZE - 1 };
+	const v4di scale_x = { stage->scale[0], stage->scale[0], stage->scale[0], stage->scale[0] };
+	const v4di scale_y = { stage->scale[1], stage->scale[1], stage->scale[1], stage->scale[1] };
+	unsigned count = stage->count;
+	unsigned padded = (count + VECTOR_WIDTH - 1) & ~(VECTOR_WIDTH - 1);
+
+	for (unsigned i = count; i < padded; i++) {
+		stage->dx[i] = 0;
+		stage->dy[i] = 0;
+	}
+
+	for (unsigned i = 0; i < padded; i += VECTOR_WIDTH) {
+		v4si x = *(const v4si *)(stage->dx + i);
+		v4si y = *(const v4si *)(stage->dy + i);
+		v4su ax = v4si_abs(x);
+		v4su ay = v4si_abs(y);
+		v4si greater = ax > ay;
+		// octagonal approximation of the vector length, at most 3 * 2^30 so it does not wrap
+		v4su speed = v4su_select(greater, ax, ay) + (v4su_select(greater, ay, ax) >> 1);
+		v4su index = v4su_select(speed > limit, limit, speed);
+		v4di gain = {
+			stage->accel[index[0]], stage->accel[index[1]],
+			stage->accel[index[2]], stage->accel[index[3]],
+		};
+		*(v4di *)(gx + i) = __builtin_convertvector(x, v4di) * ((gain * scale_x) >> POINTER_FRAC_BITS);
+		*(v4di *)(gy + i) = __builtin_convertvector(y, v4di) * ((gain * scale_y) >> POINTER_FRAC_BITS);
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		int64_t total_x = stage->remainder[0] + gx[i];
+		int64_t total_y = stage->remainder[1] + gy[i];
+		// a gain above 1 may take huge motion past the range of an event value
+		stage->dx[i] = saturate_int32(total_x / POINTER_ONE);
+		stage->dy[i] = saturate_int32(total_y / POINTER_ONE);
+		stage->remainder[0] = total_x - (int64_t)stage->dx[i] * POINTER_ONE;
+		stage->remainder[1] = total_y - (int64_t)stage->dy[i] * POINTER_ONE;
+		// what did not fit is dropped, not sent with the frames after
+		if (stage->remainder[0] <= -POINTER_ONE || stage->remainder[0] >= POINTER_ONE)
+			stage->remainder[0] = 0;
+		if (stage->remainder[1] <= -POINTER_ONE || stage->remainder[1] >= POINTER_ONE)
+			stage->remainder[1] = 0;
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <sys/time.h>
+
+// frames of motion processed at once, multiple of the vector width
+#define POINTER_BATCH_SIZE 32
+// acceleration lookup table, indexed by speed in counts per frame
+#define POINTER_ACCEL_SIZE 64
+// fixed-point gains and remainders, Q16
+#define POINTER_FRAC_BITS 16
+#define POINTER_ONE (1 << POINTER_FRAC_BITS)
+
+struct pointer_stage_t {
+	int32_t dx[POINTER_BATCH_SIZE] __attribute__((aligned(32)));
+	int32_t dy[POINTER_BATCH_SIZE] __attribute__((aligned(32)));
+	struct timeval time[POINTER_BATCH_SIZE];
+	unsigned count;
+	// motion of the frame being read
+	int32_t frame_dx;
+	int32_t frame_dy;
+	unsigned frame_events;
+	int32_t scale[2];
+	int64_t remainder[2];
+	int32_t accel[POINTER_ACCEL_SIZE];
+	uint64_t events;
+	uint64_t frames;
+	// for rate reports
+	uint64_t report_events;
+	int64_t report_time;
+};
+
+// coalesces motion of one frame, saturating as a device may send values up to INT32_MIN
+static inline void pointer_frame_add(int32_t *sum, int32_t value)
+{
+	if (__builtin_add_overflow(*sum, value, sum))
+		*sum = value < 0 ? INT32_MIN : INT32_MAX;
+}
+
+void pointer_stage_init(struct pointer_stage_t *stage, double scale_x, double scale_y);
+void pointer_stage_set_accel(struct pointer_stage_t *stage, const double *speed, const double *factor, unsigned count);
+int pointer_stage_push(struct pointer_stage_t *stage, const struct timeval *time);
+void pointer_stage_process(struct pointer_stage_t *stage);
@@ -4,26 +4,122 @@
 #include <string.h>
 #include <poll.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "uring.h"
 
 #define CAPACITY_INC_STEP 4
 
+#define URING_ENTRIES 256
+#define URING_WRITE_BUFFER 8192
+#define URING_WRITE_QUEUE 128
+// user_data of poll SQEs is stamp << 32 | fd, write SQEs carry their length
+#define URING_WRITE_TAG (1ULL << 63)
+#define URING_CANCEL_TAG (1ULL << 62)
+
+// Linux 5.13, older headers lack them
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+struct poll_write_t {
+	int fd;
+	unsigned offset;
+	unsigned length;
+};
+
+struct poll_uring_t {
+	struct uring_t ring;
+	// stamp of the armed poll per entry of poll_fd, 0 when not armed
+	uint32_t *armed;
+	uint32_t stamp;
+	// multishot polls for drained fds, off once the kernel refused one
+	int multishot;
+	// poll_group_pending() was called, look at revents again before waiting
+	int pending;
+	unsigned write_count;
+	unsigned write_length;
+	unsigned inflight;
+	struct poll_write_t write[URING_WRITE_QUEUE];
+	char buffer[URING_WRITE_BUFFER];
+};
+
 int poll_group_init(struct poll_group_t *group)
 {
+	memset(group, 0, sizeof(struct poll_group_t));
 	group->capacity = CAPACITY_INC_STEP;
-	group->size = 0;
-	group->index = 0;
 	group->poll_fd = (struct pollfd *)malloc(sizeof(struct pollfd) * group->capacity);
-	if (group->poll_fd == NULL)
+	group->drained = (uint8_t *)malloc(group->capacity);
+	if (group->poll_fd == NULL || group->drained == NULL) {
+		free(group->poll_fd);
+		free(group->drained);
 		return -ENOMEM;
+	}
 	return 0;
 }
 
 void poll_group_cleanup(struct poll_group_t *group)
 {
+	if (group->uring) {
+		// closing the ring cancels all armed polls
+		uring_cleanup(&group->uring->ring);
+		free(group->uring->armed);
+		free(group->uring);
+	}
 	free(group->poll_fd);
+	free(group->drained);
 	memset(group, 0, sizeof(struct poll_group_t));
 }
 
+static inline int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+void poll_group_set_spin(struct poll_group_t *group, unsigned us)
+{
+	group->spin_max = (int64_t)us * 1000;
+	group->spin_window = group->spin_max;
+	group->last_ready = 0;
+}
+
+// input came a moment ago, more is likely to follow before a blocking wait would return
+static inline int64_t spin_deadline(const struct poll_group_t *group, int64_t now)
+{
+	if (group->spin_max == 0 || now - group->last_ready >= group->spin_window)
+		return 0;
+	return group->last_ready + group->spin_window;
+}
+
+// a spin that found input widens the window, one that ran out narrows it
+static void spin_done(struct poll_group_t *group, int hit, int64_t start, int64_t now)
+{
+	group->stat.spin_ns += now - start;
+	if (hit) {
+		group->stat.spin_hits++;
+		group->last_ready = now;
+		group->spin_window *= 2;
+		if (group->spin_window > group->spin_max)
+			group->spin_window = group->spin_max;
+	} else {
+		group->spin_window /= 2;
+		if (group->spin_window < group->spin_max / 16)
+			group->spin_window = group->spin_max / 16;
+	}
+}
+
+static inline void ready(struct poll_group_t *group)
+{
+	if (group->spin_max)
+		group->last_ready = now_ns();
+}
+
 static unsigned poll_group_find(struct poll_group_t *group, int fd)
 {
 	unsigned i;
@@ -34,7 +130,75 @@ static unsigned poll_group_find(struct poll_group_t *group, int fd)
 	return i;
 }
 
-int poll_group_add(struct poll_group_t *group, int fd)
+static int uring_submit(struct poll_group_t *group, unsigned wait_nr)
+{
+	struct uring_t *ring = &group->uring->ring;
+	int rc = uring_enter(ring, wait_nr);
+	if (wait_nr)
+		group->stat.waits++;
+	group->stat.syscalls = ring->enters;
+	group->stat.sqes = ring->sqes_submitted;
+	return rc;
+}
+
+// submits what is pending when the submission queue is full
+static struct io_uring_sqe *uring_sqe(struct poll_group_t *group)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&group->uring->ring);
+	if (sqe == NULL && uring_submit(group, 0) == 0)
+		sqe = uring_get_sqe(&group->uring->ring);
+	return sqe;
+}
+
+static int uring_arm(struct poll_group_t *group, unsigned index)
+{
+	struct poll_uring_t *uring = group->uring;
+	struct io_uring_sqe *sqe = uring_sqe(group);
+	int fd = group->poll_fd[index].fd;
+	if (sqe == NULL)
+		return -EBUSY;
+	if (++uring->stamp == 0)
+		uring->stamp = 1;
+	// one-shot, so readiness is level triggered as with poll(2), unless the handler drains the fd
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	if (uring->multishot && group->drained[index])
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uint64_t)uring->stamp << 32 | (uint32_t)fd;
+	uring->armed[index] = uring->stamp;
+	return 0;
+}
+
+static void uring_disarm(struct poll_group_t *group, unsigned index)
+{
+	struct poll_uring_t *uring = group->uring;
+	struct io_uring_sqe *sqe;
+	int fd = group->poll_fd[index].fd;
+
+	if (uring->armed[index] == 0)
+		return;
+	sqe = uring_sqe(group);
+	if (sqe) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uint64_t)uring->armed[index] << 32 | (uint32_t)fd;
+		sqe->user_data = URING_CANCEL_TAG;
+		// the armed poll holds a reference to the file, drop it before the fd is closed
+		uring_submit(group, 0);
+	}
+	uring->armed[index] = 0;
+}
+
+// entries moved: poll(2) gets the readiness again on its next call, a completion is only seen once
+static inline void poll_group_moved(struct poll_group_t *group)
+{
+	if (group->uring)
+		group->uring->pending = 1;
+	else
+		group->index = group->size;
+}
+
+static int poll_group_add_entry(struct poll_group_t *group, int fd, int drained)
 {
 	if (poll_group_find(group, fd) < group->size)
 		return -EEXIST;
@@ -45,41 +209,318 @@ int poll_group_add(struct poll_group_t *group, int fd)
 		if (p == NULL)
 			return -ENOMEM;
 		group->poll_fd = (struct pollfd *)p;
+		p = realloc(group->drained, new_cap);
+		if (p == NULL)
+			return -ENOMEM;
+		group->drained = (uint8_t *)p;
+		if (group->uring) {
+			p = realloc(group->uring->armed, sizeof(uint32_t) * new_cap);
+			if (p == NULL)
+				return -ENOMEM;
+			group->uring->armed = (uint32_t *)p;
+		}
 		group->capacity = new_cap;
 	}
 	group->poll_fd[group->size].fd = fd;
 	group->poll_fd[group->size].events = POLLIN;
 	group->poll_fd[group->size].revents = 0;
+	group->drained[group->size] = drained;
+	if (group->uring && uring_arm(group, group->size) != 0)
+		return -EBUSY;
 	group->size++;
-	group->index = group->size;
+	poll_group_moved(group);
 	return 0;
 }
 
+int poll_group_add(struct poll_group_t *group, int fd)
+{
+	return poll_group_add_entry(group, fd, 0);
+}
+
+int poll_group_add_drained(struct poll_group_t *group, int fd)
+{
+	return poll_group_add_entry(group, fd, 1);
+}
+
 int poll_group_del(struct poll_group_t *group, int fd)
 {
 	unsigned index = poll_group_find(group, fd);
 	if (index >= group->size)
 		return -EINVAL;
+	if (group->uring) {
+		uring_disarm(group, index);
+		group->uring->armed[index] = group->uring->armed[group->size - 1];
+	}
 	group->poll_fd[index] = group->poll_fd[--group->size];
-	group->index = group->size;
+	group->drained[index] = group->drained[group->size];
+	poll_group_moved(group);
 	return 0;
 }
 
+void poll_group_pending(struct poll_group_t *group, int fd)
+{
+	unsigned index;
+	// poll(2) is level triggered, it sees the fd is still readable
+	if (group->uring == NULL)
+		return;
+	index = poll_group_find(group, fd);
+	if (index < group->size) {
+		group->poll_fd[index].revents = POLLIN;
+		group->uring->pending = 1;
+	}
+}
+
+int poll_group_use_uring(struct poll_group_t *group)
+{
+	int rc;
+	struct poll_uring_t *uring = (struct poll_uring_t *)calloc(1, sizeof(struct poll_uring_t));
+	if (uring == NULL)
+		return ENOMEM;
+	uring->armed = (uint32_t *)calloc(group->capacity, sizeof(uint32_t));
+	if (uring->armed == NULL) {
+		free(uring);
+		return ENOMEM;
+	}
+	rc = uring_init(&uring->ring, URING_ENTRIES);
+	if (rc != 0) {
+		free(uring->armed);
+		free(uring);
+		return rc;
+	}
+	uring->multishot = 1;
+	group->uring = uring;
+	for (unsigned i = 0; i < group->size; i++)
+		uring_arm(group, i);
+	return 0;
+}
+
+static void uring_reap(struct poll_group_t *group)
+{
+	struct poll_uring_t *uring = group->uring;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(&uring->ring)) != NULL) {
+		uint64_t data = cqe->user_data;
+		if (data & URING_WRITE_TAG) {
+			uring->inflight--;
+			if (cqe->res < 0 || (uint32_t)cqe->res != (uint32_t)data)
+				group->stat.write_errors++;
+		} else if (!(data & URING_CANCEL_TAG)) {
+			unsigned index = poll_group_find(group, (int)(uint32_t)data);
+			// a poll of an fd removed in the meantime does not match
+			if (index < group->size && uring->armed[index] == (uint32_t)(data >> 32)) {
+				// a multishot poll stays armed until the kernel ends it
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					uring->armed[index] = 0;
+				// an error or hangup is seen by the handler on its read, instead of firing the poll again and again
+				if (cqe->res > 0 && (cqe->res & (POLLIN | POLLERR | POLLHUP | POLLNVAL))) {
+					group->poll_fd[index].revents = POLLIN;
+				} else if (cqe->res == -EINVAL && uring->multishot && group->drained[index]) {
+					// before Linux 5.13, the handler runs once and the fd gets a one-shot poll
+					uring->multishot = 0;
+					group->poll_fd[index].revents = POLLIN;
+				}
+			}
+		}
+		uring_cqe_seen(&uring->ring);
+		group->stat.cqes++;
+	}
+	if (uring->inflight == 0 && uring->write_count == 0)
+		uring->write_length = 0;
+}
+
+// one linked chain per fd keeps its writes in order, a failing sink does not hold up the others
+static void uring_emit_writes(struct poll_group_t *group)
+{
+	struct poll_uring_t *uring = group->uring;
+
+	for (unsigned i = 0; i < uring->write_count; i++) {
+		unsigned length = 0;
+		int fd = uring->write[i].fd;
+		if (fd < 0)
+			continue;
+		for (unsigned j = i; j < uring->write_count; j++)
+			length += uring->write[j].fd == fd;
+		// a submission in the middle would split the chain, and its writes could pass each other
+		if (uring_sq_space(&uring->ring) < length)
+			uring_submit(group, 0);
+		for (unsigned j = i; j < uring->write_count && length; j++) {
+			struct poll_write_t *write = uring->write + j;
+			struct io_uring_sqe *sqe;
+			if (write->fd != fd)
+				continue;
+			write->fd = -1;
+			length--;
+			sqe = uring_get_sqe(&uring->ring);
+			if (sqe == NULL) {
+				group->stat.write_errors++;
+				continue;
+			}
+			if (length)
+				sqe->flags |= IOSQE_IO_LINK;
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t)(uintptr_t)(uring->buffer + write->offset);
+			sqe->len = write->length;
+			sqe->off = (uint64_t)-1;
+			sqe->user_data = URING_WRITE_TAG | write->length;
+			uring->inflight++;
+			group->stat.writes++;
+		}
+	}
+	uring->write_count = 0;
+}
+
+int poll_group_write(struct poll_group_t *group, int fd, const void *buf, size_t len)
+{
+	struct poll_uring_t *uring = group->uring;
+	struct poll_write_t *last;
+
+	if (uring == NULL) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0)
+			return -errno;
+		return (size_t)n == len ? 0 : -EIO;
+	}
+	if (len > URING_WRITE_BUFFER)
+		return -EMSGSIZE;
+	if (uring->write_length + len > URING_WRITE_BUFFER || uring->write_count == URING_WRITE_QUEUE)
+		poll_group_flush(group);
+
+	memcpy(uring->buffer + uring->write_length, buf, len);
+	last = uring->write_count ? uring->write + uring->write_count - 1 : NULL;
+	if (last && last->fd == fd && last->offset + last->length == uring->write_length) {
+		last->length += len;
+	} else {
+		last = uring->write + uring->write_count++;
+		last->fd = fd;
+		last->offset = uring->write_length;
+		last->length = len;
+	}
+	uring->write_length += len;
+	return 0;
+}
+
+void poll_group_flush(struct poll_group_t *group)
+{
+	struct poll_uring_t *uring = group->uring;
+	if (uring == NULL)
+		return;
+	uring_emit_writes(group);
+	while (uring->inflight || uring->ring.to_submit) {
+		int rc = uring_submit(group, uring->inflight ? 1 : 0);
+		if (rc != 0 && rc != EINTR)
+			break;
+		uring_reap(group);
+	}
+	uring_reap(group);
+}
+
+static int uring_spin(struct poll_group_t *group)
+{
+	int hit = 0;
+	int64_t start = now_ns();
+	int64_t now = start;
+	int64_t deadline = spin_deadline(group, now);
+	if (deadline == 0)
+		return 0;
+	// writes and new polls go out first, then only the completion ring is looked at
+	uring_emit_writes(group);
+	if (uring_submit(group, 0) != 0)
+		return 0;
+	while (!hit && now < deadline) {
+		uring_reap(group);
+		group->stat.spins++;
+		for (unsigned i = 0; i < group->size && !hit; i++)
+			hit = group->poll_fd[i].revents & POLLIN;
+		now = now_ns();
+	}
+	spin_done(group, hit, start, now);
+	return hit;
+}
+
+static int poll_group_next_uring(struct poll_group_t *group, int *fd)
+{
+	int rc;
+	struct poll_uring_t *uring = group->uring;
+
+	do {
+		for (; group->index < group->size; ++group->index) {
+			if (group->poll_fd[group->index].revents & POLLIN) {
+				*fd = group->poll_fd[group->index].fd;
+				group->poll_fd[group->index].revents = 0;
+				ready(group);
+				return 0;
+			}
+		}
+		if (uring->pending) {
+			uring->pending = 0;
+			group->index = 0;
+			continue;
+		}
+		// everything found was handed out and handled, arm each poll that ended: one-shot polls,
+		// multishot polls the kernel ended without IORING_CQE_F_MORE, and polls that failed
+		for (unsigned i = 0; i < group->size; i++) {
+			if (uring->armed[i] == 0)
+				uring_arm(group, i);
+		}
+		if (uring_spin(group)) {
+			group->index = 0;
+			continue;
+		}
+		// queued writes, new polls and the wait go in one syscall
+		uring_emit_writes(group);
+		rc = uring_submit(group, 1);
+		if (rc != 0)
+			return rc;
+		uring_reap(group);
+		group->index = 0;
+	} while (1);
+}
+
+static int poll_spin(struct poll_group_t *group)
+{
+	int rc = 0;
+	int64_t start = now_ns();
+	int64_t now = start;
+	int64_t deadline = spin_deadline(group, now);
+	if (deadline == 0)
+		return 0;
+	while (rc == 0 && now < deadline) {
+		rc = poll(group->poll_fd, group->size, 0);
+		group->stat.spins++;
+		group->stat.syscalls++;
+		now = now_ns();
+	}
+	spin_done(group, rc > 0, start, now);
+	// errors are left to the blocking poll
+	return rc > 0;
+}
+
 int poll_group_next(struct poll_group_t *group, int *fd)
 {
 	int rc = 0;
+	if (group->uring)
+		return poll_group_next_uring(group, fd);
 	do {
 		for (; group->index < group->size; ++group->index) {
 			if (group->poll_fd[group->index].revents & POLLIN) {
 				*fd = group->poll_fd[group->index].fd;
 				group->poll_fd[group->index].revents = 0;
+				ready(group);
 				return 0;
 			}
 		}
+		if (poll_spin(group)) {
+			group->index = 0;
+			continue;
+		}
 		rc = poll(group->poll_fd, group->size, -1);
+		group->stat.waits++;
+		group->stat.syscalls++;
 		if (rc < 0)
 			break;
 		group->index = 0;
 	} while (1);
 	return errno;
-}
\ No newline at end of file
+}
@@ -1,20 +1,56 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 
 struct pollfd;
 struct input_event;
 struct libevdev;
 struct libevdev_uinput;
+struct poll_uring_t;
 
+struct poll_group_stat_t {
+	uint64_t waits;		// poll(2) or io_uring_enter(2) calls that waited
+	uint64_t syscalls;	// all of the above, plus submissions without waiting
+	uint64_t sqes;
+	uint64_t cqes;
+	uint64_t writes;	// batched writes, io_uring only
+	uint64_t write_errors;
+	uint64_t spins;		// non-blocking checks while busy polling
+	uint64_t spin_hits;	// busy polls that ended with an fd ready
+	uint64_t spin_ns;	// time spent busy polling
+};
 
 struct poll_group_t {
 	unsigned size;
 	unsigned capacity;
 	unsigned index;
 	struct pollfd *poll_fd;
+	// per entry of poll_fd, added by poll_group_add_drained()
+	uint8_t *drained;
+	// io_uring backend, NULL when poll(2) is used
+	struct poll_uring_t *uring;
+	struct poll_group_stat_t stat;
+	// busy polling after activity, the window adapts between spin_max / 16 and spin_max, 0 is off
+	int64_t spin_max;
+	int64_t spin_window;
+	int64_t last_ready;
 };
 
 int poll_group_init(struct poll_group_t *group);
 void poll_group_cleanup(struct poll_group_t *group);
 int poll_group_add(struct poll_group_t *group, int fd);
+// for an fd whose handler reads until EAGAIN or calls poll_group_pending(), io_uring then
+// keeps one multishot poll armed on it instead of arming a one-shot poll after every wakeup
+int poll_group_add_drained(struct poll_group_t *group, int fd);
 int poll_group_del(struct poll_group_t *group, int fd);
+// fd was left readable, it is returned again without waiting for more input
+void poll_group_pending(struct poll_group_t *group, int fd);
 int poll_group_next(struct poll_group_t *group, int *fd);
+// switches the group to io_uring, the group stays on poll(2) on failure
+int poll_group_use_uring(struct poll_group_t *group);
+// spins on non-blocking checks for up to us after an fd was ready, before blocking
+void poll_group_set_spin(struct poll_group_t *group, unsigned us);
+// with io_uring, writes are queued and submitted together with the next wait, returns 0 or -errno
+int poll_group_write(struct poll_group_t *group, int fd, const void *buf, size_t len);
+// waits until queued writes are done, before the fd is closed
+void poll_group_flush(struct poll_group_t *group);
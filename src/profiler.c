@@ -0,0 +1,85 @@
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct profiler_t *profiler_create(void)
+{
+	return (struct profiler_t *)calloc(1, sizeof(struct profiler_t));
+}
+
+void profiler_destroy(struct profiler_t *prof)
+{
+	if (prof == NULL)
+		return;
+	profiler_reset(prof);
+	free(prof);
+}
+
+void profiler_set_rate(struct profiler_t *prof, unsigned rate)
+{
+	prof->rate = rate;
+	prof->period = rate ? 1000000000LL / rate : 0;
+	prof->next = 0;
+}
+
+void profiler_reset(struct profiler_t *prof)
+{
+	for (unsigned i = 0; i < PROFILER_TABLE_SIZE; i++) {
+		free(prof->table[i].stack);
+		prof->table[i].stack = NULL;
+		prof->table[i].count = 0;
+	}
+	prof->used = 0;
+	prof->samples = 0;
+	prof->lost = 0;
+}
+
+// FNV-1a
+static inline uint64_t stack_hash(const char *stack)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (*stack) {
+		hash ^= (unsigned char)*stack++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+void profiler_add(struct profiler_t *prof, const char *stack)
+{
+	uint64_t hash = stack_hash(stack);
+	unsigned mask = PROFILER_TABLE_SIZE - 1;
+
+	prof->samples++;
+	for (unsigned i = hash & mask, n = 0; n < PROFILER_TABLE_SIZE; i = (i + 1) & mask, n++) {
+		struct profiler_entry_t *entry = prof->table + i;
+		if (entry->stack == NULL) {
+			// keep a quarter free so probing stays short
+			if (prof->used >= PROFILER_TABLE_SIZE / 4 * 3)
+				break;
+			entry->stack = strdup(stack);
+			if (entry->stack == NULL)
+				break;
+			entry->hash = hash;
+			entry->count = 1;
+			prof->used++;
+			return;
+		}
+		if (entry->hash == hash && 0 == strcmp(entry->stack, stack)) {
+			entry->count++;
+			return;
+		}
+	}
+	prof->lost++;
+}
+
+void profiler_dump(const struct profiler_t *prof, FILE *out)
+{
+	for (unsigned i = 0; i < PROFILER_TABLE_SIZE; i++) {
+		const struct profiler_entry_t *entry = prof->table + i;
+		if (entry->stack)
+			fprintf(out, "%s %llu\n", entry->stack, (unsigned long long)entry->count);
+	}
+	if (prof->lost)
+		fprintf(out, "[lost] %llu\n", (unsigned long long)prof->lost);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+// distinct stacks kept, power of 2
+#define PROFILER_TABLE_SIZE 4096
+// one folded stack, frames joined by ';'
+#define PROFILER_STACK_SIZE 512
+#define PROFILER_MAX_DEPTH 32
+#define PROFILER_DEFAULT_RATE 997
+
+struct profiler_entry_t {
+	uint64_t hash;
+	uint64_t count;
+	char *stack;
+};
+
+struct profiler_t {
+	unsigned rate;
+	int64_t period;		// ns between samples
+	int64_t next;		// time of the next sample
+	uint64_t samples;
+	uint64_t lost;		// samples not recorded, table full
+	unsigned used;
+	struct profiler_entry_t table[PROFILER_TABLE_SIZE];
+};
+
+struct profiler_t *profiler_create(void);
+void profiler_destroy(struct profiler_t *prof);
+void profiler_set_rate(struct profiler_t *prof, unsigned rate);
+void profiler_reset(struct profiler_t *prof);
+void profiler_add(struct profiler_t *prof, const char *stack);
+void profiler_dump(const struct profiler_t *prof, FILE *out);
@@ -0,0 +1,81 @@
+#include "recorder.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	while (len) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int recorder_dump(const struct recorder_t *rec, int fd)
+{
+	int rc;
+	struct timespec ts;
+	uint64_t head = rec->head;
+	uint64_t count = head < RECORDER_SIZE ? head : RECORDER_SIZE;
+	unsigned start = (head - count) & (RECORDER_SIZE - 1);
+	struct recorder_header_t header = {
+		.version = RECORDER_VERSION,
+		.entry_size = sizeof(struct recorder_entry_t),
+		.count = (uint32_t)count,
+	};
+
+	memcpy(header.magic, RECORDER_MAGIC, sizeof(header.magic));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	header.time = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rc = write_all(fd, &header, sizeof(header));
+	if (rc != 0)
+		return rc;
+
+	// oldest first, the ring wraps at most once
+	if (start + count > RECORDER_SIZE) {
+		rc = write_all(fd, rec->entry + start, (RECORDER_SIZE - start) * sizeof(struct recorder_entry_t));
+		if (rc != 0)
+			return rc;
+		count -= RECORDER_SIZE - start;
+		start = 0;
+	}
+	return write_all(fd, rec->entry + start, count * sizeof(struct recorder_entry_t));
+}
+
+int recorder_save(const struct recorder_t *rec, const char *path)
+{
+	int rc;
+	int fd;
+	char tmp[PATH_MAX];
+	size_t len = strlen(path);
+
+	// a new file next to it, renamed into place: nothing that was there is written through
+	if (len + sizeof(RECORDER_TMP_SUFFIX) > sizeof(tmp))
+		return ENAMETOOLONG;
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, RECORDER_TMP_SUFFIX, sizeof(RECORDER_TMP_SUFFIX));
+	// left over by a dump that was cut short, fails if it is not ours to remove
+	unlink(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return errno;
+	rc = recorder_dump(rec, fd);
+	close(fd);
+	if (rc == 0 && rename(tmp, path) != 0)
+		rc = errno;
+	if (rc != 0)
+		unlink(tmp);
+	return rc;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// entries kept, power of 2
+#define RECORDER_SIZE 8192
+#define RECORDER_MAGIC "LKFR"
+#define RECORDER_VERSION 1
+// dumps are written to the path with this appended, then renamed
+#define RECORDER_TMP_SUFFIX ".tmp"
+
+enum {
+	RECORDER_READ = 1,	// event read from an evdev
+	RECORDER_DISPATCH,	// Lua handler called, value is events queued
+	RECORDER_RETURN,	// Lua handler returned, value is rc, extra is time in us
+	RECORDER_WRITE,		// event written to a uinput device
+	RECORDER_HOTPLUG,	// code is 1 for add, 0 for del, value is the eventN number
+	RECORDER_ERROR,		// value is rc or -errno
+};
+
+struct recorder_entry_t {
+	int64_t time;
+	uint8_t kind;
+	uint8_t type;
+	uint16_t code;
+	int32_t fd;
+	int32_t value;
+	int32_t extra;
+};
+
+// file layout: header, then count entries oldest first
+struct recorder_header_t {
+	char magic[4];
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;
+	uint32_t reserved;
+	int64_t time;
+};
+
+struct recorder_t {
+	uint64_t head;
+	// monotonic ns, taken once per wakeup and shared by its entries
+	int64_t now;
+	// automatic dumps go here
+	const char *path;
+	struct recorder_entry_t entry[RECORDER_SIZE];
+};
+
+static inline void recorder_log(struct recorder_t *rec, unsigned kind, int fd, unsigned type, unsigned code, int value, int extra)
+{
+	struct recorder_entry_t *entry;
+	if (rec == NULL)
+		return;
+	entry = rec->entry + (rec->head++ & (RECORDER_SIZE - 1));
+	entry->time = rec->now;
+	entry->kind = kind;
+	entry->type = type;
+	entry->code = code;
+	entry->fd = fd;
+	entry->value = value;
+	entry->extra = extra;
+}
+
+// both only use async-signal-safe calls
+int recorder_dump(const struct recorder_t *rec, int fd);
+int recorder_save(const struct recorder_t *rec, const char *path);
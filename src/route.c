@@ -0,0 +1,50 @@
+#include "route.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// codes per type, types without codes cannot be routed
+static const unsigned route_code_count[EV_CNT] = {
+	[EV_KEY] = KEY_CNT,
+	[EV_REL] = REL_CNT,
+	[EV_ABS] = ABS_CNT,
+	[EV_MSC] = MSC_CNT,
+	[EV_SW] = SW_CNT,
+	[EV_LED] = LED_CNT,
+	[EV_SND] = SND_CNT,
+};
+
+struct route_stage_t *route_stage_create(void)
+{
+	return (struct route_stage_t *)calloc(1, sizeof(struct route_stage_t));
+}
+
+void route_stage_destroy(struct route_stage_t *stage)
+{
+	if (stage == NULL)
+		return;
+	for (unsigned i = 0; i < EV_CNT; i++)
+		free(stage->map[i]);
+	free(stage);
+}
+
+int route_stage_set(struct route_stage_t *stage, unsigned sink, int type, int code)
+{
+	unsigned count;
+	if (type < 0 || type >= EV_CNT || route_code_count[type] == 0 || sink >= stage->sink_count)
+		return EINVAL;
+	count = route_code_count[type];
+	if (code >= (int)count)
+		return EINVAL;
+	if (stage->map[type] == NULL) {
+		stage->map[type] = (uint8_t *)calloc(count, 1);
+		if (stage->map[type] == NULL)
+			return ENOMEM;
+		stage->map_size[type] = count;
+	}
+	if (code < 0)
+		memset(stage->map[type], sink + 1, count);
+	else
+		stage->map[type][code] = sink + 1;
+	return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+// sinks of one source
+#define ROUTE_SINK_MAX 8
+// events buffered per sink before a write, SYN_REPORT included
+#define ROUTE_FRAME_MAX 64
+
+struct route_sink_t {
+	void *sink;
+	int ref;
+	// the sink has seen events of the frame being read
+	int pending;
+	unsigned count;
+	uint64_t events;
+	uint64_t writes;
+	struct input_event frame[ROUTE_FRAME_MAX];
+};
+
+struct route_stage_t {
+	unsigned sink_count;
+	// 1 based sink index per code of a type, 0 for the normal path, allocated per type
+	uint8_t *map[EV_CNT];
+	uint16_t map_size[EV_CNT];
+	struct route_sink_t sink[ROUTE_SINK_MAX];
+};
+
+struct route_stage_t *route_stage_create(void);
+void route_stage_destroy(struct route_stage_t *stage);
+// code -1 routes all codes of the type, returns 0 or errno
+int route_stage_set(struct route_stage_t *stage, unsigned sink, int type, int code);
+
+static inline struct route_sink_t *route_stage_lookup(const struct route_stage_t *stage, const struct input_event *ev)
+{
+	const uint8_t *map;
+	if (ev->type >= EV_CNT || ev->code >= stage->map_size[ev->type])
+		return NULL;
+	map = stage->map[ev->type];
+	if (map[ev->code] == 0)
+		return NULL;
+	return (struct route_sink_t *)stage->sink + map[ev->code] - 1;
+}
+
+// buffers the event, returns 1 when the buffer must be written before the next one
+static inline int route_sink_push(struct route_sink_t *sink, const struct input_event *ev)
+{
+	sink->frame[sink->count++] = *ev;
+	sink->pending = 1;
+	sink->events++;
+	return sink->count == ROUTE_FRAME_MAX - 1;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "uevent.h"
+#include "monitor.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define UDEV_PREFIX "libudev"
+#define UDEV_MAGIC 0xfeedcafe
+
+// header of messages sent by udev, see udev_monitor_send_device() in libudev
+struct udev_header_t {
+	char prefix[8];
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t properties_off;
+	uint32_t properties_len;
+	uint32_t filter_subsystem_hash;
+	uint32_t filter_devtype_hash;
+	uint32_t filter_tag_bloom_hi;
+	uint32_t filter_tag_bloom_lo;
+};
+
+int uevent_monitor_init(struct uevent_monitor_t *monitor, int source)
+{
+	int on = 1;
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = source,
+	};
+
+	memset(monitor, 0, sizeof(struct uevent_monitor_t));
+	monitor->source = source;
+	monitor->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (monitor->fd < 0)
+		return errno;
+	// credentials tell messages of the kernel and of root from anyone else's
+	if (setsockopt(monitor->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0 ||
+	    bind(monitor->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int rc = errno;
+		close(monitor->fd);
+		monitor->fd = -1;
+		return rc;
+	}
+	return 0;
+}
+
+void uevent_monitor_cleanup(struct uevent_monitor_t *monitor)
+{
+	close(monitor->fd);
+	monitor->fd = -1;
+}
+
+const char *uevent_get(const struct uevent_t *ev, const char *key)
+{
+	for (unsigned i = 0; i < ev->count; i++) {
+		if (0 == strcmp(ev->key[i], key))
+			return ev->value[i];
+	}
+	return NULL;
+}
+
+int uevent_parse(char *buf, size_t len, struct uevent_t *ev)
+{
+	char *p;
+	char *end = buf + len;
+	const char *action;
+	const char *devname;
+	const struct udev_header_t *header = (const struct udev_header_t *)buf;
+
+	memset(ev, 0, sizeof(struct uevent_t));
+	if (len >= sizeof(struct udev_header_t) && 0 == memcmp(header->prefix, UDEV_PREFIX, sizeof(UDEV_PREFIX)) &&
+	    ntohl(header->magic) == UDEV_MAGIC) {
+		// in size_t, the sum of two untrusted uint32_t could wrap
+		size_t off = header->properties_off;
+		size_t plen = header->properties_len;
+		if (off < sizeof(struct udev_header_t) || off > len || plen > len - off)
+			return EINVAL;
+		p = buf + off;
+		end = p + plen;
+	} else {
+		// kernel messages start with action@devpath, the same is repeated in properties
+		p = memchr(buf, 0, len);
+		if (p == NULL || memchr(buf, '@', p - buf) == NULL)
+			return EINVAL;
+		p++;
+	}
+	*end = 0;
+
+	while (p < end && ev->count < UEVENT_PROPERTY_MAX) {
+		char *eq;
+		size_t n = strlen(p);
+		eq = memchr(p, '=', n);
+		if (eq) {
+			*eq = 0;
+			ev->key[ev->count] = p;
+			ev->value[ev->count] = eq + 1;
+			ev->count++;
+		}
+		p += n + 1;
+	}
+
+	action = uevent_get(ev, "ACTION");
+	ev->devpath = uevent_get(ev, "DEVPATH");
+	ev->subsystem = uevent_get(ev, "SUBSYSTEM");
+	if (action == NULL || ev->devpath == NULL || ev->subsystem == NULL)
+		return EINVAL;
+	if (0 == strcmp(action, "add"))
+		ev->action = DEVICE_MONITOR_EVENT_ADD;
+	else if (0 == strcmp(action, "remove"))
+		ev->action = DEVICE_MONITOR_EVENT_DEL;
+
+	// "input/event3" from the kernel, "/dev/input/event3" from udev
+	devname = uevent_get(ev, "DEVNAME");
+	if (devname) {
+		const char *slash = strrchr(devname, '/');
+		if (slash && slash - devname >= 5 && 0 == strncmp(slash - 5, "input", 5))
+			ev->name = slash + 1;
+	}
+	return 0;
+}
+
+int uevent_accept(const struct uevent_t *ev)
+{
+	return ev->action && ev->name && ev->name[0] && 0 == strcmp(ev->subsystem, "input");
+}
+
+// kernel messages come from port 0, udev ones from a root process
+static int uevent_trusted(const struct uevent_monitor_t *monitor, const struct msghdr *msg)
+{
+	const struct sockaddr_nl *addr = (const struct sockaddr_nl *)msg->msg_name;
+	const struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	const struct ucred *cred;
+
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+		return 0;
+	cred = (const struct ucred *)CMSG_DATA(cmsg);
+	if (cred->uid != 0)
+		return 0;
+	if (monitor->source == UEVENT_SOURCE_KERNEL)
+		return addr->nl_pid == 0 && addr->nl_groups == UEVENT_SOURCE_KERNEL;
+	return addr->nl_groups == UEVENT_SOURCE_UDEV;
+}
+
+int uevent_monitor_next(struct uevent_monitor_t *monitor, struct uevent_t *ev)
+{
+	while (1) {
+		ssize_t len;
+		struct sockaddr_nl addr;
+		char control[CMSG_SPACE(sizeof(struct ucred))];
+		struct iovec iov = {
+			.iov_base = monitor->buffer,
+			.iov_len = UEVENT_BUFFER_SIZE,
+		};
+		struct msghdr msg = {
+			.msg_name = &addr,
+			.msg_namelen = sizeof(addr),
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+
+		len = recvmsg(monitor->fd, &msg, 0);
+		if (len < 0)
+			return errno;
+		monitor->received++;
+		if ((msg.msg_flags & MSG_TRUNC) || !uevent_trusted(monitor, &msg) ||
+		    uevent_parse(monitor->buffer, len, ev) != 0 || !uevent_accept(ev)) {
+			monitor->ignored++;
+			continue;
+		}
+		monitor->reported++;
+		return 0;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define UEVENT_BUFFER_SIZE 8192
+#define UEVENT_PROPERTY_MAX 64
+
+// netlink multicast groups, the udev one carries events after its rules ran
+enum {
+	UEVENT_SOURCE_KERNEL = 1,
+	UEVENT_SOURCE_UDEV = 2,
+};
+
+// one message parsed in place, the strings point into the buffer it came from
+struct uevent_t {
+	// DEVICE_MONITOR_EVENT_ADD or DEVICE_MONITOR_EVENT_DEL, 0 for other actions
+	int action;
+	const char *devpath;
+	const char *subsystem;
+	// node name below /dev/input, such as "event3"
+	const char *name;
+	unsigned count;
+	const char *key[UEVENT_PROPERTY_MAX];
+	const char *value[UEVENT_PROPERTY_MAX];
+};
+
+struct uevent_monitor_t {
+	int fd;
+	int source;
+	uint64_t received;
+	uint64_t reported;
+	uint64_t ignored;
+	char buffer[UEVENT_BUFFER_SIZE + 1];
+};
+
+int uevent_monitor_init(struct uevent_monitor_t *monitor, int source);
+void uevent_monitor_cleanup(struct uevent_monitor_t *monitor);
+// next add or del of an input node that is ready to open, returns 0, EAGAIN when drained, or errno
+int uevent_monitor_next(struct uevent_monitor_t *monitor, struct uevent_t *ev);
+
+// kernel "action@devpath" or udev format, the buffer must hold a NUL after len, returns 0 or EINVAL
+int uevent_parse(char *buf, size_t len, struct uevent_t *ev);
+// an add or del of a node below /dev/input
+int uevent_accept(const struct uevent_t *ev);
+const char *uevent_get(const struct uevent_t *ev, const char *key);
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int uring_init(struct uring_t *ring, unsigned entries)
+{
+	int rc;
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(struct uring_t));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return errno;
+	// one mmap for both rings, and no copy of SQEs at submission, since 5.4 and 5.5
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_SUBMIT_STABLE)) {
+		close(ring->fd);
+		return ENOSYS;
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		rc = errno;
+		goto err;
+	}
+	ring->cq_ring = ring->sq_ring;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		rc = errno;
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto err;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+	return 0;
+err:
+	close(ring->fd);
+	return rc;
+}
+
+void uring_cleanup(struct uring_t *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	unsigned index;
+
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+	index = tail & *ring->sq_mask;
+	sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	// published right away, the kernel only looks at it on io_uring_enter
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+unsigned uring_sq_space(const struct uring_t *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return ring->sq_entries - (*ring->sq_tail - head);
+}
+
+int uring_enter(struct uring_t *ring, unsigned wait_nr)
+{
+	int rc;
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	if (ring->to_submit == 0 && wait_nr == 0)
+		return 0;
+	ring->enters++;
+	rc = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags, NULL, 0);
+	if (rc < 0)
+		return errno;
+	ring->sqes_submitted += rc;
+	ring->to_submit -= rc;
+	return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return ring->cqes + (head & *ring->cq_mask);
+}
+
+void uring_cqe_seen(struct uring_t *ring)
+{
+	ring->cqes_reaped++;
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// minimal io_uring on raw syscalls, single threaded
+struct uring_t {
+	int fd;
+	unsigned sq_entries;
+	unsigned cq_entries;
+	// pending SQEs not yet passed to the kernel
+	unsigned to_submit;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	uint64_t enters;
+	uint64_t sqes_submitted;
+	uint64_t cqes_reaped;
+};
+
+int uring_init(struct uring_t *ring, unsigned entries);
+void uring_cleanup(struct uring_t *ring);
+// NULL when the submission queue is full, submit first
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+// free SQE slots, a linked chain must fit without a submission in between
+unsigned uring_sq_space(const struct uring_t *ring);
+// submits pending SQEs, and waits for at least wait_nr completions
+int uring_enter(struct uring_t *ring, unsigned wait_nr);
+// returns the next completion or NULL, uring_cqe_seen() hands its slot back
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring);
+void uring_cqe_seen(struct uring_t *ring);